@@ -1,4 +1,4 @@
-const int README_SIZE = 2709;
+const int README_SIZE = 21202;
 const unsigned char *README = 
 "# spconnect\n\nConnects to a serial port from a Windows Terminal/Console.\nCopyright 2024 David Atkinson. MIT License. "
 "\nAvailable from https://github.com/david47k/spconnect/\n\n## About\n\nThis program connects to a serial port from a Win"
@@ -6,21 +6,178 @@ const unsigned char *README =
 "to e.g. PuTTY. It is tested on (and designed to work on) Windows 10.\n\n## Using the program\n\n### Configuring the seri"
 "al port\n\nYou can specify baud rate and 8 data bits, no parity, 1 stop bit, by using the\n`-c` option. e.g.:\n\n`spconn"
 "ect com1 -c 9600`\n\nCommon baud rates: 300, 1200, 2400, 4800, 9600, 19200, 38400, 57600,\n115200, 230400, 460800, 92160"
-"0.\n\nFor more complicated configuration, you can specify baud rate etc. by first\nusing the windows built-in `mode` com"
-"mand. e.g.:\n\n`mode com1 baud=115200 parity=n data=8 stop=1 to=off xon=off odsr=off octs=off dtr=on rts=on`\n\nor\n\n`m"
-"ode com1 115200,n,8,1`\n\nRunning `mode` by itself will give you a list of serial ports. \n\n### Starting the program\n"
-"\nStart this program with the serial port as an argument, along with any options. \ne.g.:\n\n`spconnect com1 -w 10000`\n"
-"\n### Options\n\n```\n  -h       --help               Full documentation.\n  -l       --local-echo         Enable local "
-"echo of characters typed.\n  -s       --system-codepage    Use system codepage instead of UTF-8.\n  -r       --replace-c"
-"r         Replace input CR (\\r) with newline (\\n).\n  -d       --disable-vt         Disable virtual terminal (VT) code"
-"s.\n  -c 9600  --configure-port     Configure the port with given baud rate, 8N1.\n  -w 100   --write-timeout 100  Seria"
-"l port write timeout, in ms. Default 1000.\n```\n\n### Quitting\n\nUse `Ctrl-F10` to quit.\n\n### Using a different code"
-"page\n\nThe default is to use UTF-8 for console input and output. You can use the system\ncodepage instead by using the "
-"`-s` option. You can check the system codepage \nand change it using the the windows built-in `mode con cp` command. e.g"
-".:\n\n`mode con cp select=1251`\n\n### Disable VT processing (raw mode)\n\nThe default is to process VT commands from bo"
-"th the keyboard and the serial \nport. You can disable VT processing (essentially a raw mode) using `-d`.\n\n## Similar "
-"programs\n\n- [https://github.com/fasteddy516/SimplySerial](SimpleSerial) (C#, MIT license)\n- [https://github.com/YaSue"
-"nag/SimpleCom](SimpleCom) (C++, GPLv2 license)\n- [https://github.com/Dasors/comPST/tree/main](comPST) (PowerShell)\n- ["
-"https://github.com/airbornesurfer/windows-serial-terminal](windows-serial-terminal) (Python)\n- [https://github.com/welt"
-"ling/convey](convey) (C++). Works with named pipes too.\n- [https://github.com/itas109/CommLite](CommLine) (C++). Serial"
-" port tool, TUI, multi-platform.\n";
+"0. Any other rate the driver accepts works too,\ne.g. 250000 or 3000000 on most USB adapters.\n\n`-c` also takes the res"
+"t of the line settings, separated by commas: data bits,\nparity (`n`, `o`, `e`, `m`, `s`) and stop bits (`1`, `1.5`, `2`"
+"), either as\nseparate fields or run together, followed by any of:\n\n    rtscts      RTS/CTS hardware flow control\n   "
+" dtrdsr      DTR/DSR hardware flow control\n    xonxoff     XON/XOFF software flow control\n    none        no flow cont"
+"rol\n    xonlim=N    send XON / raise RTS when the input buffer drops to N bytes\n    xofflim=N   send XOFF / drop RTS w"
+"hen the input buffer has N bytes free\n\ne.g.:\n\n`spconnect com1 -c 3000000,8,n,1,rtscts`  \n`spconnect com1 -c 57600,7"
+"e1,xonxoff`\n\nEverything is applied in a single call, so the port never runs with half of the\nnew settings. Flow contr"
+"ol is left as the driver has it unless you give one of\nthe keywords. Above 460800 baud the receive buffer can overflow "
+"between reads\nwithout hardware flow control, so you get a warning if RTS/CTS is off.\n\nIf you don\'t know the baud rat"
+"e, `--autobaud` listens at each of the common\nrates in turn, for about 64 characters\' worth of time (a quarter to one"
+"\nsecond), and stays at the one where what arrives looks most like text:\nprintable, valid UTF-8, and without framing er"
+"rors. It prints the score for\neach rate as it goes. The device has to be sending something, e.g. a boot log,\nso start "
+"spconnect and then reset the board. The rest of `-c` (data bits, parity,\nflow control) is kept. e.g.:\n\n`spconnect com"
+"1 --autobaud`\n\nA port can also carry its own settings after a colon, which take precedence\nover `-c`, e.g. `spconnect"
+" com3:921600,rtscts com4:9600`.\n\nFor more complicated configuration, you can specify baud rate etc. by first\nusing th"
+"e windows built-in `mode` command. e.g.:\n\n`mode com1 baud=115200 parity=n data=8 stop=1 to=off xon=off odsr=off octs=o"
+"ff dtr=on rts=on`\n\nor\n\n`mode com1 115200,n,8,1`\n\nRunning `mode` by itself will give you a list of serial ports. \n"
+"\n### Starting the program\n\nStart this program with the serial port as an argument, along with any options. \ne.g.:\n"
+"\n`spconnect com1 -w 10000`\n\n### Options\n\n```\n  -h       --help               Full documentation.\n  -l       --loc"
+"al-echo         Enable local echo of characters typed.\n  -s       --system-codepage    Use system codepage instead of U"
+"TF-8.\n  -r       --replace-cr         Replace input CR (\\r) with newline (\\n).\n  -d       --disable-vt         Disab"
+"le virtual terminal (VT) codes.\n  -c 9600  --configure-port     Configure the port, e.g. 9600 or 3000000,8,n,1,rtscts."
+"\n           --autobaud           Find the baud rate by listening at each common rate.\n  -w 100   --write-timeout 100  "
+"Serial port write timeout, in ms. Default 1000.\n  -x       --hex-dump           Show data in both directions as a hex d"
+"ump.\n  -k       --hotkey quit=f12    Set the key for a hotkey action.\n           --char-delay 5       Delay after each"
+" character sent, in ms.\n           --line-delay 50      Delay after each line sent, in ms.\n           --send-file FILE"
+"     Send FILE to the port. Ctrl-F8 sends a file during a session.\n           --send-rate 1000     Limit the rate a fil"
+"e is sent at, in bytes per second.\n           --send-prompt \"> \"   Wait for the device to send a prompt after each li"
+"ne of a file.\n           --upload FILE        Upload FILE with X/Y/ZMODEM. Ctrl-F6 uploads during a session.\n         "
+"  --download DIR       Download with X/Y/ZMODEM (to a file for XMODEM). Ctrl-F7 during a session.\n           --protocol"
+" zmodem    Transfer protocol: xmodem, xmodem-1k, ymodem or zmodem. Default zmodem.\n           --resume             Resu"
+"me an interrupted ZMODEM transfer.\n           --transfer-test 1    Send a 1 MB file with each protocol through a named "
+"pipe, and check it.\n           --log FILE           Append everything received to FILE.\n           --log-sent         "
+"  Also log everything sent.\n           --capture FILE       Capture everything sent and received to FILE, with timestam"
+"ps.\n           --dump FILE          Print capture FILE as text.\n           --from 3600          With --dump, start thi"
+"s many seconds into the capture.\n           --spill-size 256     Spill file size for received data, in MB. Default 256."
+"\n           --max-fps 60         Limit console writes of received data per second. 0 for none.\n           --ring-size "
+"64       Size of the buffers between threads, in KB. Default 64.\n           --stats              Print statistics on ex"
+"it.\n           --stats-file FILE    Append statistics to FILE as JSON on exit and on Ctrl-Break.\n           --latency "
+"           Measure latency through the program. Ctrl-F9 prints it.\n           --loopback-test 10   Send 10 MB through a"
+" looped-back port and check it.\n           --low-latency        Tune the port for round trips: small driver queues, 1 m"
+"s FTDI latency timer.\n           --rtt-test 1000      Time 1000 round trips through a looped-back port.\n           --n"
+"o-reconnect       Exit if a port goes away, rather than waiting for it to come back.\n           --reconnect-test 3   Un"
+"plug a stand-in device 3 times, and check the port comes back each time.\n           --daemon DIR         Log every port"
+" to its own files in DIR, without a console.\n           --segment-size 64    Start a new daemon log file after this man"
+"y MB. Default 64.\n           --silence 60         Note in the daemon log when a port is silent for this many seconds.\n"
+"           --daemon-bench 100   Benchmark daemon mode with 100 named pipes in place of ports.\n           --bench-rate 1"
+"000    Total data rate for --daemon-bench, in KB/s. Default 1000.\n           --serve 7000         Share the port over T"
+"CP on [address:]port, with no console.\n           --rfc2217            Serve with RFC 2217, so clients can set the baud"
+" rate etc.\n           --linger 1000        In pipe mode, exit once input has ended and the port is quiet for this long,"
+" in ms.\n           --pipe-bench 100     Benchmark pipe mode with 100 MB through a pipeline.\n           --hex-bench 100"
+"      Benchmark the hex dump formatter with 100 MB.\n```\n\n### Write timeout\n\nIf a write to the serial port times out"
+" (`-w`, e.g. the device is holding off\nwith flow control), the unsent data stays queued and is retried. While the port"
+"\nisn\'t taking data, what you type is queued too, up to a limit.\n\n### Pasting\n\nLarge pastes are read from the conso"
+"le in big blocks, but only as fast as the\nserial port takes them, so nothing is dropped. Progress and speed are shown i"
+"n\nthe title bar until the paste has been sent. A paste is recognised by a burst\nof input, or by bracketed paste marker"
+"s if the device has turned them on.\n\nSome devices can\'t take a paste at full speed. `--char-delay` waits after each\n"
+"character sent, and `--line-delay` after each line, e.g.:\n\n`spconnect com1 --line-delay 50`\n\n### Sending a file\n\n`"
+"--send-file config.txt` sends a file to the port when the session starts.\nDuring a session, press `Ctrl-F8` and type a "
+"file name to send one (press it\nagain to cancel). The file is sent as is, as fast as the port takes it, and\nspconnect "
+"reports the speed achieved against the most the baud rate allows.\nAnything you type meanwhile is sent after the file.\n"
+"\nTo pace the file, use `--send-rate` (bytes per second), `--line-delay`, or\n`--send-prompt` to wait for the device\'s "
+"prompt after each line, e.g.:\n\n`spconnect com1 --send-file script.txt --send-prompt \"> \"`\n\n### File transfers (XMO"
+"DEM, YMODEM, ZMODEM)\n\nspconnect can upload and download files with XMODEM, YMODEM or ZMODEM, e.g. to\na bootloader, wi"
+"thout leaving the session. Press `Ctrl-F6` to upload a file or\n`Ctrl-F7` to download, or use `--upload` and `--download"
+"` to start a transfer\nwhen spconnect connects. `--protocol` picks the protocol (ZMODEM by default).\nPress `Esc` to can"
+"cel a transfer. e.g.:\n\n`spconnect com1 -c 115200 --protocol xmodem-1k --upload firmware.bin`\n\nYMODEM and ZMODEM down"
+"loads are saved in the given directory (the current\ndirectory if none is given) under the names the sender gives them. "
+"An XMODEM\ndownload is saved to the given file. ZMODEM streams the data without waiting for\neach block to be acknowledg"
+"ed, so it runs close to the speed of the line. An\ninterrupted ZMODEM transfer can carry on from where it stopped with `"
+"--resume`\n(or `sz -r` at the other end). YMODEM and ZMODEM can\'t send files of 4 GB or\nmore, as their sizes and file "
+"positions are 32-bit.\n\n`--transfer-test 1` checks the protocols against each other, with no serial\nport: it sends a f"
+"ile of just over 1 MB with each protocol from one end of a\nnamed pipe to the other, then ZMODEM again with half the fil"
+"e already there to\ntest resuming, and checks that each copy matches. It reports each run, and\nexits with an error if a"
+"ny failed.\n\n### Connecting to a named pipe\n\nThe port can also be a named pipe, such as the COM port of a Hyper-V vir"
+"tual\nmachine. This is handy for testing without any serial hardware. e.g.:\n\n`spconnect \\\\.\\pipe\\com1`\n\nPort con"
+"figuration (`-c`) and the write timeout (`-w`) don\'t apply to pipes.\n\n### Using spconnect in a pipeline\n\nWhen stdin"
+" or stdout isn\'t a console, spconnect runs in pipe mode. Bytes pass\nbetween the pipes and the port exactly as they are"
+", in large blocks and at full\nspeed, with none of the console handling (hotkeys, hex dump, logging and so on).\ne.g.:\n"
+"\n`spconnect com3 -c 115200 | findstr ERROR`\n\n`type commands.txt | spconnect com3 > replies.txt`\n\nOnce the input has"
+" ended and all of it has been sent, spconnect waits for the\nport to be quiet for a second (`--linger` sets how long, in"
+" ms) and exits. It\nalso stops when the program it\'s writing to exits, or on `Ctrl-C`. Pipe mode\ntakes one port. The t"
+"ests (`--loopback-test`, `--rtt-test`, `--transfer-test`)\nand `--upload`, `--download` and `--send-file` need the conso"
+"le, and refuse to\nrun with stdin or stdout redirected.\n\n`--pipe-bench 100` measures pipe mode: it sends 100 MB throug"
+"h a pipeline to a\nnamed pipe that echoes it back, checks it all comes back in order, and reports\nMB/s and CPU use.\n\n"
+"### Several ports at once\n\nGive more than one port to watch them all in the same window, e.g. a device\'s\nconsole and"
+" its debug port. A port can have its own baud rate after a colon;\n`-c` sets it for the rest. e.g.:\n\n`spconnect com3:1"
+"15200 com4:921600`\n\nEach line received is shown whole, tagged with its port (in colour, unless `-d`\nis used), so line"
+"s from different ports never run together. An unfinished line\nis held back until the rest arrives, for up to 100 ms, ex"
+"cept from the port you\nare typing to. Typing goes to the first port. Press `Ctrl-F5` to switch to the\nnext one. File s"
+"ends and transfers go to the port you are typing to. The log\nand capture record the lines as shown, with their tags.\n"
+"\n### Logging\n\n`--log session.txt` appends everything received from the port to\n`session.txt`. Add `--log-sent` to lo"
+"g what you type too. The log is written\nin the background in large blocks, and is flushed when spconnect exits (even on"
+"\nan error).\n\n### When the console can\'t keep up\n\nIf the console falls behind (e.g. while you select text, or durin"
+"g a flood of\noutput), received data queues up in memory. Once that is full it spills to a\ntemporary file, and is shown"
+" as the console catches up. Nothing is lost, and\nthe serial port keeps being read. `--spill-size` sets the size of the "
+"spill\nfile; with `--spill-size 0`, spconnect waits for the console instead.\n\n### When the port goes away\n\nIf a port"
+" disappears during a session (e.g. a USB adapter is unplugged, or\nre-enumerates when the board resets), spconnect says "
+"so and keeps going. The\nscreen, and anything you type meanwhile, are kept. It tries to reopen the port\nafter 0.1 s, th"
+"en waits twice as long after each failed try, up to 5 s. When\nthe port comes back it gets the same settings as before ("
+"from `-c`, or whatever\nit had when spconnect started), anything typed while it was gone is sent, and\nyou\'re told how "
+"long it was gone. `--stats` shows the number of reconnects and\nthe longest outage. Use `--no-reconnect` to exit instead"
+".\n\nData already handed to the driver when the port went away may not have been\nsent. Named pipes aren\'t reopened, an"
+"d nor is the port in pipe mode or server\nmode.\n\n`--reconnect-test 3` checks all this with no serial port: the port is"
+" a named\npipe, and a stand-in device at the other end echoes what it\'s sent. Three times\nover, the device goes away f"
+"or half a second and comes back, and data is queued\nfor the port while it\'s gone. The test checks that the data all co"
+"mes back in\norder, and that the reconnect count and longest outage reported are right.\n\n### Hex dump\n\n`-x` shows ev"
+"erything received (RX) and typed (TX) as a hex dump, 16 bytes per\nrow, with the offset in each direction and an ASCII c"
+"olumn. It also works with\n`--dump`, to show a capture as a hex dump.\n\n`--hex-bench 100` measures the formatter on its"
+" own: it formats 100 MB of test\ndata as a hex dump, without showing it, and reports MB/s and the equivalent\nline rate "
+"in Mbit/s. It should be far above any serial line, so `-x` keeps up\nat full speed.\n\n### Capturing\n\n`--capture sessi"
+"on.cap` records everything sent and received in a compact\nbinary format. Each chunk carries a timestamp, its direction "
+"and its port\n(with several ports, the data is recorded as received, without the tags), and the file\nhas a seek index, "
+"so even very large captures can be navigated quickly. Print\na capture as text with:\n\n`spconnect --dump session.cap`\n"
+"\nTo start part way through, give the number of seconds in with `--from`. The\nindex records sit at every megabyte of th"
+"e file, so spconnect finds the place\nwithout reading everything before it. This works even if the capture wasn\'t\nclos"
+"ed cleanly. e.g.:\n\n`spconnect --dump session.cap --from 3600`\n\n### Measuring latency\n\n`--latency` times every chun"
+"k of data on its way through the program. It\nmeasures keyboard to port (from reading the keyboard to the serial write\n"
+"completing), and port to screen (from the serial read completing to the console\nwrite completing). Press `Ctrl-F9` to p"
+"rint the p50/p99/p99.9 latencies at any\ntime. They are also printed on exit. The histograms have a fixed size, so the\n"
+"probe can be left on for long sessions.\n\n### Statistics\n\nPress `Ctrl-F4` to show a status line in the title bar, upd"
+"ated every second,\nfor the port you are typing to. It shows the current and peak throughput in\neach direction, how muc"
+"h is queued (in the driver, between spconnect\'s threads,\nand spilled), and counts of errors: UART overruns, driver buf"
+"fer overflows,\nframing and parity errors, breaks, write timeouts and short console writes.\nThe UART errors are collect"
+"ed from the driver after each read.\n\n`--stats` prints the same figures when spconnect exits. For scripts and\nmonitori"
+"ng, `--stats-file stats.json` appends them as a line of JSON on exit,\nand `Ctrl-Break` (or another program sending the "
+"console a Ctrl-Break) writes\nthem at any time, to the file if one is given or to the screen if not.\nThey include how o"
+"ften the console and RX threads woke up per second, which\nshould stay near zero while the line and keyboard are idle (a"
+"bout one a second\nwith the status line on).\n\n### Loopback test\n\nWith the port\'s TX wired to its RX (or a peer that"
+" echoes everything back),\n`--loopback-test` floods the port with a known pattern and checks it all comes\nback in order"
+". It reports missing and mismatched bytes, MB/s and CPU use. e.g.:\n\n`spconnect com1 -c 921600 --loopback-test 10 --sta"
+"ts`\n\n### Low latency\n\nReads on the port already return as soon as the first byte arrives, but USB\nserial adapters a"
+"dd their own delay. An FTDI chip holds a short packet back\nuntil its latency timer runs out, 16 ms by default, so a req"
+"uest/response\nexchange can take 20 ms or more whatever the baud rate. `--low-latency`:\n\n- sets the FTDI latency timer"
+" to 1 ms, before the port is opened. This needs\n  administrator rights, as the setting lives in the registry. Without t"
+"hem you\n  get a warning, and can set it yourself in Device Manager (Port Settings,\n  Advanced). The new setting stays "
+"after spconnect exits.\n- asks the driver for small queues, which FTDI drivers take as the USB transfer\n  size. Without"
+" `--low-latency` the queues are made large, to ride out bursts\n  at high baud rates.\n\nTo see the difference, time som"
+"e round trips through a looped-back port (or a\npeer that echoes) with `--rtt-test`, with and without `--low-latency`. e"
+".g.:\n\n`spconnect com1 -c 115200 --rtt-test 1000`  \n`spconnect com1 -c 115200 --rtt-test 1000 --low-latency`\n\nIt pri"
+"nts the p50/p99/p99.9 round-trip times and any probes that didn\'t come\nback within a second.\n\n### Daemon mode\n\n`--"
+"daemon DIR` logs ports without a console, e.g. a rack of devices left\nrunning overnight. Each port is logged to its own"
+" files in `DIR`, named after\nthe port and the time the file was started (e.g. `com3-20240501-120000.log`).\nA new file "
+"is started every `--segment-size` MB. The ports are shared between\na few worker threads, one per CPU core, so hundreds "
+"of ports can be logged at\nonce. e.g.:\n\n`spconnect --daemon logs com3 com4 com5:9600 --silence 60`\n\nIf a port goes a"
+"way (e.g. a USB adapter is unplugged), it\'s noted in the log\nand spconnect tries to open it again every 5 seconds. Wit"
+"h `--silence`, a port\nthat hasn\'t sent anything for that many seconds is noted in its log too. Press\n`Ctrl-C` to stop"
+"; everything received is written out first.\n\n`--daemon-bench 100` measures how much CPU daemon mode needs. It logs 100"
+" named\npipes (in place of serial ports) and feeds them lines of text at `--bench-rate`\nKB/s in total for 10 seconds, t"
+"hen reports the CPU used per port, e.g.:\n\n`spconnect --daemon benchlogs --daemon-bench 100 --bench-rate 2000`\n\n### S"
+"haring a port over the network\n\n`--serve` shares the port over TCP, so others can use a device without a\ndesktop sess"
+"ion on the machine it\'s plugged into. Give a port number to listen\non every interface, or an address and port, e.g.:\n"
+"\n`spconnect com3 -c 115200 --serve 7000`\n\n`spconnect com3 --serve 127.0.0.1:7000 --rfc2217`\n\nBy default the connect"
+"ion is raw: bytes go straight through in both\ndirections, as with `nc` or PuTTY\'s raw mode. With `--rfc2217`, it\'s a "
+"telnet\nconnection with the RFC 2217 com port option, so a client can set the baud\nrate, data bits, parity, stop bits a"
+"nd flow control, and DTR, RTS and break\n(e.g. Python\'s `serial.serial_for_url(\"rfc2217://host:7000\")`).\n\nUp to 8 c"
+"lients can connect at once. The first is in control: what it sends\ngoes to the port, and it alone can change the settin"
+"gs. The others watch\neverything received from the port. When the client in control disconnects, the\none connected long"
+"est takes over. A watching client that can\'t keep up for 5\nseconds is disconnected. Press `Ctrl-C` to stop. A named pi"
+"pe (e.g. from a\nvirtual machine) can be served too, which is handy for testing on one machine.\n\n### Quitting\n\nUse `"
+"Ctrl-F10` to quit.\n\n### Hotkeys\n\nHotkeys are handled by spconnect, and are not sent to the serial port.\n\n```\n  qu"
+"it      Ctrl-F10   Quit.\n  latency   Ctrl-F9    Print latency measurements (with --latency).\n  send-file Ctrl-F8    Se"
+"nd a file, or cancel the one being sent.\n  upload    Ctrl-F6    Upload a file with X/Y/ZMODEM.\n  download  Ctrl-F7    "
+"Download files with X/Y/ZMODEM.\n  next-port Ctrl-F5    Type to the next port (with several ports).\n  status    Ctrl-F4"
+"    Show throughput, queues and errors in the title bar, or stop.\n```\n\nYou can change the key for an action with `-k`"
+", using F1 to F12 with any of\n`ctrl-`, `alt-` and `shift-`, or `none` to disable it. e.g.:\n\n`spconnect com1 -k quit=c"
+"trl-f12 -k latency=none`\n\n### Using a different codepage\n\nThe default is to use UTF-8 for console input and output. "
+"You can use the system\ncodepage instead by using the `-s` option. You can check the system codepage \nand change it usi"
+"ng the the windows built-in `mode con cp` command. e.g.:\n\n`mode con cp select=1251`\n\n### Disable VT processing (raw "
+"mode)\n\nThe default is to process VT commands from both the keyboard and the serial \nport. You can disable VT processi"
+"ng (essentially a raw mode) using `-d`.\n\n## Similar programs\n\n- [https://github.com/fasteddy516/SimplySerial](Simple"
+"Serial) (C#, MIT license)\n- [https://github.com/YaSuenag/SimpleCom](SimpleCom) (C++, GPLv2 license)\n- [https://github."
+"com/Dasors/comPST/tree/main](comPST) (PowerShell)\n- [https://github.com/airbornesurfer/windows-serial-terminal](windows"
+"-serial-terminal) (Python)\n- [https://github.com/weltling/convey](convey) (C++). Works with named pipes too.\n- [https:"
+"//github.com/itas109/CommLite](CommLine) (C++). Serial port tool, TUI, multi-platform.\n";
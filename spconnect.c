@@ -4,8 +4,9 @@
 // Available from https://github.com/david47k/spconnect/
 
 const char* SHORT_HELP_MSG =
-    "Usage: 'spconnect <PORT> [OPTIONS]'\n"
+    "Usage: 'spconnect <PORT> [PORT...] [OPTIONS]'\n"
     "e.g.:  'spconnect com1 -w 100'\n"
+    "       'spconnect com1:115200 com2:9600'\n"
     "\n"
     "Options:\n"
     "  -h       --help               Full documentation.\n"
@@ -13,8 +14,47 @@ const char* SHORT_HELP_MSG =
     "  -s       --system-codepage    Use system codepage instead of UTF-8.\n"
     "  -r       --replace-cr         Replace input CR (\\r) with newline (\\n).\n"
     "  -d       --disable-vt         Disable virtual terminal (VT) codes.\n"
-    "  -c 9600  --configure-port     Configure the port with given baud rate, 8N1.\n"
+    "  -c 9600  --configure-port     Configure the port, e.g. 9600 or 3000000,8,n,1,rtscts.\n"
+    "           --autobaud           Find the baud rate by listening at each common rate.\n"
     "  -w 100   --write-timeout 100  Serial port write timeout, in ms. Default 1000.\n"
+    "  -x       --hex-dump           Show data in both directions as a hex dump.\n"
+    "  -k       --hotkey quit=f12    Set the key for a hotkey action.\n"
+    "           --char-delay 5       Delay after each character sent, in ms.\n"
+    "           --line-delay 50      Delay after each line sent, in ms.\n"
+    "           --send-file FILE     Send FILE to the port. Ctrl-F8 sends a file during a session.\n"
+    "           --send-rate 1000     Limit the rate a file is sent at, in bytes per second.\n"
+    "           --send-prompt \"> \"   Wait for the device to send a prompt after each line of a file.\n"
+    "           --upload FILE        Upload FILE with X/Y/ZMODEM. Ctrl-F6 uploads during a session.\n"
+    "           --download DIR       Download with X/Y/ZMODEM (to a file for XMODEM). Ctrl-F7 during a session.\n"
+    "           --protocol zmodem    Transfer protocol: xmodem, xmodem-1k, ymodem or zmodem. Default zmodem.\n"
+    "           --resume             Resume an interrupted ZMODEM transfer.\n"
+    "           --transfer-test 1    Send a 1 MB file with each protocol through a named pipe, and check it.\n"
+    "           --log FILE           Append everything received to FILE.\n"
+    "           --log-sent           Also log everything sent.\n"
+    "           --capture FILE       Capture everything sent and received to FILE, with timestamps.\n"
+    "           --dump FILE          Print capture FILE as text.\n"
+    "           --from 3600          With --dump, start this many seconds into the capture.\n"
+    "           --spill-size 256     Spill file size for received data, in MB. Default 256.\n"
+    "           --max-fps 60         Limit console writes of received data per second. 0 for none.\n"
+    "           --ring-size 64       Size of the buffers between threads, in KB. Default 64.\n"
+    "           --stats              Print statistics on exit.\n"
+    "           --stats-file FILE    Append statistics to FILE as JSON on exit and on Ctrl-Break.\n"
+    "           --latency            Measure latency through the program. Ctrl-F9 prints it.\n"
+    "           --loopback-test 10   Send 10 MB through a looped-back port and check it.\n"
+    "           --low-latency        Tune the port for round trips: small driver queues, 1 ms FTDI latency timer.\n"
+    "           --rtt-test 1000      Time 1000 round trips through a looped-back port.\n"
+    "           --no-reconnect       Exit if a port goes away, rather than waiting for it to come back.\n"
+    "           --reconnect-test 3   Unplug a stand-in device 3 times, and check the port comes back each time.\n"
+    "           --daemon DIR         Log every port to its own files in DIR, without a console.\n"
+    "           --segment-size 64    Start a new daemon log file after this many MB. Default 64.\n"
+    "           --silence 60         Note in the daemon log when a port is silent for this many seconds.\n"
+    "           --daemon-bench 100   Benchmark daemon mode with 100 named pipes in place of ports.\n"
+    "           --bench-rate 1000    Total data rate for --daemon-bench, in KB/s. Default 1000.\n"
+    "           --serve 7000         Share the port over TCP on [address:]port, with no console.\n"
+    "           --rfc2217            Serve with RFC 2217, so clients can set the baud rate etc.\n"
+    "           --linger 1000        In pipe mode, exit once input has ended and the port is quiet for this long, in ms.\n"
+    "           --pipe-bench 100     Benchmark pipe mode with 100 MB through a pipeline.\n"
+    "           --hex-bench 100      Benchmark the hex dump formatter with 100 MB.\n"
     "\n"
     "Use Ctrl-F10 to quit.\n";
 
@@ -24,6 +64,9 @@ const char* SHORT_HELP_MSG =
 #include <ctype.h>
 #include <locale.h>
 #include <assert.h>
+#include <emmintrin.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #include <winbase.h>
 #include <fileapi.h>
@@ -34,9 +77,83 @@ const char* SHORT_HELP_MSG =
 // Tweakable constants
 //
 #define BUF_SIZE 4096           // Size of copy buffer, in bytes. May hold utf-8 data.
-#define WBUF_SIZE 1024          // Size of wchar buffer, in wchar_t's. Must be 1/4 of BUF_SIZE.
-#define RECORD_SIZE 256         // Size of console events buffer, in record items.
-#define SLEEP_TIME 1            // Time to sleep between polls, in milliseconds.
+#define STDIN_BUF_SIZE 65536    // Size of the buffer stdin is read into, in bytes. Large, so a paste is read in big blocks.
+#define WBUF_SIZE 16384         // Size of wchar buffer, in wchar_t's. Must be more than RECORD_SIZE.
+#define RECORD_SIZE 8192        // Size of console events buffer, in record items. Also limited by the size of the byte buffer.
+#define PASTE_RECORDS 64        // This many console events waiting at once means a paste rather than typing.
+#define PASTE_MIN_FREE 4096     // During a paste, only read more from the console once the TX ring has this much free, in bytes.
+#define PASTE_PROGRESS 250      // Time between paste progress updates in the title bar, in milliseconds.
+#define SEND_CHUNK 65536        // Largest single write when sending a file, in bytes.
+#define SEND_RATE_STEPS 20      // With --send-rate, split each second's worth of data into this many writes.
+#define SEND_PROMPT_MAX 64      // Maximum length of the --send-prompt string, in bytes.
+#define SEND_PROMPT_TIMEOUT 10000   // Give up waiting for the prompt after this long and send the next line, in milliseconds.
+#define XFER_TIMEOUT 10000      // Give up waiting for the other end of a file transfer after this long, in milliseconds.
+#define XFER_START_TIMEOUT 60000    // Give up on a file transfer that hasn't started after this long, in milliseconds.
+#define XFER_POLL 3000          // Time between XMODEM/YMODEM requests to start, in milliseconds.
+#define XFER_PURGE 1000         // After a bad block, wait for the line to be quiet this long, in milliseconds.
+#define XFER_RETRIES 10         // Give up on a file transfer after this many errors in a row.
+#define ZMODEM_SUBPACKET 1024   // Data in each ZMODEM subpacket we send, in bytes.
+#define XFER_MAX_SIZE 0xFFFFFFFF    // Largest file YMODEM and ZMODEM can send, as their sizes and positions are 32-bit, in bytes.
+#define READ_TIMEOUT 60000      // Time a pending serial read may wait for its first byte before being re-armed, in milliseconds.
+#define RX_READS 2              // Number of serial reads kept pending at once, so the port is never left without one.
+#define HIGH_BAUD 460800        // Above this baud rate, warn if RTS/CTS flow control is off.
+#define MAX_PORTS 256           // Most ports. A terminal session can have MAXIMUM_WAIT_OBJECTS (64), as the TX thread waits on them all.
+#define PORT_TAG_SIZE 64        // Longest tag shown before each line from a port, with its colour codes, in bytes.
+#define PARTIAL_LINE_WAIT 100   // With several ports, show an unfinished line from a port after it has waited this long, in milliseconds.
+#define SPILL_POLL 10           // While received data is spilled, the RX thread also checks for ring space this often, in milliseconds.
+#define RING_SIZE 64            // Default size of each buffer between threads, in KB. Rounded up to a power of two.
+#define SPILL_SIZE 256          // Default size of the spill file for received data the console can't keep up with, in MB.
+#define TX_HOLD_SIZE 16384      // Input held by the console thread while the TX ring is full, in bytes.
+#define CACHE_LINE 64           // Size of a CPU cache line, in bytes.
+#define MARK_COUNT 1024         // Timestamps each ring can hold for the latency probe and capture. Chunks beyond this aren't timed.
+#define HIST_BUCKETS 40         // Powers of two covered by a latency histogram (in microseconds).
+#define LOG_RING_SIZE 1024      // Size of the buffer between the console thread and the log writer, in KB.
+#define LOG_BLOCK 65536         // Log writer writes in blocks of this many bytes, in bytes.
+#define LOG_FLUSH_TIME 1000     // Log writer writes a partial block once data has waited this long, in milliseconds.
+#define LOG_CLOSE_TIMEOUT 5000  // Time allowed for the final flush of the log on exit, in milliseconds.
+#define CAPTURE_INDEX_INTERVAL 1048576 // Capture file has a seek index record at every multiple of this offset, in bytes.
+#define HEX_CHUNK 16384         // Hex dump formats up to this many bytes per console write, in bytes.
+#define HEX_ROW_SIZE 84         // Longest hex dump row, in bytes (16 data bytes).
+#define HOTKEY_MAX_LEN 16       // Longest VT sequence for a hotkey, in bytes. ReadStdin() keeps this much of its buffer spare.
+#define HOTKEY_TIMEOUT 20       // Time to wait for the rest of a possible hotkey sequence before sending what we have, in milliseconds.
+#define MAX_FPS 60              // Default limit on console writes of received data, per second.
+#define FLUSH_SIZE 65536        // Write received data to the console straight away once this much is waiting, in bytes.
+#define STATS_INTERVAL 1000     // Throughput is measured, and the status line updated, this often, in milliseconds.
+#define STATS_TEXT_SIZE 65536   // Longest statistics dump (--stats-file, Ctrl-Break), in bytes.
+#define LOOPBACK_TIMEOUT 2000   // Loopback test gives up when nothing has moved for this long, in milliseconds.
+#define PORT_QUEUE 65536        // Driver queue sizes asked for with SetupComm(), in bytes. Rides out bursts at high baud rates.
+#define LOW_LATENCY_QUEUE 256   // Driver queue sizes with --low-latency, in bytes. FTDI drivers take this as the USB transfer size.
+#define LATENCY_TIMER 1         // FTDI latency timer set by --low-latency, in milliseconds. The driver default is 16.
+#define RECONNECT_MIN 100       // First try at reopening a port that has gone away is after this long, in milliseconds...
+#define RECONNECT_MAX 5000      // ...then the wait doubles each try, up to this, in milliseconds.
+#define RECONNECT_TEST_OUTAGE 500   // Reconnect test keeps its stand-in device unplugged this long, in milliseconds.
+#define RECONNECT_TEST_BLOCK 4096   // Data the reconnect test queues for the port while it's gone, in bytes.
+#define RTT_PROBE 8             // Bytes in each round-trip test probe.
+#define AUTOBAUD_CHARS 64       // Autobaud listens long enough at each rate to receive this many characters...
+#define AUTOBAUD_MIN 250        // ...but at least this long, in milliseconds...
+#define AUTOBAUD_MAX 1000       // ...and at most this long, in milliseconds.
+#define AUTOBAUD_BUF 32768      // Most received data autobaud scores at each rate, in bytes.
+#define RTT_TIMEOUT 1000        // Round-trip test counts a probe as lost when it hasn't come back in this long, in milliseconds.
+#define DAEMON_BLOCK 32768      // Daemon mode batches each port's data into blocks of this size for writing, in bytes.
+#define DAEMON_FLUSH 1000       // Daemon mode writes a partial block once data has waited this long, in milliseconds.
+#define DAEMON_RECONNECT 5000   // Daemon mode tries to reopen a port that has gone away this often, in milliseconds.
+#define SEGMENT_SIZE 64         // Default size at which daemon mode starts a new log segment for a port, in MB.
+#define WHEEL_SLOTS 256         // Slots in each daemon worker's timer wheel.
+#define WHEEL_TICK 100          // Time each slot of the timer wheel covers, in milliseconds.
+#define BENCH_RATE 1000         // Default total rate the daemon benchmark feeds its ports at, in KB/s.
+#define BENCH_TIME 10           // Length of the daemon benchmark, in seconds.
+#define BENCH_TICK 10           // Daemon benchmark writes to every port this often, in milliseconds.
+#define PIPE_BUF_SIZE 65536     // Pipe mode moves data in blocks of up to this size, in bytes.
+#define PIPE_LINGER 1000        // Default time pipe mode waits for the port to be quiet after the input ends, in milliseconds.
+#define SERVE_CLIENTS 8         // Most clients connected to the TCP server at once. One is in control, the rest watch.
+#define SERVE_STALL 5000        // A watching client that holds up the port this long is disconnected, in milliseconds.
+#define TELNET_CTL_SIZE 256     // Telnet replies waiting to go to a client, in bytes.
+#define TELNET_SB_SIZE 64       // Longest telnet subnegotiation taken from a client, in bytes.
+
+//
+// File transfer protocols (--protocol)
+//
+enum { XFER_XMODEM, XFER_XMODEM_1K, XFER_YMODEM, XFER_ZMODEM, XFER_PROTOCOLS };
 
 //
 // Options
@@ -46,17 +163,734 @@ bool SystemCP = false;          // -s  Use system codepage instead of UTF-8.
 bool ReplaceCR = false;         // -r  Replace input CR (\r) with newline (\n).
 bool DisableVT = false;         // -d  Disable sending and receiving of virtual terminal (VT) codes.
 bool DebugInput = false;        //     Debug input by echoing hex for input
+bool HexDump = false;           //     Show data in both directions as a hex dump.
 DWORD WriteTimeout = 1000;      // -w  Serial port write timeout, in milliseconds.
+DWORD CharDelay = 0;            //     Delay after each character sent, in milliseconds.
+DWORD LineDelay = 0;            //     Delay after each line sent, in milliseconds.
+char * SendFilePath = NULL;     //     Send this file to the port when the session starts.
+DWORD SendRate = 0;             //     Limit on the rate a file is sent at, in bytes per second. 0 for no limit.
+char * SendPrompt = NULL;       //     When sending a file, wait for the device to send this after each line.
+DWORD RingSize = RING_SIZE;     //     Size of each buffer between threads, in KB.
+DWORD SpillSize = SPILL_SIZE;   //     Size of the spill file, in MB. 0 to wait for the console instead.
+DWORD MaxFps = MAX_FPS;         //     Limit on console writes of received data, per second. 0 for no limit.
+bool ShowStats = false;         //     Print statistics on exit.
+char * StatsFile = NULL;        //     Append statistics to this file as JSON, on exit and on Ctrl-Break.
+bool LatencyProbe = false;      //     Time each chunk through the program, and print latency percentiles.
+char * LogPath = NULL;          //     Log everything received to this file.
+bool LogSent = false;           //     Also log everything sent.
+char * CapturePath = NULL;      //     Capture everything sent and received, with timestamps, to this file.
+char * DumpPath = NULL;         //     Print this capture file as text, instead of connecting.
+double DumpFrom = 0;            //     Start printing the capture this many seconds in.
+DWORD LoopbackTestMB = 0;       //     Run a loopback test of this many MB instead of a terminal session.
+bool AutoBaud = false;          //     Find the baud rate by listening at each common rate.
+bool NoReconnect = false;       //     Exit when a port goes away, rather than reopening it.
+bool LowLatency = false;        //     Tune the port for round-trip time rather than throughput.
+DWORD RttTestCount = 0;         //     Run a round-trip test of this many probes instead of a terminal session.
+int Protocol = XFER_ZMODEM;     //     File transfer protocol.
+char * UploadPath = NULL;       //     Upload this file when the session starts.
+char * DownloadPath = NULL;     //     Download to this file (XMODEM) or directory (YMODEM, ZMODEM) when the session starts.
+bool Resume = false;            //     Resume a ZMODEM transfer that was interrupted.
+DWORD TransferTestMB = 0;       //     Run the file transfer test with a file of this many MB.
+DWORD ReconnectTestCount = 0;   //     Run the reconnect test, unplugging its stand-in device this many times.
+char * DaemonDir = NULL;        //     Log every port to files in this directory, with no console (daemon mode).
+DWORD SegmentSize = SEGMENT_SIZE; //     Daemon mode starts a new log file for a port at this size, in MB.
+DWORD SilenceTime = 0;          //     Daemon mode notes in the log when a port has been silent this long, in seconds.
+DWORD BenchPorts = 0;           //     Run the daemon benchmark with this many named pipe pairs.
+DWORD BenchRate = BENCH_RATE;   //     Total rate the daemon benchmark feeds its ports at, in KB/s.
+DWORD Linger = PIPE_LINGER;     //     Pipe mode: once the input has ended, exit when the port has been quiet this long, in ms.
+DWORD PipeBenchMB = 0;          //     Run the pipe mode benchmark with this many MB.
+DWORD HexBenchMB = 0;           //     Run the hex dump benchmark with this many MB.
+char * ServeAddr = NULL;        //     Serve the port over TCP on this [address:]port.
+bool Rfc2217 = false;           //     Serve with the RFC 2217 telnet protocol, rather than raw.
+
+//
+// Single-producer/single-consumer byte ring, used to pass data between threads without locks.
+// head and tail are running byte counts. Only the producer writes head, only the consumer writes tail.
+// They sit on separate cache lines so the two threads don't fight over the same line.
+//
+// For the latency probe and capture, the producer can also leave timestamp marks, which the consumer picks up
+// once it has consumed past the marked position. marks is NULL when neither is on.
+//
+typedef struct {
+    LONG64 pos;                 // Ring position just after the chunk
+    LONG64 time;                // Performance counter when the chunk entered the program
+} Mark;
+
+typedef struct {
+    char * buf;                 // Preallocated storage
+    LONG64 size;                // Capacity in bytes, a power of two
+    LONG64 peak;                // Highest fill level seen, in bytes. Written by the producer.
+    HANDLE data_event;          // Set by the producer when data is added
+    HANDLE space_event;         // Set by the consumer when space is freed
+    Mark * marks;               // mark_count timestamp marks, or NULL
+    DWORD  mark_count;
+    __declspec(align(CACHE_LINE)) volatile LONG64 head;
+    volatile LONG64 mark_head;
+    __declspec(align(CACHE_LINE)) volatile LONG64 tail;
+    volatile LONG64 mark_tail;
+} Ring;
+
+//
+// Fixed-size log-linear latency histogram, in microseconds. Each power of two is split into 16 sub-buckets,
+// so values are kept to within about 6%. Only one thread records into each histogram.
+//
+typedef struct {
+    LONG64 counts[HIST_BUCKETS][16];
+    LONG64 total;
+    LONG64 max;
+} Histogram;
+
+//
+// Spill file for received data. When the console falls a whole RX ring behind, the RX thread puts new data
+// here instead of waiting, and moves it into the ring as space frees up. A circular buffer in a memory-mapped
+// temporary file, created the first time it's needed. Only the RX thread uses it.
+//
+typedef struct {
+    HANDLE file;                // Temporary file, deleted on close
+    HANDLE mapping;
+    char * view;                // The whole file, mapped
+    LONG64 size;                // Capacity in bytes
+    LONG64 head;                // Total bytes written
+    LONG64 tail;                // Total bytes moved on to the RX ring
+    LONG64 spilled;             // Total bytes that have gone through the spill file
+    LONG64 max_lag;             // Most bytes ever waiting for the console (RX ring and spill file)
+    LONG64 stalls;              // Times the spill file was full too, and the RX thread had to wait
+} Spill;
+
+//
+// Line settings for a port (-c, or com1:SPEC), e.g. "3000000,8,n,1,rtscts". Applied in one SetCommState().
+//
+#define FLOW_RTSCTS  1          // Flow control flags
+#define FLOW_DTRDSR  2
+#define FLOW_XONXOFF 4
+#define FLOW_LEAVE   0x80       // Leave the port's flow control as it is
+
+typedef struct {
+    DWORD baud;                 // Baud rate, or 0 to leave the port's settings as they are
+    BYTE  data_bits;            // 5 to 8
+    BYTE  parity;               // As in the DCB: NOPARITY, ODDPARITY, EVENPARITY, MARKPARITY or SPACEPARITY
+    BYTE  stop_bits;            // As in the DCB: ONESTOPBIT, ONE5STOPBITS or TWOSTOPBITS
+    BYTE  flow;                 // FLOW_ flags
+    WORD  xon_lim;              // Flow control thresholds (input queue bytes), or 0 to leave them as they are
+    WORD  xoff_lim;
+} LineSettings;
+
+//
+// Serial port, and the buffers between it and the console
+//
+typedef struct {
+    const char * name;          // As given on the command line, e.g. "com1" or "\\.\pipe\com1"
+    LineSettings line;          // Settings to configure (from -c, or e.g. com1:115200), or line.baud 0 to leave them
+    bool   is_pipe;             // A named pipe (e.g. a virtual machine COM port), not a comm device
+    HANDLE h;                   // Port handle, opened for overlapped I/O
+    Ring   rx;                  // Serial RX thread -> console thread
+    Ring   tx;                  // Console thread -> serial TX thread
+    Spill  spill;               // Overflow for rx
+    LONG64 rx_bytes;            // Bytes read from the port. Written by the RX thread.
+    LONG64 rx_calls;            // Completed reads. Written by the RX thread.
+    LONG64 tx_bytes;            // Bytes written to the port. Written by the TX thread.
+    LONG64 tx_calls;            // Completed writes. Written by the TX thread.
+    LONG64 tx_timeouts;         // Writes that timed out before sending everything. Written by the TX thread.
+    LONG64 overruns;            // UART errors, from ClearCommError() after each read: the UART's FIFO overran,
+    LONG64 rx_overflows;        // the driver's input buffer overflowed,
+    LONG64 framing_errors;
+    LONG64 parity_errors;
+    LONG64 breaks;              // and breaks received. Written by the RX thread.
+    DWORD  in_queue;            // Bytes waiting in the driver's input queue after the last read. Written by the RX thread.
+    DWORD  peak_in_queue;
+    LONG64 rate_rx_bytes;       // rx_bytes and tx_bytes when throughput was last measured. Console thread only.
+    LONG64 rate_tx_bytes;
+    double rx_rate;             // Throughput over the last STATS_INTERVAL, and the most seen, in bytes per second
+    double tx_rate;
+    double peak_rx_rate;
+    double peak_tx_rate;
+    bool   reconnect;           // Reopen the port if it goes away (e.g. its USB adapter is unplugged). Terminal session only.
+    volatile LONG lost;         // The port has gone away, and is being reopened. Set by whichever thread notices first.
+    SRWLOCK lock;               // Held shared by the TX thread while writing, and exclusive by the RX thread to close or reopen h
+    HANDLE connected;           // Set while the port is open, reset while it's lost
+    LONG64 lost_time;           // When it was lost (from Now())
+    LONG64 retry_time;          // When to try reopening it next (from Now()). RX thread only.
+    DWORD  retry_delay;         // Wait before the try after that, in milliseconds. RX thread only.
+    DWORD  retry_count;         // Tries at reopening it since it was lost. RX thread only.
+    LONG64 reconnects;          // Times it has been lost and reopened. Written by the RX thread.
+    double max_outage;          // Longest it has been gone, in seconds. Written by the RX thread.
+    char * rx_buf;              // RX_READS buffers of BUF_SIZE, for the pending reads. RX thread only.
+    OVERLAPPED rx_ov[RX_READS];
+    bool   rx_done[RX_READS];   // Read has completed, but is waiting for an earlier one to be handled
+    DWORD  rx_next;             // The read to handle next
+    DWORD  rx_pending;          // Reads pending on the port. RX thread only.
+    char   last_sent;           // Last byte written, for line pacing. TX thread only.
+    char   tag[PORT_TAG_SIZE];  // With several ports, shown before each line from this port, e.g. "[com1] "
+    DWORD  tag_len;
+    LONG64 shown;               // Bytes shown on the console so far, for hex dump offsets. Console thread only.
+    DWORD  held;                // Unfinished line held back from the console, in bytes. Console thread only.
+    LONG64 held_due;            // When the held line will be shown anyway (from Now())
+} Port;
+
+//
+// Session log. The console thread appends to the ring, and a writer thread puts it on disk in large blocks,
+// so a slow disk never holds up the terminal.
+//
+typedef struct {
+    const char * name;          // For messages, e.g. "Log file"
+    HANDLE file;                // Log file, or NULL if not logging
+    Ring   ring;                // Console thread -> log writer thread
+    HANDLE thread;              // Log writer thread
+    DWORD  thread_id;
+    volatile LONG closing;      // Set when the writer should flush everything and stop
+    LONG64 written;             // Bytes written to disk. Written by the writer thread.
+    LONG64 stalls;              // Times the ring was full and the console thread had to wait for the disk
+} LogFile;
+
+//
+// Capture file (--capture). A binary record of everything sent and received, with timestamps.
+// Layout: a CaptureHeader, then records, each a CaptureRecord followed by length bytes of payload.
+// RX, TX and control records carry the index of their port (in command line order), and RX payloads are the raw
+// bytes received, without the tags shown on the console when there are several ports.
+// At every multiple of CAPTURE_INDEX_INTERVAL in the file there is a CAP_INDEX record, so a reader can seek by
+// time (binary search on the index records' times) without reading the whole file, even if it wasn't closed
+// cleanly. Records are split, or a CAP_PAD record fills the gap, to keep them there. A CAP_INDEX payload is the
+// file offset of the previous CAP_INDEX record (-1 for the first). A clean close ends the file with a CAP_END
+// record whose payload is the offset of the last CAP_INDEX record.
+// All values are little-endian.
+//
+#define CAPTURE_MAGIC "SPCAP01"
+#define CAP_RX      1           // Received from the port (timestamped when the read completed), one record per read
+#define CAP_TX      2           // Sent to the port (timestamped when queued)
+#define CAP_CONTROL 3           // Text note from spconnect, e.g. the port that was opened
+#define CAP_INDEX   4           // Seek index
+#define CAP_END     5           // End of a cleanly closed capture
+#define CAP_PAD     6           // Filler up to the next index record. Payload is zeros.
+
+typedef struct {
+    char   magic[8];            // CAPTURE_MAGIC
+    LONG64 frequency;           // Timestamp ticks per second
+    FILETIME start;             // Wall clock time at timestamp 0 (UTC)
+} CaptureHeader;
+
+typedef struct {
+    LONG64 time;                // Ticks since the start of the capture
+    BYTE   type;                // CAP_*
+    BYTE   port;                // Index of the port, 0 for the first (and for index and end records)
+    BYTE   reserved[2];
+    DWORD  length;              // Payload length, in bytes
+} CaptureRecord;
+
+typedef struct {
+    LogFile log;                // Written through the same background writer as the session log
+    LONG64 offset;              // File offset of the next record
+    LONG64 last_index;          // File offset of the last CAP_INDEX record, or -1
+    LONG64 next_index;          // Write a CAP_INDEX record once offset reaches this
+} Capture;
+
+//
+// Local hotkeys. These are handled by spconnect rather than being sent to the port.
+// In VT mode they are matched as VT sequences by FilterHotkeys(), otherwise by virtual key code in ReadStdin().
+//
+#define HKMOD_SHIFT 1
+#define HKMOD_ALT   2
+#define HKMOD_CTRL  4
+
+enum { HK_QUIT, HK_LATENCY, HK_SEND_FILE, HK_UPLOAD, HK_DOWNLOAD, HK_NEXT_PORT, HK_STATUS, HK_PASTE_START, HK_PASTE_END, HOTKEY_COUNT };
+
+typedef struct {
+    const char * action;        // Name, for --hotkey
+    const char * key;           // Key, e.g. "ctrl-f10", or "none"
+    char   display[24];         // Key, for messages, e.g. "Ctrl-F10". Longest is "Ctrl-Alt-Shift-F10".
+    WORD   vk;                  // Virtual key code (0 if disabled)
+    DWORD  mods;                // HKMOD_* modifiers
+    char   seq[HOTKEY_MAX_LEN]; // VT sequence
+    DWORD  seq_len;
+    bool   pass_through;        // A fixed sequence that is noticed, but still sent to the port (e.g. bracketed paste)
+} Hotkey;
+
+//
+// Matcher state carried between reads, for a hotkey sequence split across two reads.
+//
+typedef struct {
+    char   held[HOTKEY_MAX_LEN];    // The start of a possible hotkey, from the end of the last read
+    DWORD  held_len;
+} HotkeyMatcher;
+
+//
+// A paste in progress. Detected by a burst of console events, or by bracketed paste markers (when the device
+// has turned bracketed paste on). While pasting, the console is read in big blocks, but only as fast as the port
+// takes the data, and progress is shown in the title bar.
+//
+typedef struct {
+    bool   active;              // A paste is being sent
+    bool   bracketed;           // Started by a bracketed paste marker, so it ends with the end marker
+    bool   input_done;          // The whole paste has been read from the console
+    LONG64 start;               // When it started (from Now())
+    LONG64 queued;              // Bytes of the paste read from the console so far
+    LONG64 tx_start;            // The port's tx_bytes at the start of the paste
+    LONG64 last_progress;       // When progress was last shown (from Now())
+} PasteState;
+
+//
+// A file being sent (--send-file, or the send-file hotkey). The file is mapped, and the TX thread writes straight
+// from the view. Typing waits in the TX ring until the file is done.
+//
+typedef struct {
+    volatile LONG active;       // Set while the TX thread is sending from the view
+    volatile LONG cancel;       // Set to make the TX thread stop early
+    bool   requested;           // The send-file hotkey was pressed (console thread only)
+    char   name[MAX_PATH];      // File name, for messages
+    HANDLE file;
+    HANDLE mapping;
+    char * view;
+    LONG64 size;
+    LONG64 pos;                 // Bytes written so far (TX thread)
+    DWORD  chunk;               // Largest write
+    double line_rate;           // Most bytes per second the port can send, from its baud rate. 0 if unknown.
+    DWORD  baud;
+    LONG64 start;               // When sending started and ended (from Now())
+    LONG64 end;
+    DWORD  prompt_timeouts;     // Lines after which the prompt didn't arrive in time
+    Port * port;                // Port it's being sent to
+    HANDLE done_event;          // Set by the TX thread when it's done with the file
+    HANDLE prompt_event;        // Set by the RX thread when it sees the prompt
+} FileSend;
+
+//
+// File transfer protocol characters. XMODEM and YMODEM use the first few; ZMODEM frames are built from the rest.
+//
+#define SOH     0x01            // Start of a 128 byte block
+#define STX     0x02            // Start of a 1024 byte block
+#define EOT     0x04            // End of file
+#define ACK     0x06
+#define NAK     0x15
+#define CAN     0x18            // Cancel (several in a row)
+#define CPMEOF  0x1A            // Padding for the last XMODEM block
+#define DLE     0x10
+#define XON     0x11
+#define XOFF    0x13
+#define ZPAD    '*'             // Padding before a ZMODEM header
+#define ZDLE    CAN             // ZMODEM escape
+#define ZBIN    'A'             // Binary header with CRC-16
+#define ZHEX    'B'             // Hex header with CRC-16
+#define ZBIN32  'C'             // Binary header with CRC-32
+#define ZCRCE   'h'             // Subpacket ends the frame, header follows
+#define ZCRCG   'i'             // Subpacket, more data follows, no ACK wanted
+#define ZCRCQ   'j'             // Subpacket, more data follows, ACK wanted
+#define ZCRCW   'k'             // Subpacket ends the frame, ACK wanted
+#define ZRUB0   'l'             // Escaped 0x7F
+#define ZRUB1   'm'             // Escaped 0xFF
+#define ZFRAME_END 0x100        // ZGetByte() result flag for a subpacket end
+#define CRC32_RESIDUE 0xDEBB20E3
+
+// ZMODEM frame types
+enum { ZRQINIT, ZRINIT, ZSINIT, ZACK, ZFILE, ZSKIP, ZNAK, ZABORT, ZFIN, ZRPOS, ZDATA, ZEOF, ZFERR, ZCRC, ZCHALLENGE,
+       ZCOMPL, ZCAN, ZFREECNT, ZCOMMAND, ZSTDERR };
+
+// ZMODEM header bytes: flags count down from ZF0 at the end, positions are little-endian from ZP0
+#define ZF0     3
+#define ZP0     0
+#define ZP1     1
+
+// ZRINIT capabilities (ZF0), and ZFILE options (ZF0)
+#define CANFDX  0x01            // Full duplex
+#define CANOVIO 0x02            // Can receive while writing to disk
+#define CANFC32 0x20            // Can use CRC-32
+#define ESCCTL  0x40            // Wants all control characters escaped
+#define ZCBIN   1               // Binary file
+#define ZCRESUM 3               // Resume an interrupted transfer
+
+// Results from reading during a file transfer (all negative, unlike a byte)
+#define XFER_TIMED_OUT  -1
+#define XFER_CANCELLED  -2      // Esc pressed
+#define XFER_BAD        -3      // Bad data, e.g. a CRC error
+#define XFER_ABORTED    -4      // The other end cancelled
+
+//
+// A file transfer in progress (X/Y/ZMODEM). Transfers run on the console thread.
+//
+typedef struct {
+    int    requested;           // The upload (1) or download (2) hotkey was pressed
+    Port * port;
+    HANDLE stdin_h;             // For Esc to cancel
+    bool   receiving;
+    bool   cancelled;           // Esc was pressed
+    const char * error;         // Why it failed
+    wchar_t path[MAX_PATH];     // File to send, or where to put what's received
+    char   name[MAX_PATH];      // Name of the current file, for messages and YMODEM/ZMODEM headers
+    HANDLE file;                // Sending: the mapped file
+    HANDLE mapping;
+    char * view;
+    HANDLE out;                 // Receiving: the file being written
+    LONG64 size;                // Size of the current file, or -1 if not known
+    LONG64 pos;                 // Bytes of it sent or received
+    LONG64 start_pos;           // Where it started from (when resuming)
+    LONG64 start;               // When it started (from Now())
+    LONG64 last_progress;
+    DWORD  errors;              // Errors recovered from
+    double line_rate;           // Most bytes per second the port can send, from its baud rate. 0 if unknown.
+    DWORD  baud;
+    bool   crc32;               // ZMODEM: send CRC-32s
+    bool   esc_ctl;             // ZMODEM: escape all control characters
+    bool   rx_crc32;            // ZMODEM: the last header received had a CRC-32, so its data does too
+    char * rx_p;                // Unread data in the RX ring
+    DWORD  rx_len;
+    DWORD  rx_taken;            // Read, but not yet handed back to the ring
+} Transfer;
+
+//
+// Transfer test (--transfer-test): the receiving end, which runs on a thread of its own.
+//
+typedef struct {
+    HANDLE never;               // Stands in for stdin, so only the sending end reads the keyboard
+    const wchar_t * path;       // Where to put what's received
+    LONG64 start_pos;           // Where the transfer started, so a resume can be checked
+} TransferTestSide;
+
+//
+// Reconnect test (--reconnect-test): the stand-in device, the server end of a named pipe. It echoes what it's sent.
+// Unplugged, it closes the pipe, waits RECONNECT_TEST_OUTAGE, then creates it again for the port to reopen.
+//
+typedef struct {
+    HANDLE h;                   // The pipe instance, overlapped so a pending read can be cancelled
+    HANDLE unplug;              // Set to unplug the device
+} ReconnectDevice;
+
+//
+// Daemon mode (--daemon). Each port is logged to its own files, in segments of up to SegmentSize MB, with no console.
+// The ports are shared out between worker threads, one per core, each with its own completion port and event loop.
+// Data is batched into DAEMON_BLOCK blocks, written with overlapped writes, so a worker never waits for the disk.
+// Each worker keeps a timer wheel: one timer per port, set for whichever is due first of the partial block flush,
+// the silence check, and the reconnect attempt. Only the worker that owns a port touches it.
+//
+typedef struct DaemonPort {
+    Port * port;
+    struct Worker * worker;
+    bool   connected;           // Reads are pending on the port
+    bool   dropping;            // The port failed, and we're waiting for its cancelled reads to complete
+    DWORD  drop_error;          // Why it failed
+    DWORD  reads_pending;
+    DWORD  rx_len[RX_READS];    // Bytes from each completed read
+    DWORD  rx_error[RX_READS];  // Error from each completed read, or 0
+    char * block[2];            // One block filling, while the other is written
+    DWORD  fill;                // Which block is filling
+    DWORD  fill_len;
+    bool   writing;             // The other block is being written
+    OVERLAPPED write_ov;
+    HANDLE log;                 // Current log segment
+    LONG64 log_pos;             // Where the next write goes, the end of the segment
+    LONG64 logged;              // Bytes written to the log segments
+    LONG64 flush_tick;          // When the filling block is due to be written, in timer wheel ticks
+    LONG64 last_rx_tick;        // When data last arrived
+    bool   silent;              // Silent for SilenceTime, and noted in the log
+    LONG64 reconnect_tick;      // When to try to reopen the port, if it isn't connected
+    DWORD  open_error;          // Why the last attempt to open it failed, so each new reason is only noted once
+    DWORD  disconnects;
+    LONG64 timer_tick;          // When the timer is due, or 0 if it isn't set
+    struct DaemonPort * timer_prev;     // Timer wheel slot list
+    struct DaemonPort * timer_next;
+} DaemonPort;
+
+typedef struct Worker {
+    HANDLE iocp;
+    HANDLE thread;
+    LONG64 tick;                // Timer wheel ticks handled so far
+    DaemonPort * wheel[WHEEL_SLOTS];
+} Worker;
+
+//
+// Pipe mode, when stdin or stdout isn't a console (e.g. "spconnect com3 | findstr ERROR"). Bytes are passed on as they
+// are, in large blocks, with none of the console handling. There is a thread for each direction. Each reads into a
+// buffer and writes straight from it, with the next read (or write) already under way.
+//
+typedef struct {
+    HANDLE in;                  // stdin, or the benchmark's pipes
+    HANDLE out;
+    Port * port;
+    HANDLE input_done;          // Set once the input has ended and all of it has been written to the port
+    LONG64 last_rx;             // When data last arrived from the port (from Now()). Written by the RX thread.
+} PipeState;
+
+//
+// Server mode (--serve). The port is shared over TCP, raw or with RFC 2217, all on one thread, with non-blocking
+// sockets. Each block read from the port is sent to every client straight from the read buffer, and the read is only
+// re-armed once they all have it. What the client in control sends is received straight into the write buffer.
+//
+#define TN_SE   240             // Telnet commands
+#define TN_SB   250
+#define TN_WILL 251
+#define TN_WONT 252
+#define TN_DO   253
+#define TN_DONT 254
+#define TN_IAC  255
+#define TN_BINARY   0           // Telnet options
+#define TN_SGA      3
+#define TN_COM_PORT 44          // RFC 2217
+#define TN_US   1               // Option states: we have agreed to do it
+#define TN_THEM 2               // They have agreed to do it
+
+typedef struct {
+    SOCKET s;
+    HANDLE event;               // Set for network events on the socket
+    char   name[64];            // Address of the other end, for messages
+    bool   control;             // What it sends goes to the port. The others can only watch.
+    bool   readable;            // There may be data waiting to be received
+    bool   suspended;           // RFC 2217: it has asked us to stop sending for now
+    DWORD  sent;                // Bytes of the current block from the port sent to it
+    bool   iac_pending;         // Telnet: an 0xFF has been sent, but not the 0xFF that escapes it
+    LONG64 stalled;             // When it started holding up the port, or 0
+    BYTE   ctl[TELNET_CTL_SIZE];    // Telnet replies waiting to be sent
+    DWORD  ctl_len;
+    BYTE   tn_state;            // Telnet parser state: 0 data, else the command being taken
+    BYTE   sb[TELNET_SB_SIZE];  // Telnet subnegotiation being received
+    DWORD  sb_len;
+    BYTE   options[256];        // Telnet option states (TN_US, TN_THEM)
+} Client;
+
+typedef struct {
+    Port * port;
+    Client clients[SERVE_CLIENTS];      // In the order they connected
+    DWORD  client_count;
+    const char * out;           // Block from the port being sent to the clients, or NULL
+    DWORD  out_len;
+    DWORD  rx_len[RX_READS];    // Bytes from each completed read
+    bool   rx_pending[RX_READS];
+    char   tx_buf[BUF_SIZE];    // Data from the client in control, being written to the port
+    DWORD  tx_pos;
+    DWORD  tx_len;
+    bool   writing;
+    OVERLAPPED tx_ov;
+    bool   dtr;                 // RFC 2217: the control lines as last set
+    bool   rts;
+    bool   brk;
+    LONG64 rx_bytes;
+    LONG64 tx_bytes;
+} Server;
+
+//
+// State
+//
+Port Ports[MAX_PORTS] = { 0 };  // The serial ports we are connected to.
+DWORD PortCount = 0;
+Port * Target = &Ports[0];      // The port that typing, file sends and transfers go to.
+bool TargetRequested = false;   // The next-port hotkey was pressed.
+Port * LineOwner = NULL;        // With several ports, the port whose line is unfinished on the console, if any.
+HANDLE RxCompletion = NULL;     // Completion port for reads on all the ports.
+HANDLE RxReady = NULL;          // Set by the RX thread when it has passed the console thread data, from any port.
+LogFile SessionLog = { 0 };     // Session log (--log).
+Capture SessionCapture = { 0 }; // Capture file (--capture).
+Hotkey Hotkeys[HOTKEY_COUNT] = {
+    { "quit",        "ctrl-f10" },
+    { "latency",     "ctrl-f9" },
+    { "send-file",   "ctrl-f8" },
+    { "upload",      "ctrl-f6" },
+    { "download",    "ctrl-f7" },
+    { "next-port",   "ctrl-f5" },
+    { "status",      "ctrl-f4" },
+    { "paste-start", NULL, "", 0, 0, "\x1b[200~", 6, true },
+    { "paste-end",   NULL, "", 0, 0, "\x1b[201~", 6, true },
+};
+PasteState Paste = { 0 };       // The paste in progress, if any.
+FileSend Sending = { 0 };       // The file being sent, if any.
+__declspec(thread) Transfer Xfer = { 0 };   // The file transfer in progress, if any. Per thread, for the transfer test.
+Server Serve = { 0 };           // Server mode (--serve).
+ReconnectDevice TestDevice = { 0 };     // The reconnect test's stand-in device.
+PipeState Piped = { 0 };        // Pipe mode.
+const char * ProtocolNames[XFER_PROTOCOLS] = { "xmodem", "xmodem-1k", "ymodem", "zmodem" };
+WORD Crc16Table[256];           // CRC-16/XMODEM table, for file transfers.
+DWORD Crc32Table[256];          // CRC-32 table, for file transfers.
+bool StdinBurst = false;        // The last ReadStdin() found PASTE_RECORDS or more console events waiting.
+HotkeyMatcher StdinHotkeys = { 0 };   // Hotkey matcher for stdin, in VT mode.
+LONG64 TxOffset = 0;            // Bytes sent so far, for hex dump offsets.
+DWORD ConsoleThreadId = 0;      // Thread that runs the console, and writes the session log and capture.
+HANDLE StopEvent = NULL;        // Set by Ctrl-C (or the end of the benchmark) to stop daemon or server mode.
+Histogram TxLatency = { 0 };    // Keyboard to port: ReadStdin() returning to the write completing.
+Histogram RxLatency = { 0 };    // Port to screen: the read completing to the console write completing.
+Histogram WriteLatency = { 0 }; // Port writes: WriteFile() being issued to it completing.
+LONG64 QpcFrequency = 0;        // Performance counter ticks per second.
+LONG64 StartTime = 0;           // Performance counter at the start of the session.
+LONG64 ConsoleBytes = 0;        // Bytes written to stdout from the serial port (with -x, the hex dump of both directions).
+LONG64 ConsoleWrites = 0;       // Number of writes to stdout from the serial port.
+LONG64 ConsoleTicks = 0;        // Performance counter ticks spent writing to stdout.
+LONG64 ConsoleShortWrites = 0;  // Times the console took fewer bytes than offered (the rest is retried).
+LONG64 TxDropped = 0;           // Typed bytes thrown away because the port wasn't taking any data.
+LONG64 ConsoleWakeups = 0;      // Times the console thread's wait returned, for wakeups per second.
+LONG64 RxWakeups = 0;           // Times the RX thread's wait returned. Written by the RX thread.
+bool StatusLine = false;        // The status hotkey has turned on the status line, in the title bar.
+LONG64 StatsTime = 0;           // When throughput was last measured.
 
 //
 // Function declarations
 //
 void   ExitWithError(const char * callstr, bool use_gle);
 void   StrToLower(char* str, size_t max_len);
+LONG64 Now();
+double SecondsSince(LONG64 start);
+DWORD  MsUntil(LONG64 deadline);
+double CpuSeconds();
 HANDLE InitStdin();
 HANDLE InitStdout();
 void   RestoreConsole();
+DWORD  RingFree(Ring * r);
+void   PasteBegin(bool bracketed);
+void   PasteProgress(bool done);
+void   PaceWait(HANDLE timer, DWORD ms);
+double PortByteRate(Port * port, DWORD * baud);
+bool   MapFileRead(const wchar_t * path, HANDLE * file, HANDLE * mapping, char ** view, LONG64 * size);
+void   UnmapFile(HANDLE file, HANDLE mapping, char * view);
+bool   SendFileStart(Port * port, const wchar_t * path);
+void   SendFileDone();
+void   SendFileFinish();
+bool   PromptLine(HANDLE stdin_h, const char * prompt, wchar_t * line, DWORD size);
+void   PromptSendFile(HANDLE stdin_h, Port * port);
+bool   PromptSeen(const char * buf, DWORD n);
+void   CrcInit();
+WORD   Crc16(WORD crc, const BYTE * buf, DWORD n);
+DWORD  Crc32(DWORD crc, const BYTE * buf, DWORD n);
+int    XferWait(HANDLE h, DWORD timeout);
+int    XferGetByte(DWORD timeout);
+int    XferPeekByte();
+bool   XferPut(const void * buf, DWORD n);
+bool   XferPutByte(BYTE c);
+void   XferAbort();
+void   XferPurge();
+void   XferProgress();
+void   XferReport(const char * what);
+bool   XferOpenOutput(const char * name, LONG64 size, bool resume, LONG64 * pos);
+bool   XferWrite(const BYTE * buf, DWORD n);
+void   XferCloseOutput(bool complete);
+DWORD  XferFileInfo(char * buf, DWORD size, bool zmodem);
+void   XferParseFileInfo(const BYTE * buf, DWORD n, char * name, LONG64 * size);
+int    XWaitStart(DWORD timeout);
+bool   XSendBlock(BYTE number, const char * data, DWORD n, DWORD block_len, BYTE pad, bool crc);
+bool   XSend(bool ymodem, bool one_k);
+bool   XReceive(bool ymodem);
+int    HexDigit(char c);
+BYTE * ZEscape(BYTE * p, BYTE c);
+bool   ZPutHexHeader(BYTE type, const BYTE hdr[4]);
+bool   ZPutBinHeader(BYTE type, const BYTE hdr[4]);
+bool   ZPutData(const BYTE * buf, DWORD n, BYTE frame_end);
+int    ZGetByte();
+int    ZGetHeader(BYTE hdr[4]);
+int    ZGetData(BYTE * buf, DWORD size, DWORD * n);
+void   ZSetPos(BYTE hdr[4], LONG64 pos);
+LONG64 ZGetPos(const BYTE hdr[4]);
+bool   ZSend();
+bool   ZReceive();
+void   RunTransfer(HANDLE stdin_h, Port * port, bool receiving, const wchar_t * path);
+void   PromptTransfer(HANDLE stdin_h, Port * port, bool receiving);
+void   Quit();
+void   PrintStats();
+void   UartErrors(Port * port);
+bool   SampleStats();
+void   ShowStatus();
+DWORD  FormatStats(char * out, DWORD out_size);
+void   WriteStats();
+BOOL   WINAPI StatsCtrlHandler(DWORD ctrl_type);
+void   RingInit(Ring * r, DWORD size, DWORD mark_count);
+DWORD  RingUsed(Ring * r);
+DWORD  RingWritable(Ring * r, char ** p);
+void   RingCommit(Ring * r, DWORD n);
+DWORD  RingPush(Ring * r, const char * buf, DWORD n);
+DWORD  RingReadable(Ring * r, char ** p);
+void   RingConsume(Ring * r, DWORD n);
+void   RingMark(Ring * r, LONG64 pos, LONG64 time);
+void   RingUnmark(Ring * r, Histogram * h);
+void   HistRecord(Histogram * h, LONG64 usec);
+LONG64 HistPercentile(Histogram * h, double pct);
+void   PrintHist(const char * name, Histogram * h);
+void   PrintLatency();
+void   OpenLog(LogFile * log, const char * path);
+void   LogWrite(LogFile * log, const char * buf, DWORD n);
+DWORD  WINAPI LogWriterThread(LPVOID param);
+void   CloseLog(LogFile * log);
+void   OpenCapture(Capture * cap, const char * path);
+void   CaptureRecordWrite(Capture * cap, BYTE type, BYTE port, LONG64 time, const char * buf, DWORD n);
+void   CaptureWrite(Capture * cap, BYTE type, BYTE port, LONG64 time, const char * buf, DWORD n);
+void   CaptureRx(Port * port, const char * buf, DWORD n);
+void   CloseCapture(Capture * cap);
+bool   ReadCaptureIndex(HANDLE f, LONG64 offset, LONG64 * time);
+void   DumpCapture(const char * path);
+DWORD  FormatHex(char * out, const char * tag, LONG64 offset, const unsigned char * buf, DWORD n);
+void   HexBench(DWORD megabytes);
+void   WriteHex(HANDLE stdout_h, const char * tag, LONG64 offset, const char * buf, DWORD n);
 DWORD  ReadStdin(HANDLE stdin_h, char * buf, DWORD buf_size);
+bool   ParseHotkey(Hotkey * hk, const char * key);
+void   RunHotkey(int action);
+int    MatchHotkeyVk(WORD vk, DWORD control_key_state);
+DWORD  FilterHotkeys(HotkeyMatcher * m, char * buf, DWORD n);
+DWORD  FlushHotkeys(HotkeyMatcher * m, char * buf);
+void   InitPort(Port * port);
+bool   OpenPort(Port * port);
+void   FtdiLatencyTimer(Port * port);
+void   DetectBaudRate(Port * port);
+DWORD  AutoBaudSample(Port * port, char * buf, DWORD ms, DWORD * frame_errors);
+double AutoBaudScore(const char * buf, DWORD len, DWORD frame_errors);
+bool   ConfigureSerialPort(Port * port, const LineSettings * ls);
+bool   ParseLineSettings(char * spec, LineSettings * ls);
+bool   StartPortRead(Port * port, OVERLAPPED * ov, char * buf, DWORD buf_size);
+DWORD  FinishPortRead(Port * port, OVERLAPPED * ov);
+DWORD  WritePort(Port * port, const char * buf, DWORD buf_size);
+void   PortLost(Port * port);
+void   ArmPortReads(Port * port);
+void   ClosePortIfDone(Port * port);
+void   ReopenPort(Port * port);
+void   SaveLineSettings(Port * port);
+void   SpillOpen(Spill * sp);
+void   SpillDrain(Spill * sp, Ring * r);
+void   PassRx(Port * port, const char * buf, DWORD n, LONG64 read_time);
+void   ConsumeRx(Port * port, DWORD n);
+DWORD  RxPending(LONG64 * held_due);
+void   ShowRx(HANDLE stdout_h, Port * port);
+void   ShowLines(HANDLE stdout_h, Port * port);
+void   WriteShown(HANDLE stdout_h, const char * buf, DWORD n);
+DWORD  WINAPI SerialRxThread(LPVOID param);
+DWORD  WINAPI SerialTxThread(LPVOID param);
+void   LoopbackTest(HANDLE stdin_h, Port * port, DWORD megabytes);
+void   RttTest(HANDLE stdin_h, Port * port, DWORD count);
+void   TransferTestPorts();
+void   TransferTestFile(const wchar_t * path, LONG64 size);
+bool   TransferTestCheck(const wchar_t * sent, const wchar_t * received, bool padded);
+DWORD  WINAPI TransferTestReceive(LPVOID param);
+void   TransferTest(HANDLE stdin_h, DWORD megabytes);
+HANDLE ReconnectTestPipe(const char * name);
+void   ReconnectTestPorts();
+DWORD  WINAPI ReconnectTestDevice(LPVOID param);
+bool   ReconnectTestEcho(HANDLE stdin_h, Port * port, LONG64 * sent, LONG64 * received, LONG64 * mismatched);
+void   ReconnectTest(HANDLE stdin_h, Port * port, DWORD count);
+LONG64 WheelNow();
+void   TimerSet(DaemonPort * dp, LONG64 tick);
+void   TimerRun(Worker * w);
+void   DaemonSchedule(DaemonPort * dp);
+void   DaemonTimer(DaemonPort * dp);
+void   DaemonNote(DaemonPort * dp, const char * note, DWORD error);
+void   DaemonOpenSegment(DaemonPort * dp);
+void   DaemonWrite(DaemonPort * dp);
+void   DaemonWritten(DaemonPort * dp, DWORD bytes, DWORD error);
+void   DaemonConnect(DaemonPort * dp);
+bool   DaemonArm(DaemonPort * dp, DWORD i);
+void   DaemonDrop(DaemonPort * dp, DWORD error);
+void   DaemonClosed(DaemonPort * dp);
+void   DaemonReadDone(DaemonPort * dp, OVERLAPPED * ov, DWORD bytes, DWORD error);
+void   DaemonTakeReads(DaemonPort * dp);
+DWORD  WINAPI DaemonWorkerThread(LPVOID param);
+BOOL   WINAPI StopCtrlHandler(DWORD ctrl_type);
+void   DaemonBench(Worker * workers, DWORD worker_count, DaemonPort * dps, HANDLE * pipes);
+void   RunDaemon(const char * dir);
+DWORD  WINAPI PipeRxThread(LPVOID param);
+DWORD  WINAPI PipeTxThread(LPVOID param);
+void   PipeWriteWait(Port * port, OVERLAPPED * ov, const char * buf, DWORD len);
+void   PipeStart(HANDLE in, HANDLE out);
+void   RunPipe();
+DWORD  WINAPI PipeBenchEcho(LPVOID param);
+DWORD  WINAPI PipeBenchFeed(LPVOID param);
+void   PipeBench(DWORD megabytes);
+bool   ClientSend(Client * c);
+void   ClientClose(DWORD i);
+void   ClientAccept(SOCKET listen_s);
+bool   ClientReceive(Client * c);
+DWORD  TelnetInput(Client * c, BYTE * buf, DWORD len);
+void   TelnetReply(Client * c, const BYTE * reply, DWORD len);
+void   TelnetOption(Client * c, BYTE command, BYTE option);
+void   ComPortCommand(Client * c, const BYTE * sb, DWORD len);
+void   ComPortReply(Client * c, BYTE code, const BYTE * value, DWORD len);
+void   RunServer(const char * addr);
 int    main(int argc, char* argv[]);
 
 //
@@ -69,6 +903,11 @@ void ExitWithError(const char * callstr, bool use_gle) {
     else {
         fprintf(stderr, "\nspconnect exiting. %s\n", callstr);
     }
+    if (StatsFile != NULL) {
+        WriteStats();
+    }
+    CloseLog(&SessionLog);
+    CloseCapture(&SessionCapture);
     RestoreConsole();
     exit(1);
 }
@@ -85,236 +924,5750 @@ void StrToLower(char * str, size_t max_len) {
 }
 
 //
-// Globals to store console settings so they can be restored on exit
+// Current time from the performance counter, in ticks.
 //
-DWORD  STDIN_ORIGINAL_MODE  = 0;
-UINT   STDIN_ORIGINAL_CP    = 0;
-DWORD  STDOUT_ORIGINAL_MODE = 0;
-UINT   STDOUT_ORIGINAL_CP   = 0;
+LONG64 Now() {
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
 
-// 
-// Initialise stdin. Check that is a supported file type, configure it, disable line-edit mode, etc.
 //
-HANDLE InitStdin() {
-    HANDLE stdin_h = GetStdHandle(STD_INPUT_HANDLE);    
-    if (stdin_h == INVALID_HANDLE_VALUE) {
-        ExitWithError("GetStdHandle(stdin)", true);
-    }
-    
-    if (GetFileType(stdin_h) != FILE_TYPE_CHAR) {
-        ExitWithError("GetFileType(stdin_h)", true);
-    }
-
-    if (GetConsoleMode(stdin_h, &STDIN_ORIGINAL_MODE) == 0) {   // Set global, so we can restore the console settings on exit
-        ExitWithError("GetConsoleMode(stdin_h)", true);
-    }
-    DWORD stdin_mode =         
-        ENABLE_QUICK_EDIT_MODE | ENABLE_EXTENDED_FLAGS      // Allow the user to use the mouse to select and edit text
-    //  | ENABLE_MOUSE_INPUT                                // Receive mouse input events
-        | ENABLE_WINDOW_INPUT                               // Receive messages about changes to the size of the console screen buffer        
-    ;
-    if (!DisableVT) {
-        //stdin_mode |= ENABLE_PROCESSED_INPUT;             // CTRL+C to be handled by the system
-        stdin_mode |= ENABLE_VIRTUAL_TERMINAL_INPUT;        // User input is converted into VT sequences.
-    }
-    if (SetConsoleMode(stdin_h, stdin_mode) == 0) {
-        ExitWithError("SetConsoleMode(stdin_h)", true);
-    }
-
-    if (!SystemCP) {
-        STDIN_ORIGINAL_CP = GetConsoleCP();                 // Set global, so we can restore the console settings on exit
-        SetConsoleCP(CP_UTF8);                              // Set UTF-8 codepage
-    }
-
-    return stdin_h;
+// Seconds elapsed since start (a value from Now()).
+//
+double SecondsSince(LONG64 start) {
+    return (double)(Now() - start) / QpcFrequency;
 }
 
 //
-// Initialise stdout. Check file type, parse VT sequences, set codepage etc.
+// Milliseconds from now until deadline (a value from Now()), rounded up. 0 if it has passed.
 //
-HANDLE InitStdout() {
-    HANDLE stdout_h = GetStdHandle(STD_OUTPUT_HANDLE);
-    if (stdout_h == INVALID_HANDLE_VALUE) {
-        ExitWithError("GetStdHandle(stdout)", true);
+DWORD MsUntil(LONG64 deadline) {
+    LONG64 ticks = deadline - Now();
+    if (ticks <= 0) {
+        return 0;
     }
+    return (DWORD)((ticks * 1000 + QpcFrequency - 1) / QpcFrequency);
+}
 
-    if (GetFileType(stdout_h) != FILE_TYPE_CHAR) {
-        ExitWithError("GetFileType(stdout_h)", true);
+//
+// CPU time (user + kernel) used by the process so far, in seconds.
+//
+double CpuSeconds() {
+    FILETIME created, exited, kernel, user;
+    if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user) == 0) {
+        return 0.0;
     }
+    ULONGLONG k = ((ULONGLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    ULONGLONG u = ((ULONGLONG)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return (k + u) / 1e7;   // FILETIME is in 100ns units
+}
 
-    if (GetConsoleMode(stdout_h, &STDOUT_ORIGINAL_MODE) == 0) { // Set global, so we can restore the console settings on exit
-        ExitWithError("GetConsoleMode(stdout_h)", true);
-    }
-    DWORD stdout_mode = ENABLE_WRAP_AT_EOL_OUTPUT;              // Wrap cursor        
-    if (!DisableVT) {
-        stdout_mode |= ENABLE_PROCESSED_OUTPUT;                 // Process control sequences
-        stdout_mode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;      // Parse VT sequences                
+//
+// Quit normally (e.g. Ctrl-F10).
+//
+void Quit() {
+    fprintf(stderr, "\nspconnect quitting.\n");
+    if (ShowStats) {
+        PrintStats();
     }
-    if (SetConsoleMode(stdout_h, stdout_mode ) == 0) {
-        ExitWithError("SetConsoleMode(stdout_h)", true);
+    if (StatsFile != NULL) {
+        WriteStats();
     }
-
-    if (!SystemCP) {
-        STDOUT_ORIGINAL_CP = GetConsoleOutputCP();              // Set global, so we can restore the console settings on exit
-        SetConsoleOutputCP(CP_UTF8);                            // Set UTF-8 codepage
+    if (LatencyProbe) {
+        PrintLatency();
     }
-
-    return stdout_h;
+    CloseLog(&SessionLog);
+    CloseCapture(&SessionCapture);
+    RestoreConsole();
+    exit(0);
 }
 
 //
-// Restore stdin and stdout to initial settings (during exit).
+// Allocate a ring of at least size bytes, with room for mark_count timestamp marks (0 for none).
 //
-void RestoreConsole() {
-    HANDLE stdin_h = GetStdHandle(STD_INPUT_HANDLE);
-    if (stdin_h != INVALID_HANDLE_VALUE && STDIN_ORIGINAL_MODE != 0) {
-        SetConsoleMode(stdin_h, STDIN_ORIGINAL_MODE);
+void RingInit(Ring * r, DWORD size, DWORD mark_count) {
+    r->size = CACHE_LINE;
+    while (r->size < size) {
+        r->size <<= 1;
     }
-    if (STDIN_ORIGINAL_CP != 0) {
-        SetConsoleCP(STDIN_ORIGINAL_CP);
+    r->buf = VirtualAlloc(NULL, (SIZE_T)r->size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (r->buf == NULL) {
+        ExitWithError("VirtualAlloc(ring)", true);
     }
-    HANDLE stdout_h = GetStdHandle(STD_OUTPUT_HANDLE);
-    if (stdout_h != INVALID_HANDLE_VALUE && STDOUT_ORIGINAL_MODE != 0) {
-        SetConsoleMode(stdout_h, STDOUT_ORIGINAL_MODE);
+    r->data_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    r->space_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (r->data_event == NULL || r->space_event == NULL) {
+        ExitWithError("CreateEvent(ring)", true);
     }
-    if (STDOUT_ORIGINAL_CP != 0) {
-        SetConsoleOutputCP(STDOUT_ORIGINAL_CP);
+    r->head = 0;
+    r->tail = 0;
+    r->peak = 0;
+    r->marks = NULL;
+    r->mark_count = mark_count;
+    r->mark_head = 0;
+    r->mark_tail = 0;
+    if (mark_count > 0) {
+        r->marks = VirtualAlloc(NULL, mark_count * sizeof(Mark), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (r->marks == NULL) {
+            ExitWithError("VirtualAlloc(marks)", true);
+        }
     }
 }
 
 //
-// Initialise serial port. 
+// Number of bytes in the ring. Safe to call from either side.
 //
-HANDLE InitPort(char * sp_s) {
-    // Open the serial port
-    HANDLE port = CreateFileA(sp_s, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_WRITE_THROUGH | FILE_FLAG_NO_BUFFERING, NULL);
-    if (port == INVALID_HANDLE_VALUE) {
-        ExitWithError("CreateFileA(sp_s)", true);
-    }
+DWORD RingUsed(Ring * r) {
+    return (DWORD)(ReadAcquire64(&r->head) - ReadAcquire64(&r->tail));
+}
 
-    // Set comms timeouts.
-    // We request for our reads to return straight away, even if there are no bytes (non-blocking). 
-    // Writes will eventually timeout.
-    COMMTIMEOUTS cto = { MAXDWORD, 0, 0, 0, WriteTimeout };        
-    if (SetCommTimeouts(port, &cto) == 0) {
-        ExitWithError("SetCommTimeouts", true);
-    }
+//
+// Number of bytes free in the ring. Safe to call from either side.
+//
+DWORD RingFree(Ring * r) {
+    return (DWORD)r->size - RingUsed(r);
+}
 
-    return port;    
+//
+// Producer: find the contiguous free space at the head. Returns its size, and sets *p to it.
+//
+DWORD RingWritable(Ring * r, char ** p) {
+    LONG64 head = r->head;
+    LONG64 free_bytes = r->size - (head - ReadAcquire64(&r->tail));
+    LONG64 offset = head & (r->size - 1);
+    *p = r->buf + offset;
+    return (DWORD)min(free_bytes, r->size - offset);
 }
 
 //
-// Configure serial port. e.g. baud rate, data bits, etc.
+// Producer: publish n bytes written into the space from RingWritable().
 //
-void ConfigureSerialPort(HANDLE port, DWORD baud_rate) {
-    DCB dcbSerialParams = { 0 };
-    dcbSerialParams.DCBlength = sizeof(dcbSerialParams);
-    if (!GetCommState(port, &dcbSerialParams)) {
-        ExitWithError("GetCommState: Error getting serial port state,", true);
+void RingCommit(Ring * r, DWORD n) {
+    if (n == 0) {
         return;
     }
+    LONG64 head = r->head + n;
+    WriteRelease64(&r->head, head);
+    LONG64 used = head - ReadAcquire64(&r->tail);
+    if (used > r->peak) {
+        r->peak = used;
+    }
+    SetEvent(r->data_event);
+}
+
+//
+// Producer: copy in as much of buf as fits. Returns the number of bytes copied.
+//
+DWORD RingPush(Ring * r, const char * buf, DWORD n) {
+    DWORD pushed = 0;
+    while (pushed < n) {
+        char * p;
+        DWORD len = min(RingWritable(r, &p), n - pushed);
+        if (len == 0) {
+            break;
+        }
+        memcpy(p, buf + pushed, len);
+        pushed += len;
+        RingCommit(r, len);
+    }
+    return pushed;
+}
 
-    // Modify settings as needed (e.g., set baud rate, parity, etc.)
-    dcbSerialParams.BaudRate = baud_rate;
-    dcbSerialParams.ByteSize = 8;
-    dcbSerialParams.Parity = NOPARITY;
-    dcbSerialParams.StopBits = ONESTOPBIT;
+//
+// Consumer: find the contiguous data at the tail. Returns its size, and sets *p to it.
+//
+DWORD RingReadable(Ring * r, char ** p) {
+    LONG64 tail = r->tail;
+    LONG64 used = ReadAcquire64(&r->head) - tail;
+    LONG64 offset = tail & (r->size - 1);
+    *p = r->buf + offset;
+    return (DWORD)min(used, r->size - offset);
+}
 
-    if (!SetCommState(port, &dcbSerialParams)) {
-        ExitWithError("SetCommState: Error setting serial port state,", true);
+//
+// Consumer: release n bytes from the tail.
+//
+void RingConsume(Ring * r, DWORD n) {
+    if (n == 0) {
         return;
     }
+    WriteRelease64(&r->tail, r->tail + n);
+    SetEvent(r->space_event);
 }
 
 //
-// Read stdin and fill the buffer with bytes. Nonblocking.
+// Producer: timestamp the data up to ring position pos (usually head, the data committed so far). time is when it
+// entered the program. If the consumer is mark_count marks behind, the chunk just isn't timed.
 //
-DWORD ReadStdin(HANDLE stdin_h, char * buf_c, DWORD buf_c_size) {    
-    INPUT_RECORD ir[RECORD_SIZE] = { 0 };   // Place to store the input records we read
-    wchar_t buf_w[WBUF_SIZE] = { 0 };       // Place to store the input characters we read
-    assert(RECORD_SIZE < WBUF_SIZE);        // We must have enough room to store all the characters we read
-    
-    // Find the number of records available
-    DWORD records_avail = 0;
-    GetNumberOfConsoleInputEvents(stdin_h, &records_avail);    
-    
-    // If there is no data, return early
-    if (records_avail < 1) {                            
-        return 0;
+void RingMark(Ring * r, LONG64 pos, LONG64 time) {
+    if (r->marks == NULL) {
+        return;
     }
-    
-    // Read no more than RECORD_SIZE records
-    records_avail = min(records_avail, RECORD_SIZE);    
+    LONG64 mh = r->mark_head;
+    if (mh - ReadAcquire64(&r->mark_tail) >= r->mark_count) {
+        return;
+    }
+    r->marks[mh % r->mark_count].pos = pos;
+    r->marks[mh % r->mark_count].time = time;
+    WriteRelease64(&r->mark_head, mh + 1);
+}
 
-    // Read the console events.
-    // We must use ReadConsoleInputW instead of ReadConsoleInputA to avoid clobbering unicode input.
-    // See: https://github.com/microsoft/terminal/issues/7777
-    // Specifically comment: https://github.com/microsoft/terminal/issues/7777#issuecomment-726912745
-    DWORD records_read = 0;
-    if (ReadConsoleInputW(stdin_h, ir, records_avail, &records_read) == 0) {
-        ExitWithError("ReadConsoleInputW", true);
+//
+// Consumer: after consuming, record the latency of every marked chunk that is now completely through.
+//
+void RingUnmark(Ring * r, Histogram * h) {
+    if (r->marks == NULL) {
+        return;
     }
-    if (records_read != records_avail) {
-        ExitWithError("ReadConsoleInputW failed to read all available records.", false);
+    LONG64 now = Now();
+    LONG64 mt = r->mark_tail;
+    LONG64 mh = ReadAcquire64(&r->mark_head);
+    while (mt < mh && r->marks[mt % r->mark_count].pos <= r->tail) {
+        HistRecord(h, (now - r->marks[mt % r->mark_count].time) * 1000000 / QpcFrequency);
+        mt++;
     }
-    
-    // Process the event records and extract only the keyboard data
-    DWORD buf_w_idx = 0;
-    for (DWORD i = 0; i < records_read; i++) {
-        if (ir[i].EventType != KEY_EVENT) continue;         // Only interested in key events
-        if (ir[i].Event.KeyEvent.bKeyDown != 1) continue;   // Only interested in keydown events            
-        wchar_t c = ir[i].Event.KeyEvent.uChar.UnicodeChar; // Read one wchar
-
-        // Check for Ctrl-F10 (in non-VT mode)
-        if (ir[i].Event.KeyEvent.dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) {    // Check for Ctrl
-            // Check for F10
-            if (ir[i].Event.KeyEvent.wVirtualKeyCode == VK_F10) {
-                fprintf(stderr, "\nspconnect quitting.\n");
-                RestoreConsole();
-                exit(0);
-            }
-        }
-
-        // Replace \r with \n, if requested
-        if (ReplaceCR && c == '\r') {                       
-            c = '\n';
-        }      
+    WriteRelease64(&r->mark_tail, mt);
+}
 
-        // Add character to buffer, so long as it's not just a control key being pressed by itself (which would be mapped as a NUL), but allow pasted NULs (!)
-        if (c != 0 || ir[i].Event.KeyEvent.dwControlKeyState == 0) {
-            buf_w[buf_w_idx++] = c;
-        }
+//
+// Add a value (in microseconds) to a histogram.
+//
+void HistRecord(Histogram * h, LONG64 usec) {
+    if (usec < 0) {
+        usec = 0;
     }
-    
-    // If there is no keyboard data, return early
-    if (buf_w_idx == 0) {                                   
-        return 0;
+    int bucket = 0;
+    while ((usec >> bucket) >= 32) {
+        bucket++;
+    }
+    int sub = (usec < 16) ? (int)usec : (int)((usec >> bucket) & 15);
+    if (usec >= 16) {
+        bucket++;
     }
 
-    // Convert the wide string buffer (W) to a multi-byte (utf-8) string buffer (A)
-    int bytes_stdin = WideCharToMultiByte(CP_UTF8, 0, buf_w, buf_w_idx, buf_c, buf_c_size, NULL, NULL);
-    if (bytes_stdin == 0) {
-        ExitWithError("WideCharToMultiByte", true);
+    // Beyond the top bucket, saturate. max keeps the true value.
+    if (bucket >= HIST_BUCKETS) {
+        bucket = HIST_BUCKETS - 1;
+        sub = 15;
     }
+    h->counts[bucket][sub]++;
+    h->total++;
+    if (usec > h->max) {
+        h->max = usec;
+    }
+}
 
-    // Check for Ctrl-F10 (in VT mode). \x1B [21;5~
-    for (int i = 0; i < bytes_stdin - 6; i++) {        
-        if (memcmp(buf_c, "\x1b""[21;5~", 7) == 0) {
-            fprintf(stderr, "\nspconnect quitting.\n");
-            RestoreConsole();
-            exit(0);
+//
+// Find the value (in microseconds) below which pct percent of the recorded values fall.
+// Returns the top of the matching bucket.
+//
+LONG64 HistPercentile(Histogram * h, double pct) {
+    LONG64 target = (LONG64)(h->total * pct / 100.0);
+    LONG64 seen = 0;
+    for (int bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+        for (int sub = 0; sub < 16; sub++) {
+            seen += h->counts[bucket][sub];
+            if (seen > target) {
+                LONG64 top = (bucket == 0) ? sub : (((LONG64)(17 + sub) << (bucket - 1)) - 1);
+                return min(top, h->max);
+            }
         }
     }
+    return h->max;
+}
 
-    return bytes_stdin;
+//
+// Print one latency histogram as percentiles.
+//
+void PrintHist(const char * name, Histogram * h) {
+    if (h->total == 0) {
+        fprintf(stderr, "Latency %s: no samples.\n", name);
+        return;
+    }
+    fprintf(stderr, "Latency %s: %lld samples, p50 %lld us, p99 %lld us, p99.9 %lld us, max %lld us.\n", name, h->total,
+        HistPercentile(h, 50.0), HistPercentile(h, 99.0), HistPercentile(h, 99.9), h->max);
 }
 
 //
-// Main function - program entry point.
+// Print the latency probe results (--latency).
 //
-int main(int argc, char* argv[]) {
-    char* sp_s = "";
-    DWORD BaudRate = 0;     // 0 is an invalid baud rate, anything other number we can try
+void PrintLatency() {
+    PrintHist("keyboard to port", &TxLatency);
+    PrintHist("port writes", &WriteLatency);
+    PrintHist("port to screen", &RxLatency);
+}
+
+//
+// Open the session log (appending) and start its writer thread.
+//
+void OpenLog(LogFile * log, const char * path) {
+    log->name = "Log file";
+    log->file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (log->file == INVALID_HANDLE_VALUE) {
+        log->file = NULL;
+        ExitWithError("CreateFileA(log)", true);
+    }
+    LARGE_INTEGER zero = { 0 };
+    if (SetFilePointerEx(log->file, zero, NULL, FILE_END) == 0) {
+        ExitWithError("SetFilePointerEx(log)", true);
+    }
+    RingInit(&log->ring, LOG_RING_SIZE * 1024, 0);
+    log->thread = CreateThread(NULL, 0, LogWriterThread, log, 0, &log->thread_id);
+    if (log->thread == NULL) {
+        ExitWithError("CreateThread(log)", true);
+    }
+}
+
+//
+// Append to the session log. Only copies into the ring; the writer thread does the disk I/O.
+// If the disk has fallen a whole ring behind we wait for it rather than lose data, and count a stall.
+//
+void LogWrite(LogFile * log, const char * buf, DWORD n) {
+    if (log->file == NULL) {
+        return;
+    }
+    DWORD pushed = RingPush(&log->ring, buf, n);
+    if (pushed < n) {
+        log->stalls++;
+        while (pushed < n) {
+            WaitForSingleObject(log->ring.space_event, INFINITE);
+            pushed += RingPush(&log->ring, buf + pushed, n - pushed);
+        }
+    }
+}
+
+//
+// Log writer thread. Writes the ring to disk in LOG_BLOCK sized pieces. A partial block is written once
+// it has waited LOG_FLUSH_TIME, and everything is written when closing.
+//
+DWORD WINAPI LogWriterThread(LPVOID param) {
+    LogFile * log = (LogFile *)param;
+    ULONGLONG last_write = GetTickCount64();
+    while (1) {
+        WaitForSingleObject(log->ring.data_event, LOG_FLUSH_TIME);
+        bool closing = ReadAcquire(&log->closing) != 0;
+        bool flush_all = closing || (GetTickCount64() - last_write >= LOG_FLUSH_TIME);
+
+        char * p;
+        DWORD len;
+        while ((len = RingReadable(&log->ring, &p)) > 0) {
+            if (!flush_all) {
+                len -= len % LOG_BLOCK;
+                if (len == 0) {
+                    break;
+                }
+            }
+            DWORD bytes_written = 0;
+            if (WriteFile(log->file, p, len, &bytes_written, NULL) == 0 || bytes_written != len) {
+                ExitWithError("WriteFile(log)", true);
+            }
+            log->written += bytes_written;
+            RingConsume(&log->ring, len);
+            last_write = GetTickCount64();
+        }
+
+        if (closing) {
+            FlushFileBuffers(log->file);
+            return 0;
+        }
+    }
+}
+
+//
+// Flush and close the session log. Safe to call from any thread, including on the way out through ExitWithError().
+//
+void CloseLog(LogFile * log) {
+    if (log->file == NULL || log->thread == NULL || GetCurrentThreadId() == log->thread_id) {
+        return;
+    }
+    InterlockedExchange(&log->closing, 1);
+    SetEvent(log->ring.data_event);
+    if (WaitForSingleObject(log->thread, LOG_CLOSE_TIMEOUT) != WAIT_OBJECT_0) {
+        fprintf(stderr, "WARNING: Timed out writing %s.\n", log->name);
+    }
+    if (log->stalls > 0) {
+        fprintf(stderr, "WARNING: %s fell behind %lld times, slowing the terminal.\n", log->name, log->stalls);
+    }
+    CloseHandle(log->file);
+    log->file = NULL;
+}
+
+//
+// Create the capture file, write its header, and start its writer thread.
+//
+void OpenCapture(Capture * cap, const char * path) {
+    cap->log.name = "Capture file";
+    cap->log.file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (cap->log.file == INVALID_HANDLE_VALUE) {
+        cap->log.file = NULL;
+        ExitWithError("CreateFileA(capture)", true);
+    }
+
+    CaptureHeader hdr = { CAPTURE_MAGIC, QpcFrequency };
+    GetSystemTimeAsFileTime(&hdr.start);
+    DWORD bytes_written = 0;
+    if (WriteFile(cap->log.file, &hdr, sizeof(hdr), &bytes_written, NULL) == 0 || bytes_written != sizeof(hdr)) {
+        ExitWithError("WriteFile(capture)", true);
+    }
+    cap->offset = sizeof(hdr);
+    cap->last_index = -1;
+    cap->next_index = CAPTURE_INDEX_INTERVAL;
+
+    RingInit(&cap->log.ring, LOG_RING_SIZE * 1024, 0);
+    cap->log.thread = CreateThread(NULL, 0, LogWriterThread, &cap->log, 0, &cap->log.thread_id);
+    if (cap->log.thread == NULL) {
+        ExitWithError("CreateThread(capture)", true);
+    }
+}
+
+//
+// Append one record to the capture. Console thread only.
+//
+void CaptureRecordWrite(Capture * cap, BYTE type, BYTE port, LONG64 time, const char * buf, DWORD n) {
+    CaptureRecord rec = { time - StartTime, type, port, { 0 }, n };
+    LogWrite(&cap->log, (const char *)&rec, sizeof(rec));
+    LogWrite(&cap->log, buf, n);
+    cap->offset += sizeof(rec) + n;
+}
+
+//
+// Capture a chunk of data, keeping a seek index record at every multiple of CAPTURE_INDEX_INTERVAL. A chunk that
+// would cross one is split there. The space before one is never left too small for a record header: if it would
+// be, it's filled with a CAP_PAD record instead. Console thread only.
+// time is when the data entered the program (a value from Now()).
+//
+void CaptureWrite(Capture * cap, BYTE type, BYTE port, LONG64 time, const char * buf, DWORD n) {
+    static const char zeros[sizeof(CaptureRecord)] = { 0 };
+    const DWORD hdr = sizeof(CaptureRecord);
+    if (cap->log.file == NULL || n == 0) {
+        return;
+    }
+    while (n > 0) {
+        DWORD space = (DWORD)(cap->next_index - cap->offset);       // 0, or at least hdr
+        if (space == 0) {
+            LONG64 index_offset = cap->offset;
+            CaptureRecordWrite(cap, CAP_INDEX, 0, time, (const char *)&cap->last_index, sizeof(cap->last_index));
+            cap->last_index = index_offset;
+            cap->next_index = index_offset + CAPTURE_INDEX_INTERVAL;
+            continue;
+        }
+        // Payload that fits before the index record. Write all of the chunk if that leaves room for another header
+        // (or nothing), otherwise as much as fills the space, or leaves exactly enough for a CAP_PAD header.
+        DWORD room = space - hdr;
+        DWORD len = (n + hdr <= room || (room > 0 && n >= room)) ? min(n, room) : (room > hdr) ? room - hdr : 0;
+        if (len > 0) {
+            CaptureRecordWrite(cap, type, port, time, buf, len);
+            buf += len;
+            n -= len;
+        }
+        else {
+            CaptureRecordWrite(cap, CAP_PAD, 0, time, zeros, room);
+        }
+    }
+}
+
+//
+// Capture received data the console thread is about to consume from the front of the port's RX ring. One record
+// per read, stamped with the time the read completed (from the ring's marks), however late it's shown. Data with
+// no mark of its own (the marks ran out) goes in with the next read. Console thread only.
+//
+void CaptureRx(Port * port, const char * buf, DWORD n) {
+    Ring * r = &port->rx;
+    if (SessionCapture.log.file == NULL || r->marks == NULL) {
+        return;
+    }
+    LONG64 pos = r->tail;
+    LONG64 mt = r->mark_tail;
+    LONG64 mh = ReadAcquire64(&r->mark_head);
+    for (DWORD done = 0; done < n; ) {
+        while (mt < mh && r->marks[mt % r->mark_count].pos <= pos + done) {
+            mt++;
+        }
+        DWORD len = n - done;
+        LONG64 time = Now();
+        if (mt < mh) {
+            len = (DWORD)min(len, r->marks[mt % r->mark_count].pos - (pos + done));
+            time = r->marks[mt % r->mark_count].time;
+        }
+        CaptureWrite(&SessionCapture, CAP_RX, (BYTE)(port - Ports), time, buf + done, len);
+        done += len;
+    }
+}
+
+//
+// Finish the capture with a CAP_END record, and flush and close it.
+// The CAP_END record can only be added from the console thread (the only writer). From other threads
+// (e.g. ExitWithError) the data is still flushed, and a reader treats the missing CAP_END as an unclean close.
+//
+void CloseCapture(Capture * cap) {
+    if (cap->log.file == NULL) {
+        return;
+    }
+    if (GetCurrentThreadId() == ConsoleThreadId) {
+        CaptureWrite(cap, CAP_END, 0, Now(), (const char *)&cap->last_index, sizeof(cap->last_index));
+    }
+    CloseLog(&cap->log);
+}
+
+//
+// Format a buffer as a classic hex dump, 16 bytes per row, into out. Returns the number of characters written.
+// out must have room for HEX_ROW_SIZE per started row of 16 bytes. e.g.:
+// RX 00000010  48 65 6c 6c 6f 2c 20 77  6f 72 6c 64 21 0d 0a 00  |Hello, world!...|
+// Table driven: each byte is looked up, rather than going through printf.
+//
+DWORD FormatHex(char * out, const char * tag, LONG64 offset, const unsigned char * buf, DWORD n) {
+    static const char hex_digits[] = "0123456789abcdef";
+    static char hex_pairs[256][2];
+    static char printable[256];
+    if (hex_pairs[1][1] == 0) {
+        for (int c = 0; c < 256; c++) {
+            hex_pairs[c][0] = hex_digits[c >> 4];
+            hex_pairs[c][1] = hex_digits[c & 15];
+            printable[c] = (c >= 0x20 && c < 0x7F) ? (char)c : '.';
+        }
+    }
+
+    char * o = out;
+    for (DWORD row = 0; row < n; row += 16) {
+        DWORD row_len = min(16, n - row);
+        const unsigned char * b = buf + row;
+
+        // Tag and offset
+        o[0] = tag[0];
+        o[1] = tag[1];
+        o[2] = ' ';
+        o += 3;
+        LONG64 row_offset = offset + row;
+        for (int i = 7; i >= 0; i--) {
+            o[i] = hex_digits[row_offset & 15];
+            row_offset >>= 4;
+        }
+        o[8] = ' ';
+        o += 9;
+
+        // Hex, with an extra space in the middle. Short rows are padded so the ASCII column lines up.
+        for (DWORD i = 0; i < 16; i++) {
+            if (i == 8) {
+                *o++ = ' ';
+            }
+            *o++ = ' ';
+            if (i < row_len) {
+                o[0] = hex_pairs[b[i]][0];
+                o[1] = hex_pairs[b[i]][1];
+            } else {
+                o[0] = ' ';
+                o[1] = ' ';
+            }
+            o += 2;
+        }
+
+        // ASCII
+        o[0] = ' ';
+        o[1] = ' ';
+        o[2] = '|';
+        o += 3;
+        for (DWORD i = 0; i < row_len; i++) {
+            *o++ = printable[b[i]];
+        }
+        o[0] = '|';
+        o[1] = '\r';
+        o[2] = '\n';
+        o += 3;
+    }
+    return (DWORD)(o - out);
+}
+
+//
+// Write a buffer to the console as a hex dump, HEX_CHUNK bytes per console write (more if the console takes only part
+// of one). Counted in the console statistics like WriteShown(), by the characters written.
+//
+void WriteHex(HANDLE stdout_h, const char * tag, LONG64 offset, const char * buf, DWORD n) {
+    static char out[HEX_CHUNK / 16 * HEX_ROW_SIZE];
+    LONG64 write_start = Now();
+    for (DWORD done = 0; done < n; done += HEX_CHUNK) {
+        DWORD len = FormatHex(out, tag, offset + done, (const unsigned char *)buf + done, min(HEX_CHUNK, n - done));
+        for (DWORD written = 0; written < len; ) {
+            DWORD bytes_written = 0;
+            if (WriteConsoleA(stdout_h, out + written, len - written, &bytes_written, NULL) == 0) {
+                ExitWithError("WriteConsoleA(stdout_h) (hex)", true);
+            }
+            written += bytes_written;
+            ConsoleWrites++;
+            if (written < len) {
+                ConsoleShortWrites++;
+            }
+        }
+        ConsoleBytes += len;
+    }
+    ConsoleTicks += Now() - write_start;
+}
+
+//
+// Hex dump benchmark (--hex-bench). Formats megabytes of the loopback test pattern, HEX_CHUNK bytes at a time as -x
+// does, without writing it anywhere, and reports the rate. This is the formatter on its own, on one core.
+//
+void HexBench(DWORD megabytes) {
+    static unsigned char buf[HEX_CHUNK];
+    static char out[HEX_CHUNK / 16 * HEX_ROW_SIZE];
+    LONG64 total = (LONG64)megabytes * 1048576;
+    LONG64 text = 0;
+
+    fprintf(stderr, "Hex benchmark: formatting %u MB.\n", megabytes);
+    double cpu_start = CpuSeconds();
+    LONG64 start = Now();
+    for (LONG64 done = 0; done < total; done += HEX_CHUNK) {
+        for (DWORD i = 0; i < HEX_CHUNK; i++) {
+            LONG64 pos = done + i;
+            buf[i] = (unsigned char)(pos ^ (pos >> 8) ^ (pos >> 16));
+        }
+        text += FormatHex(out, "RX", done, buf, HEX_CHUNK);
+    }
+
+    double secs = SecondsSince(start);
+    fprintf(stderr, "Hex benchmark: %.1f MB/s (%.0f Mbit/s of data) into %.1f MB/s of text, over %.2f s, CPU %.1f%%.\n",
+        total / 1048576.0 / secs, total * 8 / 1e6 / secs, text / 1048576.0 / secs, secs,
+        (CpuSeconds() - cpu_start) * 100.0 / secs);
+    exit(0);
+}
+
+//
+// Read the time of the capture index record at a file offset. Returns false if there isn't one there.
+//
+bool ReadCaptureIndex(HANDLE f, LONG64 offset, LONG64 * time) {
+    LARGE_INTEGER pos = { 0 };
+    pos.QuadPart = offset;
+    CaptureRecord rec;
+    DWORD bytes_read = 0;
+    if (SetFilePointerEx(f, pos, NULL, FILE_BEGIN) == 0 || ReadFile(f, &rec, sizeof(rec), &bytes_read, NULL) == 0
+        || bytes_read != sizeof(rec) || rec.type != CAP_INDEX || rec.length != sizeof(LONG64)) {
+        return false;
+    }
+    *time = rec.time;
+    return true;
+}
+
+//
+// Print a capture file as text (--dump). One line per record: seconds since the start, port index, direction, length,
+// and the data with non-printable bytes escaped. With --hex-dump, the data follows as a hex dump instead.
+//
+void DumpCapture(const char * path) {
+    HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (f == INVALID_HANDLE_VALUE) {
+        ExitWithError("CreateFileA(dump)", true);
+    }
+
+    CaptureHeader hdr;
+    DWORD bytes_read = 0;
+    if (ReadFile(f, &hdr, sizeof(hdr), &bytes_read, NULL) == 0 || bytes_read != sizeof(hdr) || memcmp(hdr.magic, CAPTURE_MAGIC, 8) != 0) {
+        ExitWithError("Not a spconnect capture file.", false);
+    }
+    SYSTEMTIME utc, local;
+    FileTimeToSystemTime(&hdr.start, &utc);
+    SystemTimeToTzSpecificLocalTime(NULL, &utc, &local);
+    printf("Capture started %04u-%02u-%02u %02u:%02u:%02u.%03u\n", local.wYear, local.wMonth, local.wDay, local.wHour, local.wMinute, local.wSecond, local.wMilliseconds);
+
+    // With --from, find the last index record at or before that time, by binary search over the index records at
+    // every multiple of CAPTURE_INDEX_INTERVAL. Start one index earlier, as received data is stamped with its read
+    // time, so can be a little earlier than what was captured just before it.
+    LONG64 from = (LONG64)(DumpFrom * hdr.frequency);
+    if (from > 0) {
+        LARGE_INTEGER size = { 0 };
+        GetFileSizeEx(f, &size);
+        LONG64 lo = 0;
+        LONG64 hi = size.QuadPart / CAPTURE_INDEX_INTERVAL;
+        while (lo < hi) {
+            LONG64 mid = (lo + hi + 1) / 2;
+            LONG64 time;
+            if (ReadCaptureIndex(f, mid * CAPTURE_INDEX_INTERVAL, &time) && time <= from) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        LARGE_INTEGER start = { 0 };
+        start.QuadPart = (lo > 1) ? (lo - 1) * CAPTURE_INDEX_INTERVAL : sizeof(hdr);
+        SetFilePointerEx(f, start, NULL, FILE_BEGIN);
+    }
+
+    static char payload[BUF_SIZE];
+    static char text[BUF_SIZE / 16 * HEX_ROW_SIZE];   // Big enough for either escaped text or a hex dump
+    static const char * type_names[] = { "??", "RX", "TX", "--" };
+    bool clean = false;
+    CaptureRecord rec;
+    while (ReadFile(f, &rec, sizeof(rec), &bytes_read, NULL) != 0 && bytes_read == sizeof(rec)) {
+        // Seek index and padding records aren't shown, and nor is anything before --from
+        if (rec.type == CAP_INDEX || rec.type == CAP_END || rec.type == CAP_PAD || rec.time < from) {
+            LARGE_INTEGER skip = { 0 };
+            skip.QuadPart = rec.length;
+            SetFilePointerEx(f, skip, NULL, FILE_CURRENT);
+            clean = (rec.type == CAP_END);
+            continue;
+        }
+
+        const char * type_name = type_names[rec.type <= CAP_CONTROL ? rec.type : 0];
+        printf("%12.6f %u %s %5u ", (double)rec.time / hdr.frequency, rec.port, type_name, rec.length);
+        if (HexDump) {
+            putchar('\n');
+        }
+        DWORD remaining = rec.length;
+        while (remaining > 0) {
+            if (ReadFile(f, payload, min(remaining, BUF_SIZE), &bytes_read, NULL) == 0 || bytes_read == 0) {
+                ExitWithError("Capture file is truncated.", false);
+            }
+            if (HexDump) {
+                DWORD len = FormatHex(text, type_name, rec.length - remaining, (const unsigned char *)payload, bytes_read);
+                fwrite(text, 1, len, stdout);
+                remaining -= bytes_read;
+                continue;
+            }
+            remaining -= bytes_read;
+            DWORD t = 0;
+            for (DWORD i = 0; i < bytes_read; i++) {
+                unsigned char c = payload[i];
+                if (c == '\\')                 { text[t++] = '\\'; text[t++] = '\\'; }
+                else if (c == '\r')            { text[t++] = '\\'; text[t++] = 'r'; }
+                else if (c == '\n')            { text[t++] = '\\'; text[t++] = 'n'; }
+                else if (c == '\t')            { text[t++] = '\\'; text[t++] = 't'; }
+                else if (c >= 0x20 && c < 0x7F) { text[t++] = c; }
+                else {
+                    text[t++] = '\\';
+                    text[t++] = 'x';
+                    text[t++] = "0123456789abcdef"[c >> 4];
+                    text[t++] = "0123456789abcdef"[c & 15];
+                }
+            }
+            fwrite(text, 1, t, stdout);
+        }
+        if (!HexDump) {
+            putchar('\n');
+        }
+    }
+    if (!clean) {
+        fprintf(stderr, "WARNING: Capture was not closed cleanly.\n");
+    }
+    CloseHandle(f);
+}
+
+//
+// Globals to store console settings so they can be restored on exit
+//
+DWORD  STDIN_ORIGINAL_MODE  = 0;
+UINT   STDIN_ORIGINAL_CP    = 0;
+DWORD  STDOUT_ORIGINAL_MODE = 0;
+UINT   STDOUT_ORIGINAL_CP   = 0;
+char   ORIGINAL_TITLE[MAX_PATH] = { 0 };
+
+//
+// Parse a key name (e.g. "ctrl-f10", "alt-shift-f3", "none") into a hotkey. Returns false if it's not a key we know.
+// Supports F1 to F12 with any of the Ctrl, Alt and Shift modifiers.
+//
+bool ParseHotkey(Hotkey * hk, const char * key) {
+    hk->key = key;
+    hk->vk = 0;
+    hk->mods = 0;
+    hk->seq_len = 0;
+    hk->display[0] = 0;
+    if (strcmp(key, "none") == 0) {
+        return true;
+    }
+
+    // Modifiers
+    const char * k = key;
+    while (1) {
+        if (strncmp(k, "ctrl-", 5) == 0)       { hk->mods |= HKMOD_CTRL;  k += 5; }
+        else if (strncmp(k, "alt-", 4) == 0)   { hk->mods |= HKMOD_ALT;   k += 4; }
+        else if (strncmp(k, "shift-", 6) == 0) { hk->mods |= HKMOD_SHIFT; k += 6; }
+        else break;
+    }
+
+    // Function key
+    if (k[0] != 'f') {
+        return false;
+    }
+    int n = atoi(k + 1);
+    if (n < 1 || n > 12) {
+        return false;
+    }
+    hk->vk = (WORD)(VK_F1 + n - 1);
+
+    // The VT sequence the console sends for it. The modifier parameter is 1 + the HKMOD_* bits.
+    static const int f_codes[13] = { 0, 0, 0, 0, 0, 15, 17, 18, 19, 20, 21, 23, 24 };
+    int m = 1 + hk->mods;
+    if (n <= 4 && m == 1) {
+        hk->seq_len = snprintf(hk->seq, HOTKEY_MAX_LEN, "\x1bO%c", "PQRS"[n - 1]);
+    } else if (n <= 4) {
+        hk->seq_len = snprintf(hk->seq, HOTKEY_MAX_LEN, "\x1b[1;%d%c", m, "PQRS"[n - 1]);
+    } else if (m == 1) {
+        hk->seq_len = snprintf(hk->seq, HOTKEY_MAX_LEN, "\x1b[%d~", f_codes[n]);
+    } else {
+        hk->seq_len = snprintf(hk->seq, HOTKEY_MAX_LEN, "\x1b[%d;%d~", f_codes[n], m);
+    }
+
+    // Display name, e.g. "Ctrl-F10"
+    snprintf(hk->display, sizeof(hk->display), "%s%s%sF%d",
+        (hk->mods & HKMOD_CTRL) ? "Ctrl-" : "", (hk->mods & HKMOD_ALT) ? "Alt-" : "", (hk->mods & HKMOD_SHIFT) ? "Shift-" : "", n);
+    return true;
+}
+
+//
+// Carry out a hotkey action.
+//
+void RunHotkey(int action) {
+    switch (action) {
+    case HK_QUIT:
+        Quit();
+        break;
+    case HK_LATENCY:
+        if (LatencyProbe) {
+            PrintLatency();
+        }
+        break;
+    case HK_SEND_FILE:
+        Sending.requested = true;       // Handled by the main loop, once this read of the console is done
+        break;
+    case HK_UPLOAD:
+        Xfer.requested = 1;             // Handled by the main loop, like send-file
+        break;
+    case HK_DOWNLOAD:
+        Xfer.requested = 2;
+        break;
+    case HK_NEXT_PORT:
+        TargetRequested = true;         // Handled by the main loop, like send-file
+        break;
+    case HK_STATUS:
+        StatusLine = !StatusLine;
+        if (StatusLine) {
+            ShowStatus();
+        } else {
+            SetConsoleTitleA(ORIGINAL_TITLE);
+        }
+        break;
+    case HK_PASTE_START:
+        PasteBegin(true);
+        break;
+    case HK_PASTE_END:
+        Paste.input_done = true;
+        break;
+    }
+}
+
+//
+// Find the hotkey for a key press in non-VT mode. Returns the action, or -1.
+//
+int MatchHotkeyVk(WORD vk, DWORD control_key_state) {
+    DWORD mods = 0;
+    if (control_key_state & SHIFT_PRESSED)                           mods |= HKMOD_SHIFT;
+    if (control_key_state & (LEFT_ALT_PRESSED | RIGHT_ALT_PRESSED))  mods |= HKMOD_ALT;
+    if (control_key_state & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) mods |= HKMOD_CTRL;
+    for (int i = 0; i < HOTKEY_COUNT; i++) {
+        if (Hotkeys[i].vk != 0 && Hotkeys[i].vk == vk && Hotkeys[i].mods == mods) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//
+// Find and carry out hotkeys in VT input, removing them from the buffer. Returns the new length.
+// Works in a single pass, jumping between ESC bytes with memchr, so ordinary typing costs one memchr.
+// A possible hotkey at the very end of the buffer is held back and matched with the next read.
+// buf must have HOTKEY_MAX_LEN bytes spare after n, to put held bytes back.
+//
+DWORD FilterHotkeys(HotkeyMatcher * m, char * buf, DWORD n) {
+    // Put back anything held from last time
+    if (m->held_len > 0) {
+        memmove(buf + m->held_len, buf, n);
+        memcpy(buf, m->held, m->held_len);
+        n += m->held_len;
+        m->held_len = 0;
+    }
+
+    char * esc = memchr(buf, 0x1b, n);
+    if (esc == NULL) {
+        return n;
+    }
+
+    DWORD w = (DWORD)(esc - buf);   // Write position
+    DWORD r = w;                    // Read position, always at or after w
+    while (r < n) {
+        // Copy everything up to the next ESC
+        if (buf[r] != 0x1b) {
+            esc = memchr(buf + r, 0x1b, n - r);
+            DWORD run_end = (esc != NULL) ? (DWORD)(esc - buf) : n;
+            memmove(buf + w, buf + r, run_end - r);
+            w += run_end - r;
+            r = run_end;
+            continue;
+        }
+
+        // At an ESC. Look for a hotkey sequence, or the start of one cut off by the end of the buffer.
+        DWORD avail = n - r;
+        int action = -1;
+        bool partial = false;
+        for (int i = 0; i < HOTKEY_COUNT; i++) {
+            Hotkey * hk = &Hotkeys[i];
+            if (hk->seq_len == 0) {
+                continue;
+            }
+            if (avail >= hk->seq_len && memcmp(buf + r, hk->seq, hk->seq_len) == 0) {
+                action = i;
+                break;
+            }
+            if (avail < hk->seq_len && memcmp(buf + r, hk->seq, avail) == 0) {
+                partial = true;
+            }
+        }
+
+        if (action >= 0 && Hotkeys[action].pass_through) {
+            memmove(buf + w, buf + r, Hotkeys[action].seq_len);
+            w += Hotkeys[action].seq_len;
+            r += Hotkeys[action].seq_len;
+            RunHotkey(action);
+        } else if (action >= 0) {
+            r += Hotkeys[action].seq_len;
+            RunHotkey(action);
+        } else if (partial) {
+            memcpy(m->held, buf + r, avail);
+            m->held_len = avail;
+            break;
+        } else {
+            buf[w++] = buf[r++];
+        }
+    }
+    return w;
+}
+
+//
+// The rest of a held hotkey sequence didn't arrive in time, so it wasn't a hotkey.
+// Moves the held bytes into buf, and returns how many.
+//
+DWORD FlushHotkeys(HotkeyMatcher * m, char * buf) {
+    DWORD n = m->held_len;
+    memcpy(buf, m->held, n);
+    m->held_len = 0;
+    return n;
+}
+
+// 
+// Initialise stdin. Check that is a supported file type, configure it, disable line-edit mode, etc.
+//
+HANDLE InitStdin() {
+    HANDLE stdin_h = GetStdHandle(STD_INPUT_HANDLE);    
+    if (stdin_h == INVALID_HANDLE_VALUE) {
+        ExitWithError("GetStdHandle(stdin)", true);
+    }
+    
+    if (GetFileType(stdin_h) != FILE_TYPE_CHAR) {
+        ExitWithError("GetFileType(stdin_h)", true);
+    }
+
+    if (GetConsoleMode(stdin_h, &STDIN_ORIGINAL_MODE) == 0) {   // Set global, so we can restore the console settings on exit
+        ExitWithError("GetConsoleMode(stdin_h)", true);
+    }
+    DWORD stdin_mode =         
+        ENABLE_QUICK_EDIT_MODE | ENABLE_EXTENDED_FLAGS      // Allow the user to use the mouse to select and edit text
+    //  | ENABLE_MOUSE_INPUT                                // Receive mouse input events
+        | ENABLE_WINDOW_INPUT                               // Receive messages about changes to the size of the console screen buffer        
+    ;
+    if (!DisableVT) {
+        //stdin_mode |= ENABLE_PROCESSED_INPUT;             // CTRL+C to be handled by the system
+        stdin_mode |= ENABLE_VIRTUAL_TERMINAL_INPUT;        // User input is converted into VT sequences.
+    }
+    if (SetConsoleMode(stdin_h, stdin_mode) == 0) {
+        ExitWithError("SetConsoleMode(stdin_h)", true);
+    }
+
+    if (!SystemCP) {
+        STDIN_ORIGINAL_CP = GetConsoleCP();                 // Set global, so we can restore the console settings on exit
+        SetConsoleCP(CP_UTF8);                              // Set UTF-8 codepage
+    }
+
+    return stdin_h;
+}
+
+//
+// Initialise stdout. Check file type, parse VT sequences, set codepage etc.
+//
+HANDLE InitStdout() {
+    HANDLE stdout_h = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (stdout_h == INVALID_HANDLE_VALUE) {
+        ExitWithError("GetStdHandle(stdout)", true);
+    }
+
+    if (GetFileType(stdout_h) != FILE_TYPE_CHAR) {
+        ExitWithError("GetFileType(stdout_h)", true);
+    }
+
+    if (GetConsoleMode(stdout_h, &STDOUT_ORIGINAL_MODE) == 0) { // Set global, so we can restore the console settings on exit
+        ExitWithError("GetConsoleMode(stdout_h)", true);
+    }
+    DWORD stdout_mode = ENABLE_WRAP_AT_EOL_OUTPUT;              // Wrap cursor        
+    if (!DisableVT) {
+        stdout_mode |= ENABLE_PROCESSED_OUTPUT;                 // Process control sequences
+        stdout_mode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;      // Parse VT sequences                
+    }
+    if (SetConsoleMode(stdout_h, stdout_mode ) == 0) {
+        ExitWithError("SetConsoleMode(stdout_h)", true);
+    }
+
+    if (!SystemCP) {
+        STDOUT_ORIGINAL_CP = GetConsoleOutputCP();              // Set global, so we can restore the console settings on exit
+        SetConsoleOutputCP(CP_UTF8);                            // Set UTF-8 codepage
+    }
+
+    GetConsoleTitleA(ORIGINAL_TITLE, MAX_PATH);                 // Set global, as paste progress changes the title
+
+    return stdout_h;
+}
+
+//
+// Restore stdin and stdout to initial settings (during exit).
+//
+void RestoreConsole() {
+    HANDLE stdin_h = GetStdHandle(STD_INPUT_HANDLE);
+    if (stdin_h != INVALID_HANDLE_VALUE && STDIN_ORIGINAL_MODE != 0) {
+        SetConsoleMode(stdin_h, STDIN_ORIGINAL_MODE);
+    }
+    if (STDIN_ORIGINAL_CP != 0) {
+        SetConsoleCP(STDIN_ORIGINAL_CP);
+    }
+    HANDLE stdout_h = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (stdout_h != INVALID_HANDLE_VALUE && STDOUT_ORIGINAL_MODE != 0) {
+        SetConsoleMode(stdout_h, STDOUT_ORIGINAL_MODE);
+    }
+    if (STDOUT_ORIGINAL_CP != 0) {
+        SetConsoleOutputCP(STDOUT_ORIGINAL_CP);
+    }
+    if (ORIGINAL_TITLE[0] != 0) {
+        SetConsoleTitleA(ORIGINAL_TITLE);
+    }
+}
+
+//
+// Start tracking a paste.
+//
+void PasteBegin(bool bracketed) {
+    if (Paste.active) {
+        return;
+    }
+    Paste.active = true;
+    Paste.bracketed = bracketed;
+    Paste.input_done = false;
+    Paste.start = Now();
+    Paste.queued = 0;
+    Paste.tx_start = Target->tx_bytes + RingUsed(&Target->tx);   // Don't count what was queued before the paste
+    Paste.last_progress = 0;
+}
+
+//
+// Show paste progress and speed in the title bar. When done, put the title back.
+//
+void PasteProgress(bool done) {
+    if (done) {
+        Paste.active = false;
+        SetConsoleTitleA(ORIGINAL_TITLE);
+        return;
+    }
+    Paste.last_progress = Now();
+    LONG64 sent = max(Target->tx_bytes - Paste.tx_start, 0);
+    char title[128];
+    snprintf(title, sizeof(title), "spconnect: pasting, %lld of %lld%s bytes sent, %.0f bytes/s",
+        sent, Paste.queued, Paste.input_done ? "" : "+", sent / SecondsSince(Paste.start));
+    SetConsoleTitleA(title);
+}
+
+//
+// Initialise serial port. Exits if it can't be opened or configured.
+//
+void InitPort(Port * port) {
+    if (LowLatency) {
+        FtdiLatencyTimer(port);
+    }
+    if (!OpenPort(port)) {
+        char msg[MAX_PATH + 32];
+        snprintf(msg, sizeof(msg), "Opening %s,", port->name);
+        ExitWithError(msg, true);
+    }
+    if (port->is_pipe && port->line.baud != 0) {
+        fprintf(stderr, "WARNING: %s is a named pipe, ignoring port configuration.\n", port->name);
+    }
+
+    if (AutoBaud && !port->is_pipe) {
+        DetectBaudRate(port);
+    }
+
+    // Fast ports need RTS/CTS, or the UART's FIFO overruns whenever the driver is slow to empty it
+    DCB dcb = { 0 };
+    dcb.DCBlength = sizeof(dcb);
+    if (!port->is_pipe && GetCommState(port->h, &dcb) != 0 && dcb.BaudRate > HIGH_BAUD && !dcb.fOutxCtsFlow) {
+        fprintf(stderr, "WARNING: %s is at %u baud without RTS/CTS flow control, and may lose data. Add ,rtscts to -c.\n",
+            port->name, dcb.BaudRate);
+    }
+}
+
+//
+// Open a serial port, set its timeouts, and configure it if port->line.baud is set. Returns false if any of that fails
+// (GetLastError() says why), leaving the port closed.
+//
+bool OpenPort(Port * port) {
+    // Open the serial port for overlapped I/O, so we can wait on it together with the console
+    port->h = CreateFileA(port->name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_WRITE_THROUGH | FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+    if (port->h == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    // A named pipe (e.g. \\.\pipe\com1 from Hyper-V) has no comm settings. Reads on it already wait for data.
+    if (GetFileType(port->h) == FILE_TYPE_PIPE) {
+        port->is_pipe = true;
+        return true;
+    }
+
+    // Size the driver's queues. Big ones ride out bursts while no read is pending, but FTDI drivers also take the
+    // input size as the USB transfer size, and small transfers come back sooner. Not every driver cares.
+    DWORD queue = LowLatency ? LOW_LATENCY_QUEUE : PORT_QUEUE;
+    SetupComm(port->h, queue, queue);
+
+    // Set comms timeouts.
+    // A read returns as soon as at least one byte is available, with everything that is available. 
+    // If nothing arrives within READ_TIMEOUT it completes empty, and we simply re-arm it.
+    // Writes will eventually timeout.
+    COMMTIMEOUTS cto = { MAXDWORD, MAXDWORD, READ_TIMEOUT, 0, WriteTimeout };        
+    if (SetCommTimeouts(port->h, &cto) == 0 || (port->line.baud != 0 && !ConfigureSerialPort(port, &port->line))) {
+        DWORD error = GetLastError();
+        CloseHandle(port->h);
+        port->h = INVALID_HANDLE_VALUE;
+        SetLastError(error);
+        return false;
+    }
+    return true;
+}
+
+//
+// For --low-latency: set the latency timer of an FTDI USB serial port to LATENCY_TIMER. The chip holds a short
+// packet back until the timer runs out, so its default of 16 ms is added to every round trip. The setting lives
+// in the registry and the driver reads it when the port is opened, so this is done before opening. Changing it
+// needs administrator rights; without them we just say what it is. Other ports are left alone.
+//
+void FtdiLatencyTimer(Port * port) {
+    char com[32];
+    snprintf(com, sizeof(com), "%s", (strncmp(port->name, "\\\\.\\", 4) == 0) ? port->name + 4 : port->name);
+    StrToLower(com, strlen(com));
+    HKEY bus;
+    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, "SYSTEM\\CurrentControlSet\\Enum\\FTDIBUS", 0, KEY_READ, &bus) != ERROR_SUCCESS) {
+        return;
+    }
+
+    // Look for the device instance whose PortName matches, e.g. FTDIBUS\VID_0403+PID_6001+A50285BIA\0000
+    char device[MAX_PATH];
+    for (DWORD i = 0; ; i++) {
+        DWORD size = sizeof(device);
+        if (RegEnumKeyExA(bus, i, device, &size, NULL, NULL, NULL, NULL) != ERROR_SUCCESS) {
+            break;
+        }
+        HKEY dev;
+        if (RegOpenKeyExA(bus, device, 0, KEY_READ, &dev) != ERROR_SUCCESS) {
+            continue;
+        }
+        char instance[MAX_PATH];
+        for (DWORD j = 0; ; j++) {
+            size = sizeof(instance);
+            if (RegEnumKeyExA(dev, j, instance, &size, NULL, NULL, NULL, NULL) != ERROR_SUCCESS) {
+                break;
+            }
+            char params[3 * MAX_PATH];
+            char name[32];
+            DWORD timer = 0;
+            DWORD name_size = sizeof(name);
+            DWORD timer_size = sizeof(timer);
+            snprintf(params, sizeof(params), "%s\\Device Parameters", instance);
+            if (RegGetValueA(dev, params, "PortName", RRF_RT_REG_SZ, NULL, name, &name_size) != ERROR_SUCCESS) {
+                continue;
+            }
+            StrToLower(name, strlen(name));
+            if (strcmp(name, com) != 0
+                || RegGetValueA(dev, params, "LatencyTimer", RRF_RT_REG_DWORD, NULL, &timer, &timer_size) != ERROR_SUCCESS) {
+                continue;
+            }
+            if (timer > LATENCY_TIMER) {
+                HKEY key;
+                DWORD value = LATENCY_TIMER;
+                LSTATUS status = RegOpenKeyExA(dev, params, 0, KEY_SET_VALUE, &key);
+                if (status == ERROR_SUCCESS) {
+                    status = RegSetValueExA(key, "LatencyTimer", 0, REG_DWORD, (const BYTE *)&value, sizeof(value));
+                    RegCloseKey(key);
+                }
+                if (status == ERROR_SUCCESS) {
+                    fprintf(stderr, "Set the latency timer of %s from %u to %u ms.\n", port->name, timer, LATENCY_TIMER);
+                }
+                else {
+                    fprintf(stderr, "WARNING: %s has a latency timer of %u ms. Run as administrator to change it, or set it in "
+                        "Device Manager, Port Settings, Advanced.\n", port->name, timer);
+                }
+            }
+            RegCloseKey(dev);
+            RegCloseKey(bus);
+            return;
+        }
+        RegCloseKey(dev);
+    }
+    RegCloseKey(bus);
+}
+
+//
+// Configure serial port: baud rate, data bits, parity, stop bits, and flow control (unless FLOW_LEAVE). Everything is
+// set in one SetCommState(), so the port never runs with half the settings. Returns false if the port won't take them.
+//
+bool ConfigureSerialPort(Port * port, const LineSettings * ls) {
+    DCB dcb = { 0 };
+    dcb.DCBlength = sizeof(dcb);
+    if (!GetCommState(port->h, &dcb)) {
+        return false;
+    }
+
+    dcb.BaudRate = ls->baud;
+    dcb.ByteSize = ls->data_bits;
+    dcb.Parity = ls->parity;
+    dcb.StopBits = ls->stop_bits;
+    dcb.fBinary = TRUE;
+    dcb.fParity = (ls->parity != NOPARITY);
+    if (!(ls->flow & FLOW_LEAVE)) {
+        bool rtscts = (ls->flow & FLOW_RTSCTS) != 0;
+        bool dtrdsr = (ls->flow & FLOW_DTRDSR) != 0;
+        bool xonxoff = (ls->flow & FLOW_XONXOFF) != 0;
+        dcb.fOutxCtsFlow = rtscts;
+        dcb.fRtsControl = rtscts ? RTS_CONTROL_HANDSHAKE : RTS_CONTROL_ENABLE;
+        dcb.fOutxDsrFlow = dtrdsr;
+        dcb.fDtrControl = dtrdsr ? DTR_CONTROL_HANDSHAKE : DTR_CONTROL_ENABLE;
+        dcb.fDsrSensitivity = FALSE;
+        dcb.fOutX = xonxoff;
+        dcb.fInX = xonxoff;
+        dcb.fTXContinueOnXoff = TRUE;
+        dcb.XonChar = 0x11;
+        dcb.XoffChar = 0x13;
+    }
+    if (ls->xon_lim != 0) {
+        dcb.XonLim = ls->xon_lim;
+    }
+    if (ls->xoff_lim != 0) {
+        dcb.XoffLim = ls->xoff_lim;
+    }
+    return SetCommState(port->h, &dcb) != 0;
+}
+
+//
+// Parse line settings (-c, or after the colon in com1:SPEC). A baud rate, then optionally data bits, parity
+// (n, o, e, m or s) and stop bits (1, 1.5 or 2), in that order or together (8n1), then any of rtscts, dtrdsr,
+// xonxoff or none for flow control, and xonlim=N and xofflim=N, all separated by commas. e.g. "3000000,8,n,1,rtscts".
+// Unless given, it's 8N1, and flow control is left as it is. Returns false if the spec isn't valid.
+//
+bool ParseLineSettings(char * spec, LineSettings * ls) {
+    LineSettings parsed = { 0, 8, NOPARITY, ONESTOPBIT, FLOW_LEAVE, 0, 0 };
+    StrToLower(spec, strlen(spec));
+    int field = 0;                                  // Next of baud, data bits, parity and stop bits
+    char * next = spec;
+    while (next != NULL) {
+        char * t = next;
+        next = strchr(t, ',');
+        if (next != NULL) {
+            *next++ = 0;
+        }
+        if (field == 0) {
+            if (strspn(t, "0123456789") != strlen(t) || (parsed.baud = strtoul(t, NULL, 10)) == 0) {
+                return false;
+            }
+            field++;
+        }
+        else if (strcmp(t, "rtscts") == 0 || strcmp(t, "dtrdsr") == 0 || strcmp(t, "xonxoff") == 0 || strcmp(t, "none") == 0) {
+            parsed.flow &= ~FLOW_LEAVE;
+            parsed.flow |= (t[0] == 'r') ? FLOW_RTSCTS : (t[0] == 'd') ? FLOW_DTRDSR : (t[0] == 'x') ? FLOW_XONXOFF : 0;
+        }
+        else if (strncmp(t, "xonlim=", 7) == 0 || strncmp(t, "xofflim=", 8) == 0) {
+            char * value = strchr(t, '=') + 1;
+            DWORD lim = strtoul(value, NULL, 10);
+            if (strspn(value, "0123456789") != strlen(value) || lim == 0 || lim > 65535) {
+                return false;
+            }
+            *((t[2] == 'n') ? &parsed.xon_lim : &parsed.xoff_lim) = (WORD)lim;
+        }
+        else {
+            // Data bits, parity and stop bits, one at a time or run together
+            while (*t != 0) {
+                if (field == 1 && *t >= '5' && *t <= '8') {
+                    parsed.data_bits = *t++ - '0';
+                }
+                else if (field == 2 && strchr("noems", *t) != NULL) {
+                    static const char parities[] = "noems";    // Same order as NOPARITY..SPACEPARITY
+                    parsed.parity = (BYTE)(strchr(parities, *t++) - parities);
+                }
+                else if (field == 3 && (strcmp(t, "1") == 0 || strcmp(t, "1.5") == 0 || strcmp(t, "2") == 0)) {
+                    parsed.stop_bits = (t[0] == '2') ? TWOSTOPBITS : (t[1] == '.') ? ONE5STOPBITS : ONESTOPBIT;
+                    t += strlen(t);
+                }
+                else {
+                    return false;
+                }
+                field++;
+            }
+        }
+    }
+    if (field == 0) {
+        return false;
+    }
+    *ls = parsed;
+    return true;
+}
+
+//
+// Find a port's baud rate (--autobaud). Listens at each of the common rates in turn, scores what arrives, and
+// leaves the port at the best one. The rest of the line settings (-c) stay as they are. Needs the device to be
+// sending something, e.g. a boot log or a prompt; if nothing arrives at any rate, the port is left as it was.
+//
+void DetectBaudRate(Port * port) {
+    static const DWORD rates[] = { 300, 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600 };
+    static char buf[AUTOBAUD_BUF];
+    LineSettings ls = port->line;
+    if (ls.baud == 0) {
+        ls = (LineSettings){ 0, 8, NOPARITY, ONESTOPBIT, FLOW_LEAVE, 0, 0 };
+    }
+    DCB original = { 0 };
+    original.DCBlength = sizeof(original);
+    GetCommState(port->h, &original);
+
+    fprintf(stderr, "Autobaud: listening on %s.\n", port->name);
+    DWORD best_baud = 0;
+    double best_score = 0.0;
+    for (DWORD i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        ls.baud = rates[i];
+        if (!ConfigureSerialPort(port, &ls)) {
+            continue;
+        }
+        // Listen long enough for AUTOBAUD_CHARS 10-bit characters
+        DWORD ms = min(max(AUTOBAUD_CHARS * 10 * 1000 / rates[i], AUTOBAUD_MIN), AUTOBAUD_MAX);
+        DWORD frame_errors = 0;
+        DWORD len = AutoBaudSample(port, buf, ms, &frame_errors);
+        double score = AutoBaudScore(buf, len, frame_errors);
+        fprintf(stderr, "Autobaud: %7u baud: %5u bytes, %u framing errors, score %.2f.\n", rates[i], len, frame_errors, score);
+        if (score > best_score) {
+            best_score = score;
+            best_baud = rates[i];
+        }
+    }
+
+    if (best_baud == 0) {
+        fprintf(stderr, "WARNING: autobaud heard nothing usable on %s. Leaving it at %u baud.\n", port->name, original.BaudRate);
+        SetCommState(port->h, &original);
+        return;
+    }
+    ls.baud = best_baud;
+    ConfigureSerialPort(port, &ls);
+    port->line = ls;
+    fprintf(stderr, "Autobaud: %s is at %u baud.\n", port->name, best_baud);
+}
+
+//
+// Autobaud: read from the port for the given time, throwing away anything received before. Returns the number of
+// bytes read into buf (at most AUTOBAUD_BUF), and counts the reads that saw framing errors or breaks.
+//
+DWORD AutoBaudSample(Port * port, char * buf, DWORD ms, DWORD * frame_errors) {
+    OVERLAPPED ov = { 0 };
+    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (ov.hEvent == NULL) {
+        ExitWithError("CreateEvent(autobaud)", true);
+    }
+    PurgeComm(port->h, PURGE_RXCLEAR);
+    DWORD errors = 0;
+    ClearCommError(port->h, &errors, NULL);
+
+    DWORD len = 0;
+    LONG64 start = Now();
+    LONG64 elapsed = 0;
+    while (len < AUTOBAUD_BUF && elapsed < ms) {
+        // The port's reads complete as soon as there is data, so wait on each one for what's left of the time
+        DWORD got = 0;
+        ResetEvent(ov.hEvent);
+        if (ReadFile(port->h, buf + len, AUTOBAUD_BUF - len, NULL, &ov) == 0 && GetLastError() != ERROR_IO_PENDING) {
+            break;
+        }
+        if (WaitForSingleObject(ov.hEvent, (DWORD)(ms - elapsed)) == WAIT_TIMEOUT) {
+            CancelIo(port->h);
+        }
+        GetOverlappedResult(port->h, &ov, &got, TRUE);
+        len += got;
+        if (ClearCommError(port->h, &errors, NULL) != 0 && (errors & (CE_FRAME | CE_BREAK)) != 0) {
+            (*frame_errors)++;
+        }
+        elapsed = (Now() - start) * 1000 / QpcFrequency;
+    }
+    CloseHandle(ov.hEvent);
+    return len;
+}
+
+//
+// Autobaud: score a sample received at one rate, from 0 (nothing, or garbage) up to about 1 (all text). At the
+// wrong rate, characters come out as random bytes, mostly unprintable or invalid UTF-8, with framing errors.
+// Printable ASCII (and tab, CR and LF) is counted 16 bytes at a time with SSE2, which every x86 and x64 Windows
+// machine has. Only samples with bytes over 0x7f are then checked as UTF-8, one byte at a time.
+//
+double AutoBaudScore(const char * buf, DWORD len, DWORD frame_errors) {
+    if (len == 0) {
+        return 0.0;
+    }
+    const __m128i space = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    LONG64 text = 0;
+    int high = 0;
+    DWORD i = 0;
+    while (i + 16 <= len) {
+        // Each lane counts up by one per printable byte. Add them up before any lane can wrap.
+        __m128i counts = _mm_setzero_si128();
+        for (int block = 0; block < 255 && i + 16 <= len; block++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+            // Signed compares, so bytes over 0x7f (negative) aren't printable
+            __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, space), _mm_cmplt_epi8(v, del));
+            printable = _mm_or_si128(printable, _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr))));
+            counts = _mm_sub_epi8(counts, printable);
+            high |= _mm_movemask_epi8(v);
+        }
+        __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+        text += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    }
+    for (; i < len; i++) {
+        BYTE c = buf[i];
+        text += (c >= 0x20 && c < 0x7f) || c == '\t' || c == '\n' || c == '\r';
+        high |= c & 0x80;
+    }
+
+    // Valid UTF-8 sequences count as text too
+    if (high != 0) {
+        const BYTE * b = (const BYTE *)buf;
+        for (i = 0; i < len; i++) {
+            int follow = (b[i] >= 0xc2 && b[i] <= 0xdf) ? 1 : (b[i] >= 0xe0 && b[i] <= 0xef) ? 2 : (b[i] >= 0xf0 && b[i] <= 0xf4) ? 3 : 0;
+            if (follow == 0 || i + follow >= len) {
+                continue;
+            }
+            int n = 1;
+            while (n <= follow && (b[i + n] & 0xc0) == 0x80) {
+                n++;
+            }
+            if (n > follow) {
+                text += n;
+                i += follow;
+            }
+        }
+    }
+
+    // Each read with framing errors or breaks costs as much as a garbage byte would. A few bytes can be
+    // printable by chance, so small samples count for less.
+    double score = ((double)text - frame_errors) / len * min(len, 16) / 16;
+    return max(score, 0.0);
+}
+
+//
+// Read stdin and fill the buffer with bytes. Nonblocking. Hotkeys are carried out, and removed from the data.
+//
+DWORD ReadStdin(HANDLE stdin_h, char * buf_c, DWORD buf_c_size) {    
+    static INPUT_RECORD ir[RECORD_SIZE];    // Place to store the input records we read
+    static wchar_t buf_w[WBUF_SIZE];        // Place to store the input characters we read
+    assert(RECORD_SIZE < WBUF_SIZE);        // We must have enough room to store all the characters we read
+    
+    // Find the number of records available
+    DWORD records_avail = 0;
+    GetNumberOfConsoleInputEvents(stdin_h, &records_avail);    
+    StdinBurst = (records_avail >= PASTE_RECORDS);
+    
+    // If there is no data, return early
+    if (records_avail < 1) {                            
+        return 0;
+    }
+    
+    // Read no more than RECORD_SIZE records, and no more than will fit in buf_c as utf-8 (up to 3 bytes per wchar)
+    records_avail = min(records_avail, RECORD_SIZE);    
+    records_avail = min(records_avail, (buf_c_size - HOTKEY_MAX_LEN) / 3);
+
+    // Read the console events.
+    // We must use ReadConsoleInputW instead of ReadConsoleInputA to avoid clobbering unicode input.
+    // See: https://github.com/microsoft/terminal/issues/7777
+    // Specifically comment: https://github.com/microsoft/terminal/issues/7777#issuecomment-726912745
+    DWORD records_read = 0;
+    if (ReadConsoleInputW(stdin_h, ir, records_avail, &records_read) == 0) {
+        ExitWithError("ReadConsoleInputW", true);
+    }
+    if (records_read != records_avail) {
+        ExitWithError("ReadConsoleInputW failed to read all available records.", false);
+    }
+    
+    // Process the event records and extract only the keyboard data
+    DWORD buf_w_idx = 0;
+    for (DWORD i = 0; i < records_read; i++) {
+        if (ir[i].EventType != KEY_EVENT) continue;         // Only interested in key events
+        if (ir[i].Event.KeyEvent.bKeyDown != 1) continue;   // Only interested in keydown events            
+        wchar_t c = ir[i].Event.KeyEvent.uChar.UnicodeChar; // Read one wchar
+
+        // Check for hotkeys (in non-VT mode)
+        if (DisableVT) {
+            int action = MatchHotkeyVk(ir[i].Event.KeyEvent.wVirtualKeyCode, ir[i].Event.KeyEvent.dwControlKeyState);
+            if (action >= 0) {
+                RunHotkey(action);
+                continue;
+            }
+        }
+
+        // Replace \r with \n, if requested
+        if (ReplaceCR && c == '\r') {                       
+            c = '\n';
+        }      
+
+        // Add character to buffer, so long as it's not just a control key being pressed by itself (which would be mapped as a NUL), but allow pasted NULs (!)
+        if (c != 0 || ir[i].Event.KeyEvent.dwControlKeyState == 0) {
+            buf_w[buf_w_idx++] = c;
+        }
+    }
+    
+    // If there is no keyboard data, return early
+    if (buf_w_idx == 0) {                                   
+        return 0;
+    }
+
+    // Convert the wide string buffer (W) to a multi-byte (utf-8) string buffer (A)
+    // Leave room for the hotkey matcher to put back held bytes.
+    int bytes_stdin = WideCharToMultiByte(CP_UTF8, 0, buf_w, buf_w_idx, buf_c, buf_c_size - HOTKEY_MAX_LEN, NULL, NULL);
+    if (bytes_stdin == 0) {
+        ExitWithError("WideCharToMultiByte", true);
+    }
+
+    // Check for hotkeys (in VT mode), even when split across reads
+    if (!DisableVT) {
+        bytes_stdin = FilterHotkeys(&StdinHotkeys, buf_c, bytes_stdin);
+    }
+
+    return bytes_stdin;
+}
+
+//
+// Start an overlapped read of the serial port. Completion is queued to RxCompletion.
+// Returns false if the port has gone away and will be reopened (port->reconnect); otherwise exits on failure.
+//
+bool StartPortRead(Port * port, OVERLAPPED * ov, char * buf, DWORD buf_size) {
+    if (ReadFile(port->h, buf, buf_size, NULL, ov) == 0 && GetLastError() != ERROR_IO_PENDING) {
+        if (port->reconnect) {
+            PortLost(port);
+            return false;
+        }
+        ExitWithError("ReadFile(port_h)", true);
+    }
+    return true;
+}
+
+//
+// Collect the result of a completed overlapped read. Returns the number of bytes read (may be 0 on timeout).
+//
+DWORD FinishPortRead(Port * port, OVERLAPPED * ov) {
+    DWORD bytes_read = 0;
+    if (GetOverlappedResult(port->h, ov, &bytes_read, FALSE) == 0) {
+        if (port->is_pipe && !port->reconnect && GetLastError() == ERROR_BROKEN_PIPE) {
+            char msg[MAX_PATH + 32];
+            snprintf(msg, sizeof(msg), "Pipe %s closed by the other end.", port->name);
+            ExitWithError(msg, false);
+        }
+        if (port->reconnect) {
+            PortLost(port);
+            return 0;
+        }
+        ExitWithError("ReadFile(port_h)", true);
+    }
+    return bytes_read;
+}
+
+//
+// Write a buffer to the serial port, waiting for the write to complete (or time out). 
+// Returns the number of bytes written. If the port has gone away, that may be short, unless we exit (no port->reconnect).
+//
+DWORD WritePort(Port * port, const char * buf, DWORD buf_size) {
+    static HANDLE write_event = NULL;
+    if (write_event == NULL) {
+        write_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (write_event == NULL) {
+            ExitWithError("CreateEvent(write_event)", true);
+        }
+    }
+
+    // The low bit of the event handle keeps the completion off RxCompletion, which the port is associated with
+    OVERLAPPED ov = { 0 };
+    ov.hEvent = (HANDLE)((ULONG_PTR)write_event | 1);
+    DWORD bytes_written = 0;
+    if ((WriteFile(port->h, buf, buf_size, NULL, &ov) == 0 && GetLastError() != ERROR_IO_PENDING)
+        || GetOverlappedResult(port->h, &ov, &bytes_written, TRUE) == 0) {
+        if (!port->reconnect) {
+            ExitWithError("WriteFile(port_h)", true);
+        }
+        PortLost(port);
+    }
+    return bytes_written;
+}
+
+//
+// Create and map the spill file.
+//
+void SpillOpen(Spill * sp) {
+    char temp_dir[MAX_PATH];
+    char temp_path[MAX_PATH];
+    if (GetTempPathA(MAX_PATH, temp_dir) == 0 || GetTempFileNameA(temp_dir, "spc", 0, temp_path) == 0) {
+        ExitWithError("GetTempFileNameA(spill)", true);
+    }
+    sp->file = CreateFileA(temp_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (sp->file == INVALID_HANDLE_VALUE) {
+        ExitWithError("CreateFileA(spill)", true);
+    }
+    sp->size = (LONG64)SpillSize * 1048576;
+    sp->mapping = CreateFileMappingA(sp->file, NULL, PAGE_READWRITE, (DWORD)(sp->size >> 32), (DWORD)sp->size, NULL);
+    if (sp->mapping == NULL) {
+        ExitWithError("CreateFileMappingA(spill)", true);
+    }
+    sp->view = MapViewOfFile(sp->mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)sp->size);
+    if (sp->view == NULL) {
+        ExitWithError("MapViewOfFile(spill)", true);
+    }
+}
+
+//
+// Move as much spilled data into the ring as will fit, oldest first.
+//
+void SpillDrain(Spill * sp, Ring * r) {
+    while (sp->head > sp->tail) {
+        LONG64 offset = sp->tail % sp->size;
+        DWORD len = (DWORD)min(sp->head - sp->tail, sp->size - offset);
+        DWORD pushed = RingPush(r, sp->view + offset, len);
+        sp->tail += pushed;
+        if (pushed < len) {
+            break;
+        }
+    }
+}
+
+//
+// Pass received data on to the console thread. If the RX ring is full, spill the rest rather than wait, 
+// so the port keeps being read. Data always comes out in order: while anything is spilled, new data goes behind it.
+//
+void PassRx(Port * port, const char * buf, DWORD n, LONG64 read_time) {
+    Spill * sp = &port->spill;
+    SpillDrain(sp, &port->rx);
+    DWORD pushed = 0;
+    if (sp->head == sp->tail) {
+        pushed = RingPush(&port->rx, buf, n);
+    }
+
+    while (pushed < n) {
+        // With no spill file, wait for the console
+        if (SpillSize == 0) {
+            WaitForSingleObject(port->rx.space_event, INFINITE);
+            pushed += RingPush(&port->rx, buf + pushed, n - pushed);
+            continue;
+        }
+
+        if (sp->view == NULL) {
+            SpillOpen(sp);
+        }
+
+        // Copy into the spill file, wrapping around its end. If it's full too, we have no choice but to wait.
+        LONG64 offset = sp->head % sp->size;
+        DWORD len = (DWORD)min(min(n - pushed, sp->size - (sp->head - sp->tail)), sp->size - offset);
+        if (len == 0) {
+            sp->stalls++;
+            WaitForSingleObject(port->rx.space_event, INFINITE);
+            SpillDrain(sp, &port->rx);
+            continue;
+        }
+        memcpy(sp->view + offset, buf + pushed, len);
+        sp->head += len;
+        sp->spilled += len;
+        pushed += len;
+    }
+
+    LONG64 lag = RingUsed(&port->rx) + (sp->head - sp->tail);
+    if (lag > sp->max_lag) {
+        sp->max_lag = lag;
+    }
+
+    // Timestamp the read at the ring position it ends at, even if it's in the spill file for now
+    if (n > 0) {
+        RingMark(&port->rx, port->rx.head + (sp->head - sp->tail), read_time);
+    }
+}
+
+//
+// Console thread: release n bytes of received data from the ring, and its timestamps. If the port has data spilled,
+// wake the RX thread to move more of it in.
+//
+void ConsumeRx(Port * port, DWORD n) {
+    RingConsume(&port->rx, n);
+    RingUnmark(&port->rx, &RxLatency);
+    if (ReadAcquire64(&port->spill.head) > ReadAcquire64(&port->spill.tail)) {
+        PostQueuedCompletionStatus(RxCompletion, 0, 0, NULL);
+    }
+}
+
+//
+// Serial RX thread. Keeps RX_READS reads pending on every port and passes what arrives to the console thread.
+// Runs on its own so a slow console can't hold up reading the ports.
+// One thread serves all the ports: every read completes to the RxCompletion port, with the Port as its key.
+// Reads complete in the order they were issued. While we handle one, the next is already waiting on the port,
+// so data goes straight from the driver into our buffers rather than sitting in the driver's queue.
+// It also closes and reopens ports that go away (PortLost()).
+//
+DWORD WINAPI SerialRxThread(LPVOID param) {
+    for (DWORD i = 0; i < PortCount; i++) {
+        ArmPortReads(&Ports[i]);
+    }
+
+    while (1) {
+        // While anything is spilled, also wake now and then in case ring space has freed up.
+        // While a port is gone, also wake when it's time to try reopening it.
+        bool spilled = false;
+        DWORD timeout = INFINITE;
+        for (DWORD i = 0; i < PortCount; i++) {
+            spilled |= (Ports[i].spill.head > Ports[i].spill.tail);
+            if (Ports[i].h == INVALID_HANDLE_VALUE) {
+                timeout = min(timeout, MsUntil(Ports[i].retry_time));
+            }
+        }
+        if (spilled) {
+            timeout = min(timeout, SPILL_POLL);
+        }
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED * ov = NULL;
+        if (GetQueuedCompletionStatus(RxCompletion, &bytes, &key, &ov, timeout) == 0 && ov == NULL && GetLastError() != WAIT_TIMEOUT) {
+            ExitWithError("GetQueuedCompletionStatus", true);
+        }
+        RxWakeups++;
+
+        // Not a read: the console thread has freed up ring space (ConsumeRx()), or it's time to check
+        if (ov == NULL) {
+            for (DWORD i = 0; i < PortCount; i++) {
+                SpillDrain(&Ports[i].spill, &Ports[i].rx);
+                if (Ports[i].h == INVALID_HANDLE_VALUE && MsUntil(Ports[i].retry_time) == 0) {
+                    ReopenPort(&Ports[i]);
+                }
+            }
+            SetEvent(RxReady);
+            continue;
+        }
+
+        // Handle the port's completed reads in the order they were issued
+        Port * port = (Port *)key;
+        port->rx_done[ov - port->rx_ov] = true;
+        while (port->rx_done[port->rx_next]) {
+            DWORD cur = port->rx_next;
+            char * buf = port->rx_buf + cur * BUF_SIZE;
+            port->rx_done[cur] = false;
+            port->rx_next = (cur + 1) % RX_READS;
+            port->rx_pending--;
+            DWORD bytes_read = FinishPortRead(port, &port->rx_ov[cur]);
+            LONG64 read_time = Now();
+            port->rx_bytes += bytes_read;
+            port->rx_calls++;
+            UartErrors(port);
+
+            // Pass the data on
+            PassRx(port, buf, bytes_read, read_time);
+
+            // Let the TX thread know when the device is ready for the next line of a file (--send-prompt)
+            if (SendPrompt != NULL && ReadAcquire(&Sending.active) != 0 && Sending.port == port && PromptSeen(buf, bytes_read)) {
+                SetEvent(Sending.prompt_event);
+            }
+
+            // Re-arm this buffer behind the reads already pending, unless the port has gone away
+            if (ReadAcquire(&port->lost) == 0 && StartPortRead(port, &port->rx_ov[cur], buf, BUF_SIZE)) {
+                port->rx_pending++;
+            }
+        }
+        ClosePortIfDone(port);
+        SetEvent(RxReady);
+    }
+    return 0;
+}
+
+//
+// Start RX_READS reads on a port, when it's opened or reopened. Stops at the first that fails, as the reads must
+// complete in order. RX thread only.
+//
+void ArmPortReads(Port * port) {
+    port->rx_next = 0;
+    port->rx_pending = 0;
+    for (int j = 0; j < RX_READS; j++) {
+        port->rx_done[j] = false;
+    }
+    for (int j = 0; j < RX_READS && StartPortRead(port, &port->rx_ov[j], port->rx_buf + j * BUF_SIZE, BUF_SIZE); j++) {
+        port->rx_pending++;
+    }
+    ClosePortIfDone(port);
+}
+
+//
+// Note that a port has gone away (e.g. its USB adapter was unplugged), from whichever thread finds out first.
+// Its pending I/O is cancelled. The RX thread closes it once its reads are all back, and then tries to reopen it.
+// Meanwhile, anything typed for it waits in its TX ring. The caller is the RX thread, or holds port->lock.
+//
+void PortLost(Port * port) {
+    DWORD error = GetLastError();
+    if (InterlockedCompareExchange(&port->lost, 1, 0) != 0) {
+        return;
+    }
+    port->lost_time = Now();
+    ResetEvent(port->connected);
+    fprintf(stderr, "\nWARNING: Lost %s (error %u). Reconnecting.\n", port->name, error);
+    CancelIoEx(port->h, NULL);
+}
+
+//
+// Close a port that has gone away once all its reads have come back, so the device can come back under the same
+// name, and set the first try at reopening it. RX thread only.
+//
+void ClosePortIfDone(Port * port) {
+    if (ReadAcquire(&port->lost) == 0 || port->rx_pending > 0 || port->h == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    AcquireSRWLockExclusive(&port->lock);
+    CloseHandle(port->h);
+    port->h = INVALID_HANDLE_VALUE;
+    ReleaseSRWLockExclusive(&port->lock);
+    port->retry_count = 0;
+    port->retry_delay = RECONNECT_MIN;
+    port->retry_time = Now() + (LONG64)RECONNECT_MIN * QpcFrequency / 1000;
+}
+
+//
+// Try to reopen a port that has gone away, with the same line settings. If it opens, its reads start again and the
+// TX thread sends what was held for it. If not, the wait before the next try doubles, up to RECONNECT_MAX.
+// RX thread only.
+//
+void ReopenPort(Port * port) {
+    port->retry_count++;
+    AcquireSRWLockExclusive(&port->lock);
+    bool opened = OpenPort(port);
+    if (opened && CreateIoCompletionPort(port->h, RxCompletion, (ULONG_PTR)port, 0) == NULL) {
+        CloseHandle(port->h);
+        port->h = INVALID_HANDLE_VALUE;
+        opened = false;
+    }
+    ReleaseSRWLockExclusive(&port->lock);
+    if (!opened) {
+        port->retry_delay = min(port->retry_delay * 2, RECONNECT_MAX);
+        port->retry_time = Now() + (LONG64)port->retry_delay * QpcFrequency / 1000;
+        return;
+    }
+
+    double outage = SecondsSince(port->lost_time);
+    port->reconnects++;
+    port->max_outage = max(port->max_outage, outage);
+    fprintf(stderr, "\nReconnected to %s after %.2f s (%u tries).\n", port->name, outage, port->retry_count);
+    InterlockedExchange(&port->lost, 0);
+    SetEvent(port->connected);
+    SetEvent(port->tx.data_event);
+    ArmPortReads(port);
+}
+
+//
+// Note the line settings a port was opened with, so it can be reopened the same if it goes away and comes back
+// (a USB adapter comes back with the driver's defaults). Only needed when they weren't given with -c.
+//
+void SaveLineSettings(Port * port) {
+    DCB dcb = { 0 };
+    dcb.DCBlength = sizeof(dcb);
+    if (GetCommState(port->h, &dcb) == 0) {
+        return;
+    }
+    LineSettings ls = { dcb.BaudRate, dcb.ByteSize, dcb.Parity, dcb.StopBits, 0, dcb.XonLim, dcb.XoffLim };
+    ls.flow |= dcb.fOutxCtsFlow ? FLOW_RTSCTS : 0;
+    ls.flow |= dcb.fOutxDsrFlow ? FLOW_DTRDSR : 0;
+    ls.flow |= dcb.fOutX ? FLOW_XONXOFF : 0;
+    port->line = ls;
+}
+
+//
+// Serial TX thread. Writes whatever the console thread has queued to the ports.
+// Runs on its own so a slow write can't hold up reading the ports or the console.
+// One thread serves all the ports. It stays with a port until its ring is empty, then moves on to the next with
+// anything queued. Typing only goes to one port at a time, so in practice there is rarely more than one.
+// Everything queued while a write is in progress goes out together in the next write.
+// If a write times out part way (-w), the unsent data stays queued and is retried; the session carries on.
+// While a port has gone away, its data stays queued until the RX thread reopens it.
+// While a file is being sent, it is written straight from its mapped view instead, and typing waits in the rings.
+//
+DWORD WINAPI SerialTxThread(LPVOID param) {
+    HANDLE wait_h[MAX_PORTS];
+    for (DWORD i = 0; i < PortCount; i++) {
+        wait_h[i] = Ports[i].tx.data_event;
+    }
+    DWORD cur = 0;
+    HANDLE pace_timer = NULL;
+    if (CharDelay > 0 || LineDelay > 0 || SendRate > 0) {
+        pace_timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        if (pace_timer == NULL) {
+            pace_timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);     // Before Windows 10 1803
+        }
+        if (pace_timer == NULL) {
+            ExitWithError("CreateWaitableTimerExW", true);
+        }
+    }
+
+    while (1) {
+        Port * port = &Ports[cur];
+        char * p;
+        DWORD len;
+        bool from_file = ReadAcquire(&Sending.active) != 0;
+        if (from_file) {
+            port = Sending.port;
+            if (Sending.pos == Sending.size || ReadAcquire(&Sending.cancel) != 0) {
+                SendFileDone();
+                continue;
+            }
+            if (ReadAcquire(&port->lost) != 0) {
+                WaitForSingleObject(port->connected, RECONNECT_MIN);
+                continue;
+            }
+            p = Sending.view + Sending.pos;
+            len = (DWORD)min(Sending.size - Sending.pos, Sending.chunk);
+            if (SendRate > 0) {
+                len = min(len, max(SendRate / SEND_RATE_STEPS, 1));
+            }
+        }
+        else {
+            // A port that has gone away keeps its data queued until it's reopened
+            len = (ReadAcquire(&port->lost) == 0) ? RingReadable(&port->tx, &p) : 0;
+            if (len == 0) {
+                // Move on to the next port with anything queued, or wait for one
+                DWORD next = cur;
+                for (DWORD i = 1; i < PortCount && next == cur; i++) {
+                    if (RingUsed(&Ports[(cur + i) % PortCount].tx) > 0 && ReadAcquire(&Ports[(cur + i) % PortCount].lost) == 0) {
+                        next = (cur + i) % PortCount;
+                    }
+                }
+                if (next == cur) {
+                    DWORD wait_result = WaitForMultipleObjects(PortCount, wait_h, FALSE, INFINITE);
+                    if (wait_result == WAIT_FAILED) {
+                        ExitWithError("WaitForMultipleObjects(tx.data_event)", true);
+                    }
+                    next = wait_result - WAIT_OBJECT_0;
+                }
+                cur = next;
+                continue;
+            }
+        }
+
+        // Pacing, for devices that can't keep up. Send one character, or up to the end of one line, then wait.
+        // A \n straight after a \r is part of the same line ending.
+        DWORD pace = 0;
+        bool line_end = false;
+        bool wait_prompt = from_file && SendPrompt != NULL;
+        if (CharDelay > 0) {
+            len = 1;
+            pace = CharDelay;
+        }
+        if (LineDelay > 0 || wait_prompt) {
+            for (DWORD i = 0; i < len; i++) {
+                char prev = (i > 0) ? p[i - 1] : port->last_sent;
+                if (p[i] == '\r' || (p[i] == '\n' && prev != '\r')) {
+                    len = (p[i] == '\r' && i + 1 < len && p[i + 1] == '\n') ? i + 2 : i + 1;
+                    pace = max(pace, LineDelay);
+                    line_end = true;
+                    break;
+                }
+            }
+        }
+        if (wait_prompt) {
+            ResetEvent(Sending.prompt_event);   // Only a prompt that arrives after this write counts
+        }
+
+        LONG64 write_start = Now();
+        AcquireSRWLockShared(&port->lock);
+        DWORD bytes_written = (ReadAcquire(&port->lost) == 0) ? WritePort(port, p, len) : 0;
+        ReleaseSRWLockShared(&port->lock);
+        if (LatencyProbe) {
+            HistRecord(&WriteLatency, (Now() - write_start) * 1000000 / QpcFrequency);
+        }
+        if (bytes_written != len && ReadAcquire(&port->lost) == 0) {
+            if (port->tx_timeouts++ == 0) {
+                fprintf(stderr, "\nWARNING: Timed out writing to %s. Retrying.\n", port->name);
+            }
+        }
+        port->tx_bytes += bytes_written;
+        port->tx_calls++;
+        if (from_file) {
+            Sending.pos += bytes_written;
+        }
+        else {
+            RingConsume(&port->tx, bytes_written);
+            RingUnmark(&port->tx, &TxLatency);
+        }
+        if (bytes_written > 0) {
+            port->last_sent = p[bytes_written - 1];
+        }
+        if (pace > 0 && bytes_written == len) {
+            PaceWait(pace_timer, pace);
+        }
+        if (wait_prompt && line_end && bytes_written == len) {
+            if (WaitForSingleObject(Sending.prompt_event, SEND_PROMPT_TIMEOUT) == WAIT_TIMEOUT) {
+                Sending.prompt_timeouts++;
+            }
+        }
+        if (from_file && SendRate > 0) {
+            DWORD ms = MsUntil(Sending.start + Sending.pos * QpcFrequency / SendRate);
+            if (ms > 0) {
+                PaceWait(pace_timer, ms);
+            }
+        }
+    }
+    return 0;
+}
+
+//
+// Wait ms milliseconds on a waitable timer. With a high resolution timer this is accurate to well under the
+// 15.6 ms of Sleep().
+//
+void PaceWait(HANDLE timer, DWORD ms) {
+    LARGE_INTEGER due;
+    due.QuadPart = -(LONG64)ms * 10000;    // Relative, in 100ns units
+    if (SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE) == 0) {
+        ExitWithError("SetWaitableTimer", true);
+    }
+    WaitForSingleObject(timer, INFINITE);
+}
+
+//
+// The most bytes per second the port can send, from its baud rate and framing (start bit, data bits, parity and
+// stop bits). Also returns the baud rate. 0 for a pipe, or if the port won't say.
+//
+double PortByteRate(Port * port, DWORD * baud) {
+    *baud = 0;
+    DCB dcb = { 0 };
+    dcb.DCBlength = sizeof(dcb);
+    if (port->is_pipe || GetCommState(port->h, &dcb) == 0 || dcb.BaudRate == 0) {
+        return 0;
+    }
+    *baud = dcb.BaudRate;
+    double stop_bits = (dcb.StopBits == TWOSTOPBITS) ? 2.0 : (dcb.StopBits == ONE5STOPBITS) ? 1.5 : 1.0;
+    double bits = 1 + dcb.ByteSize + ((dcb.Parity != NOPARITY) ? 1 : 0) + stop_bits;
+    return dcb.BaudRate / bits;
+}
+
+//
+// Open a file and map it for reading. An empty file can't be mapped, so its view is NULL.
+// Returns false if the file couldn't be opened or mapped (GetLastError() says why).
+//
+bool MapFileRead(const wchar_t * path, HANDLE * file, HANDLE * mapping, char ** view, LONG64 * size) {
+    *mapping = NULL;
+    *view = NULL;
+    *file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (*file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(*file, &file_size) == 0) {
+        CloseHandle(*file);
+        return false;
+    }
+    *size = file_size.QuadPart;
+    if (*size == 0) {
+        return true;
+    }
+    *mapping = CreateFileMappingW(*file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (*mapping == NULL) {
+        CloseHandle(*file);
+        return false;
+    }
+    *view = MapViewOfFile(*mapping, FILE_MAP_READ, 0, 0, 0);
+    if (*view == NULL) {
+        CloseHandle(*mapping);
+        CloseHandle(*file);
+        return false;
+    }
+    return true;
+}
+
+//
+// Unmap and close a file opened by MapFileRead().
+//
+void UnmapFile(HANDLE file, HANDLE mapping, char * view) {
+    if (view != NULL) {
+        UnmapViewOfFile(view);
+    }
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+}
+
+//
+// Start sending a file to the port. Maps the file and hands it to the TX thread.
+// Returns false if the file couldn't be opened or mapped (GetLastError() says why).
+//
+bool SendFileStart(Port * port, const wchar_t * path) {
+    FileSend * fs = &Sending;
+    WideCharToMultiByte(GetConsoleOutputCP(), 0, path, -1, fs->name, MAX_PATH, NULL, NULL);
+    if (!MapFileRead(path, &fs->file, &fs->mapping, &fs->view, &fs->size)) {
+        return false;
+    }
+    if (fs->size == 0) {
+        fprintf(stderr, "\nNothing to send, %s is empty.\n", fs->name);
+        UnmapFile(fs->file, fs->mapping, fs->view);
+        return true;
+    }
+
+    // Write in chunks the port can send in about half the write timeout, so a write doesn't time out part way
+    fs->pos = 0;
+    fs->port = port;
+    fs->line_rate = PortByteRate(port, &fs->baud);
+    fs->chunk = SEND_CHUNK;
+    if (fs->line_rate > 0) {
+        fs->chunk = (DWORD)max(min(fs->line_rate * WriteTimeout / 2000, SEND_CHUNK), 1);
+    }
+    fs->prompt_timeouts = 0;
+    fs->cancel = 0;
+    fs->start = Now();
+    fprintf(stderr, "\nSending %s, %lld bytes. Press the send-file hotkey again to cancel.\n", fs->name, fs->size);
+    InterlockedExchange(&fs->active, 1);
+    SetEvent(port->tx.data_event);          // Wake the TX thread
+    return true;
+}
+
+//
+// TX thread: finished with the file (or cancelled). The console thread reports and unmaps it.
+//
+void SendFileDone() {
+    Sending.end = Now();
+    InterlockedExchange(&Sending.active, 0);
+    SetEvent(Sending.done_event);
+}
+
+//
+// Report how the file send went, against what the baud rate allows, and unmap the file.
+//
+void SendFileFinish() {
+    FileSend * fs = &Sending;
+    double secs = (double)(fs->end - fs->start) / QpcFrequency;
+    double rate = (secs > 0) ? fs->pos / secs : 0.0;
+    fprintf(stderr, "\n%s %s: %lld of %lld bytes in %.2f s, %.0f bytes/s",
+        fs->cancel ? "Cancelled sending" : "Sent", fs->name, fs->pos, fs->size, secs, rate);
+    if (fs->line_rate > 0) {
+        fprintf(stderr, " (%.0f%% of the %.0f bytes/s possible at %u baud)", rate * 100.0 / fs->line_rate, fs->line_rate, fs->baud);
+    }
+    if (fs->prompt_timeouts > 0) {
+        fprintf(stderr, ", %u prompt timeouts", fs->prompt_timeouts);
+    }
+    fprintf(stderr, ".\n");
+
+    UnmapFile(fs->file, fs->mapping, fs->view);
+    fs->view = NULL;
+}
+
+//
+// Ask for a line of input, such as a file name. The console is briefly put back into line mode to read it.
+// The line ending and any quotes (e.g. from "Copy as path") are removed. Returns false if nothing was entered.
+//
+bool PromptLine(HANDLE stdin_h, const char * prompt, wchar_t * line, DWORD size) {
+    DWORD mode = 0;
+    GetConsoleMode(stdin_h, &mode);
+    if (SetConsoleMode(stdin_h, ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT | ENABLE_QUICK_EDIT_MODE | ENABLE_EXTENDED_FLAGS) == 0) {
+        ExitWithError("SetConsoleMode(stdin_h)", true);
+    }
+    fprintf(stderr, "\n%s", prompt);
+    DWORD n = 0;
+    BOOL ok = ReadConsoleW(stdin_h, line, size - 1, &n, NULL);
+    if (SetConsoleMode(stdin_h, mode) == 0) {
+        ExitWithError("SetConsoleMode(stdin_h)", true);
+    }
+    if (!ok) {
+        n = 0;
+    }
+
+    while (n > 0 && (line[n - 1] == '\r' || line[n - 1] == '\n' || line[n - 1] == '"')) {
+        n--;
+    }
+    line[n] = 0;
+    if (line[0] == '"') {
+        memmove(line, line + 1, n * sizeof(wchar_t));
+    }
+    return line[0] != 0;
+}
+
+//
+// Ask for the name of a file to send (send-file hotkey).
+//
+void PromptSendFile(HANDLE stdin_h, Port * port) {
+    wchar_t path[MAX_PATH];
+    if (!PromptLine(stdin_h, "Send file: ", path, MAX_PATH)) {
+        return;
+    }
+    if (!SendFileStart(port, path)) {
+        fprintf(stderr, "Can't send the file (error %u).\n", GetLastError());
+    }
+}
+
+//
+// RX thread: check received data for the --send-prompt string, even when it is split across reads.
+//
+bool PromptSeen(const char * buf, DWORD n) {
+    static char window[SEND_PROMPT_MAX * 2];
+    static DWORD window_len = 0;
+    DWORD prompt_len = (DWORD)strlen(SendPrompt);
+    bool seen = false;
+    for (DWORD i = 0; i < n; i++) {
+        if (window_len == sizeof(window)) {
+            memmove(window, window + window_len - (prompt_len - 1), prompt_len - 1);
+            window_len = prompt_len - 1;
+        }
+        window[window_len++] = buf[i];
+        if (window_len >= prompt_len && memcmp(window + window_len - prompt_len, SendPrompt, prompt_len) == 0) {
+            seen = true;
+        }
+    }
+    return seen;
+}
+
+//
+// Fill the CRC tables: CRC-16/XMODEM (polynomial 0x1021) and CRC-32 (reflected, polynomial 0xEDB88320).
+//
+void CrcInit() {
+    for (DWORD i = 0; i < 256; i++) {
+        WORD c16 = (WORD)(i << 8);
+        DWORD c32 = i;
+        for (int bit = 0; bit < 8; bit++) {
+            c16 = (c16 & 0x8000) ? (WORD)((c16 << 1) ^ 0x1021) : (WORD)(c16 << 1);
+            c32 = (c32 & 1) ? (c32 >> 1) ^ 0xEDB88320 : (c32 >> 1);
+        }
+        Crc16Table[i] = c16;
+        Crc32Table[i] = c32;
+    }
+}
+
+//
+// Table-driven CRCs, one byte at a time. Far faster than any serial line.
+// Running a CRC-16 over data followed by its (big-endian) CRC gives 0.
+// Running a CRC-32 (starting from 0xFFFFFFFF) over data followed by its inverted (little-endian) CRC gives CRC32_RESIDUE.
+//
+WORD Crc16(WORD crc, const BYTE * buf, DWORD n) {
+    while (n-- > 0) {
+        crc = (WORD)((crc << 8) ^ Crc16Table[(crc >> 8) ^ *buf++]);
+    }
+    return crc;
+}
+
+DWORD Crc32(DWORD crc, const BYTE * buf, DWORD n) {
+    while (n-- > 0) {
+        crc = (crc >> 8) ^ Crc32Table[(crc ^ *buf++) & 0xFF];
+    }
+    return crc;
+}
+
+//
+// Wait for an event during a file transfer, watching the keyboard for Esc.
+// Returns 0 when the event is signalled, XFER_TIMED_OUT, or XFER_CANCELLED.
+//
+int XferWait(HANDLE h, DWORD timeout) {
+    LONG64 deadline = Now() + (LONG64)timeout * QpcFrequency / 1000;
+    while (1) {
+        HANDLE wait_h[2] = { h, Xfer.stdin_h };
+        DWORD wait_result = WaitForMultipleObjects(2, wait_h, FALSE, MsUntil(deadline));
+        if (wait_result == WAIT_OBJECT_0) {
+            return 0;
+        }
+        if (wait_result == WAIT_TIMEOUT) {
+            return XFER_TIMED_OUT;
+        }
+        if (wait_result != WAIT_OBJECT_0 + 1) {
+            ExitWithError("WaitForMultipleObjects(transfer)", true);
+        }
+
+        // Keys typed during a transfer are thrown away, except Esc, which cancels it
+        INPUT_RECORD ir[16];
+        DWORD records = 0;
+        if (ReadConsoleInputW(Xfer.stdin_h, ir, 16, &records) == 0) {
+            ExitWithError("ReadConsoleInputW", true);
+        }
+        for (DWORD i = 0; i < records; i++) {
+            if (ir[i].EventType == KEY_EVENT && ir[i].Event.KeyEvent.bKeyDown && ir[i].Event.KeyEvent.wVirtualKeyCode == VK_ESCAPE) {
+                Xfer.cancelled = true;
+                return XFER_CANCELLED;
+            }
+        }
+    }
+}
+
+//
+// Get the next byte from the port during a file transfer, straight from the RX ring.
+// Returns the byte, or XFER_TIMED_OUT if nothing arrives within timeout ms, or XFER_CANCELLED.
+//
+int XferGetByte(DWORD timeout) {
+    if (Xfer.cancelled) {
+        return XFER_CANCELLED;
+    }
+    while (Xfer.rx_len == 0) {
+        // Hand back what we've used, then look for more
+        ConsumeRx(Xfer.port, Xfer.rx_taken);
+        Xfer.rx_taken = 0;
+        Xfer.rx_len = RingReadable(&Xfer.port->rx, &Xfer.rx_p);
+        if (Xfer.rx_len > 0) {
+            break;
+        }
+        int result = XferWait(Xfer.port->rx.data_event, timeout);
+        if (result < 0) {
+            return result;
+        }
+    }
+    Xfer.rx_len--;
+    Xfer.rx_taken++;
+    return (BYTE)*Xfer.rx_p++;
+}
+
+//
+// The next byte from the port, without taking it, or -1 if none has arrived. Never waits.
+//
+int XferPeekByte() {
+    if (Xfer.rx_len == 0) {
+        ConsumeRx(Xfer.port, Xfer.rx_taken);
+        Xfer.rx_taken = 0;
+        Xfer.rx_len = RingReadable(&Xfer.port->rx, &Xfer.rx_p);
+        if (Xfer.rx_len == 0) {
+            return -1;
+        }
+    }
+    return (BYTE)*Xfer.rx_p;
+}
+
+//
+// Queue data for the port during a file transfer. Waits while the TX ring is full. Returns false if cancelled,
+// or if the port stops taking data.
+//
+bool XferPut(const void * buf, DWORD n) {
+    const char * p = buf;
+    while (n > 0 && !Xfer.cancelled) {
+        DWORD pushed = RingPush(&Xfer.port->tx, p, n);
+        p += pushed;
+        n -= pushed;
+        if (n > 0) {
+            int result = XferWait(Xfer.port->tx.space_event, XFER_TIMEOUT);
+            if (result == XFER_TIMED_OUT) {
+                Xfer.error = "the port isn't taking data";
+                return false;
+            }
+        }
+    }
+    return !Xfer.cancelled;
+}
+
+bool XferPutByte(BYTE c) {
+    return XferPut(&c, 1);
+}
+
+//
+// Tell the other end we're giving up: a string of CANs, then backspaces to erase them from a command line.
+//
+void XferAbort() {
+    static const char abort_seq[] = "\x18\x18\x18\x18\x18\x18\x18\x18\b\b\b\b\b\b\b\b";
+    bool cancelled = Xfer.cancelled;
+    Xfer.cancelled = false;                 // Let this through, even when the user cancelled
+    XferPut(abort_seq, sizeof(abort_seq) - 1);
+    Xfer.cancelled = cancelled;
+}
+
+//
+// Throw away what the port sends until it goes quiet, to get back in step with the other end.
+//
+void XferPurge() {
+    while (XferGetByte(XFER_PURGE) >= 0) {
+    }
+}
+
+//
+// Show transfer progress and speed in the title bar.
+//
+void XferProgress() {
+    if (MsUntil(Xfer.last_progress + PASTE_PROGRESS * QpcFrequency / 1000) > 0) {
+        return;
+    }
+    Xfer.last_progress = Now();
+    char title[MAX_PATH + 128];
+    double secs = SecondsSince(Xfer.start);
+    snprintf(title, sizeof(title), "spconnect: %s %s, %lld of %lld bytes, %.0f bytes/s", Xfer.receiving ? "receiving" : "sending",
+        Xfer.name, Xfer.pos, Xfer.size, (secs > 0) ? (Xfer.pos - Xfer.start_pos) / secs : 0.0);
+    SetConsoleTitleA(title);
+}
+
+//
+// Report how a file went, against what the baud rate allows.
+//
+void XferReport(const char * what) {
+    double secs = SecondsSince(Xfer.start);
+    LONG64 moved = Xfer.pos - Xfer.start_pos;
+    double rate = (secs > 0) ? moved / secs : 0.0;
+    fprintf(stderr, "%s %s: %lld bytes in %.2f s, %.0f bytes/s", what, Xfer.name, moved, secs, rate);
+    if (Xfer.line_rate > 0) {
+        fprintf(stderr, " (%.0f%% of the %.0f bytes/s possible at %u baud)", rate * 100.0 / Xfer.line_rate, Xfer.line_rate, Xfer.baud);
+    }
+    if (Xfer.start_pos > 0) {
+        fprintf(stderr, ", resumed at %lld", Xfer.start_pos);
+    }
+    if (Xfer.errors > 0) {
+        fprintf(stderr, ", %u errors recovered", Xfer.errors);
+    }
+    fprintf(stderr, ".\n");
+}
+
+//
+// Receiving: open the file to write. name is the name the sender gave (YMODEM, ZMODEM), which goes in the download
+// directory, or NULL to use the download path itself (XMODEM). With resume, an existing file is added to, and
+// *pos says how much of it there already is. Returns false if the file can't be opened, or the name isn't safe.
+//
+bool XferOpenOutput(const char * name, LONG64 size, bool resume, LONG64 * pos) {
+    wchar_t path[MAX_PATH];
+    *pos = 0;
+    if (name == NULL) {
+        swprintf(path, MAX_PATH, L"%ls", Xfer.path);
+        WideCharToMultiByte(GetConsoleOutputCP(), 0, Xfer.path, -1, Xfer.name, MAX_PATH, NULL, NULL);
+    }
+    else {
+        // Only ever use the last part of the name, so the sender can't write outside the download directory
+        const char * base = name;
+        for (const char * p = name; *p != 0; p++) {
+            if (*p == '/' || *p == '\\' || *p == ':') {
+                base = p + 1;
+            }
+        }
+        wchar_t base_w[MAX_PATH];
+        if (base[0] == 0 || strcmp(base, ".") == 0 || strcmp(base, "..") == 0 ||
+            MultiByteToWideChar(CP_UTF8, 0, base, -1, base_w, MAX_PATH) == 0) {
+            Xfer.error = "the sender gave a bad file name";
+            return false;
+        }
+        swprintf(path, MAX_PATH, L"%ls\\%ls", (Xfer.path[0] != 0) ? Xfer.path : L".", base_w);
+        snprintf(Xfer.name, MAX_PATH, "%s", base);
+    }
+
+    Xfer.out = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, resume ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (Xfer.out == INVALID_HANDLE_VALUE) {
+        Xfer.out = NULL;
+        Xfer.error = "can't create the file";
+        return false;
+    }
+    if (resume) {
+        LARGE_INTEGER existing = { 0 };
+        GetFileSizeEx(Xfer.out, &existing);
+        if (existing.QuadPart > 0 && (size < 0 || existing.QuadPart <= size)) {
+            *pos = existing.QuadPart;
+            SetFilePointerEx(Xfer.out, existing, NULL, FILE_BEGIN);
+        }
+        else {
+            SetEndOfFile(Xfer.out);
+        }
+    }
+
+    Xfer.size = size;
+    Xfer.pos = *pos;
+    Xfer.start_pos = *pos;
+    Xfer.errors = 0;
+    Xfer.start = Now();
+    Xfer.last_progress = 0;
+    if (size >= 0) {
+        fprintf(stderr, "Receiving %s, %lld bytes.\n", Xfer.name, size);
+    } else {
+        fprintf(stderr, "Receiving %s.\n", Xfer.name);
+    }
+    return true;
+}
+
+//
+// Receiving: add data to the file.
+//
+bool XferWrite(const BYTE * buf, DWORD n) {
+    DWORD written = 0;
+    if (n > 0 && (WriteFile(Xfer.out, buf, n, &written, NULL) == 0 || written != n)) {
+        Xfer.error = "can't write the file";
+        return false;
+    }
+    Xfer.pos += n;
+    XferProgress();
+    return true;
+}
+
+//
+// Receiving: the file is complete (or the transfer failed). Close it and report.
+//
+void XferCloseOutput(bool complete) {
+    if (Xfer.out == NULL) {
+        return;
+    }
+    CloseHandle(Xfer.out);
+    Xfer.out = NULL;
+    XferReport(complete ? "Received" : "Partly received");
+}
+
+//
+// The file header YMODEM and ZMODEM send: the name, a NUL, then the size, modification time (octal seconds since
+// 1970) and mode (octal), and for ZMODEM the number of files and bytes still to send. Returns the length,
+// including the final NUL.
+//
+DWORD XferFileInfo(char * buf, DWORD size, bool zmodem) {
+    FILETIME mtime = { 0 };
+    GetFileTime(Xfer.file, NULL, NULL, &mtime);
+    LONG64 unix_time = ((((LONG64)mtime.dwHighDateTime << 32) | mtime.dwLowDateTime) - 116444736000000000) / 10000000;
+    int name_len = snprintf(buf, size, "%s", Xfer.name) + 1;
+    int info_len;
+    if (zmodem) {
+        info_len = snprintf(buf + name_len, size - name_len, "%lld %llo 100644 0 1 %lld", Xfer.size, max(unix_time, 0), Xfer.size);
+    } else {
+        info_len = snprintf(buf + name_len, size - name_len, "%lld %llo 100644", Xfer.size, max(unix_time, 0));
+    }
+    return name_len + info_len + 1;
+}
+
+//
+// Parse a YMODEM or ZMODEM file header: the name, and the size if given (-1 if not).
+//
+void XferParseFileInfo(const BYTE * buf, DWORD n, char * name, LONG64 * size) {
+    DWORD name_len = 0;
+    while (name_len < n && name_len < MAX_PATH - 1 && buf[name_len] != 0) {
+        name[name_len] = buf[name_len];
+        name_len++;
+    }
+    name[name_len] = 0;
+    *size = -1;
+    if (name_len + 1 < n && buf[name_len + 1] >= '0' && buf[name_len + 1] <= '9') {
+        *size = strtoll((const char *)buf + name_len + 1, NULL, 10);
+    }
+}
+
+//
+// XMODEM/YMODEM: wait for the receiver to ask for data, with 'C' (CRC-16) or NAK (checksum).
+// Returns 'C', NAK, or a negative error.
+//
+int XWaitStart(DWORD timeout) {
+    LONG64 deadline = Now() + (LONG64)timeout * QpcFrequency / 1000;
+    while (1) {
+        int c = XferGetByte(MsUntil(deadline));
+        if (c == 'C' || c == NAK || c < 0) {
+            return c;
+        }
+        if (c == CAN && XferGetByte(XFER_PURGE) == CAN) {
+            Xfer.error = "cancelled by the receiver";
+            return XFER_ABORTED;
+        }
+    }
+}
+
+//
+// XMODEM/YMODEM: send one block, and wait for it to be acknowledged, resending it as needed.
+// block_len is 128 or 1024. Short data is padded with pad.
+//
+bool XSendBlock(BYTE number, const char * data, DWORD n, DWORD block_len, BYTE pad, bool crc) {
+    static __declspec(thread) BYTE block[3 + 1024 + 2];
+    block[0] = (block_len == 1024) ? STX : SOH;
+    block[1] = number;
+    block[2] = (BYTE)~number;
+    if (n > 0) {
+        memcpy(block + 3, data, n);
+    }
+    memset(block + 3 + n, pad, block_len - n);
+    DWORD len = 3 + block_len;
+    if (crc) {
+        WORD c = Crc16(0, block + 3, block_len);
+        block[len++] = (BYTE)(c >> 8);
+        block[len++] = (BYTE)c;
+    }
+    else {
+        BYTE sum = 0;
+        for (DWORD i = 0; i < block_len; i++) {
+            sum += block[3 + i];
+        }
+        block[len++] = sum;
+    }
+
+    for (int tries = 0; tries < XFER_RETRIES; tries++) {
+        if (!XferPut(block, len)) {
+            return false;
+        }
+        // Wait for the answer, ignoring noise
+        int c;
+        do {
+            c = XferGetByte(XFER_TIMEOUT);
+        } while (c >= 0 && c != ACK && c != NAK && c != CAN && c != 'C');
+        if (c == ACK) {
+            return true;
+        }
+        if (c == XFER_CANCELLED) {
+            return false;
+        }
+        if (c == CAN && XferGetByte(XFER_PURGE) == CAN) {
+            Xfer.error = "cancelled by the receiver";
+            return false;
+        }
+        Xfer.errors++;
+    }
+    Xfer.error = "too many errors";
+    return false;
+}
+
+//
+// XMODEM/YMODEM send. XMODEM sends 128 byte blocks (1024 for xmodem-1k, when the receiver asks for CRCs).
+// YMODEM sends 1024 byte blocks, with a header block (0) giving the name and size, and an empty header to end the batch.
+//
+bool XSend(bool ymodem, bool one_k) {
+    if (ymodem && Xfer.size > XFER_MAX_SIZE) {
+        Xfer.error = "YMODEM can't send files of 4 GB or more";
+        return false;
+    }
+    int start = XWaitStart(XFER_START_TIMEOUT);
+    if (start < 0) {
+        if (start == XFER_TIMED_OUT) {
+            Xfer.error = "the receiver didn't start";
+        }
+        return false;
+    }
+    bool crc = (start == 'C');
+    DWORD block_len = (one_k && crc) ? 1024 : 128;
+
+    if (ymodem) {
+        char info[1024];
+        DWORD info_len = XferFileInfo(info, sizeof(info), false);
+        if (!XSendBlock(0, info, info_len, (info_len > 128) ? 1024 : 128, 0, crc)) {
+            return false;
+        }
+        if (XWaitStart(XFER_TIMEOUT) < 0) {
+            return false;
+        }
+    }
+
+    Xfer.start = Now();
+    BYTE number = 1;
+    while (Xfer.pos < Xfer.size) {
+        DWORD n = (DWORD)min(Xfer.size - Xfer.pos, block_len);
+        DWORD len = (n <= 128) ? 128 : block_len;   // Don't pad the last bit out to a whole 1K block
+        if (!XSendBlock(number++, Xfer.view + Xfer.pos, n, len, CPMEOF, crc)) {
+            return false;
+        }
+        Xfer.pos += n;
+        XferProgress();
+    }
+
+    // End of file. Some receivers NAK the first EOT, to be sure.
+    int c = XFER_TIMED_OUT;
+    for (int tries = 0; tries < XFER_RETRIES && c != ACK; tries++) {
+        if (!XferPutByte(EOT)) {
+            return false;
+        }
+        c = XferGetByte(XFER_TIMEOUT);
+        if (c == XFER_CANCELLED) {
+            return false;
+        }
+    }
+    if (c != ACK) {
+        Xfer.error = "the receiver didn't acknowledge the end of the file";
+        return false;
+    }
+    XferReport("Sent");
+
+    // End of batch
+    if (ymodem) {
+        if (XWaitStart(XFER_TIMEOUT) < 0) {
+            return false;
+        }
+        return XSendBlock(0, NULL, 0, 128, 0, crc);
+    }
+    return true;
+}
+
+//
+// XMODEM/YMODEM receive. Asks for CRC-16 with 'C', falling back to checksums (NAK) for an XMODEM sender that
+// doesn't answer.
+//
+bool XReceive(bool ymodem) {
+    static __declspec(thread) BYTE block[1024 + 2];
+    bool crc = true;
+    while (1) {                                 // Each file in a YMODEM batch
+        BYTE expected = ymodem ? 0 : 1;
+        bool started = false;                   // A block of this file has arrived
+        bool ask = true;                        // Send 'C' or NAK to ask the sender to start
+        int tries = 0;
+        LONG64 pos = 0;
+        while (1) {                             // Each block
+            if (ask) {
+                if (!XferPutByte(crc ? 'C' : NAK)) {
+                    return false;
+                }
+                ask = false;
+            }
+            int c = XferGetByte(started ? XFER_TIMEOUT : XFER_POLL);
+            if (c == XFER_CANCELLED) {
+                return false;
+            }
+            if (c == XFER_TIMED_OUT) {
+                if (++tries > (started ? XFER_RETRIES : XFER_START_TIMEOUT / XFER_POLL)) {
+                    Xfer.error = started ? "too many errors" : "the sender didn't start";
+                    return false;
+                }
+                if (started) {
+                    Xfer.errors++;
+                    if (!XferPutByte(NAK)) {
+                        return false;
+                    }
+                } else {
+                    crc = ymodem || tries < 3;
+                    ask = true;
+                }
+                continue;
+            }
+            if (c == CAN && XferGetByte(XFER_PURGE) == CAN) {
+                Xfer.error = "cancelled by the sender";
+                return false;
+            }
+            if (c == EOT) {
+                if (!XferPutByte(ACK)) {
+                    return false;
+                }
+                XferCloseOutput(true);
+                break;
+            }
+            if (c != SOH && c != STX) {
+                continue;                       // Noise
+            }
+
+            // Read the rest of the block
+            DWORD block_len = (c == STX) ? 1024 : 128;
+            DWORD trailer = crc ? 2 : 1;
+            int number = XferGetByte(XFER_POLL);
+            int inverse = XferGetByte(XFER_POLL);
+            bool good = (number >= 0 && inverse >= 0 && number == (BYTE)~inverse);
+            for (DWORD i = 0; good && i < block_len + trailer; i++) {
+                c = XferGetByte(XFER_POLL);
+                good = (c >= 0);
+                block[i] = (BYTE)c;
+            }
+            if (good && crc) {
+                good = (Crc16(0, block, block_len + 2) == 0);
+            }
+            else if (good) {
+                BYTE sum = 0;
+                for (DWORD i = 0; i < block_len; i++) {
+                    sum += block[i];
+                }
+                good = (sum == block[block_len]);
+            }
+            if (Xfer.cancelled) {
+                return false;
+            }
+            if (!good) {
+                Xfer.errors++;
+                if (++tries > XFER_RETRIES) {
+                    Xfer.error = "too many errors";
+                    return false;
+                }
+                XferPurge();
+                if (!XferPutByte(NAK)) {
+                    return false;
+                }
+                continue;
+            }
+            tries = 0;
+
+            // A repeat of the last block, because our ACK was lost
+            if (started && number == (BYTE)(expected - 1)) {
+                if (!XferPutByte(ACK)) {
+                    return false;
+                }
+                continue;
+            }
+            if (number != expected) {
+                Xfer.error = "lost track of the blocks";
+                XferAbort();
+                return false;
+            }
+            expected++;
+
+            // YMODEM header block: the name and size, or nothing at the end of the batch
+            if (ymodem && number == 0 && !started) {
+                if (block[0] == 0) {
+                    return XferPutByte(ACK);
+                }
+                char name[MAX_PATH];
+                LONG64 size;
+                XferParseFileInfo(block, block_len, name, &size);
+                if (!XferOpenOutput(name, size, false, &pos)) {
+                    XferAbort();
+                    return false;
+                }
+                started = true;
+                ask = true;                     // Ask again, for the data
+                if (!XferPutByte(ACK)) {
+                    return false;
+                }
+                continue;
+            }
+            if (!started && !ymodem) {
+                if (!XferOpenOutput(NULL, -1, false, &pos)) {
+                    XferAbort();
+                    return false;
+                }
+            }
+            started = true;
+
+            // Write the data. YMODEM gives the size, so the padding can be left off.
+            DWORD n = block_len;
+            if (Xfer.size >= 0) {
+                n = (DWORD)max(min(n, Xfer.size - Xfer.pos), 0);
+            }
+            if (!XferWrite(block, n)) {
+                XferAbort();
+                return false;
+            }
+            if (!XferPutByte(ACK)) {
+                return false;
+            }
+        }
+        if (!ymodem) {
+            return true;
+        }
+    }
+}
+
+//
+// The value of a hex digit, or -1.
+//
+int HexDigit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+//
+// ZMODEM: add a byte to an outgoing frame, escaped as needed. Returns the new end of the frame.
+//
+BYTE * ZEscape(BYTE * p, BYTE c) {
+    static __declspec(thread) BYTE last = 0;
+    bool escape;
+    switch (c) {
+    case ZDLE: case DLE: case XON: case XOFF:
+    case ZDLE | 0x80: case DLE | 0x80: case XON | 0x80: case XOFF | 0x80:
+        escape = true;
+        break;
+    case '\r': case '\r' | 0x80:
+        escape = ((last & 0x7F) == '@');        // "@\r" is special to some networks
+        break;
+    default:
+        escape = Xfer.esc_ctl && (c & 0x60) == 0;
+    }
+    last = c;
+    if (escape) {
+        *p++ = ZDLE;
+        c ^= 0x40;
+    }
+    *p++ = c;
+    return p;
+}
+
+//
+// ZMODEM: send a hex header. Used for the handshake, as it survives links that aren't 8-bit clean.
+//
+bool ZPutHexHeader(BYTE type, const BYTE hdr[4]) {
+    static const char hex[] = "0123456789abcdef";
+    BYTE raw[7] = { type, hdr[0], hdr[1], hdr[2], hdr[3] };
+    WORD crc = Crc16(0, raw, 5);
+    raw[5] = (BYTE)(crc >> 8);
+    raw[6] = (BYTE)crc;
+    char out[32] = { ZPAD, ZPAD, ZDLE, ZHEX };
+    DWORD len = 4;
+    for (int i = 0; i < 7; i++) {
+        out[len++] = hex[raw[i] >> 4];
+        out[len++] = hex[raw[i] & 0xF];
+    }
+    out[len++] = '\r';
+    out[len++] = (char)('\n' | 0x80);
+    if (type != ZFIN && type != ZACK) {
+        out[len++] = XON;                       // Undo a spurious XOFF
+    }
+    return XferPut(out, len);
+}
+
+//
+// ZMODEM: send a binary header, with a CRC-32 if the receiver can take one.
+//
+bool ZPutBinHeader(BYTE type, const BYTE hdr[4]) {
+    BYTE out[32] = { ZPAD, ZDLE, Xfer.crc32 ? ZBIN32 : ZBIN };
+    BYTE * p = out + 3;
+    BYTE raw[5] = { type, hdr[0], hdr[1], hdr[2], hdr[3] };
+    for (int i = 0; i < 5; i++) {
+        p = ZEscape(p, raw[i]);
+    }
+    if (Xfer.crc32) {
+        DWORD crc = ~Crc32(0xFFFFFFFF, raw, 5);
+        for (int i = 0; i < 4; i++) {
+            p = ZEscape(p, (BYTE)(crc >> (8 * i)));
+        }
+    }
+    else {
+        WORD crc = Crc16(0, raw, 5);
+        p = ZEscape(p, (BYTE)(crc >> 8));
+        p = ZEscape(p, (BYTE)crc);
+    }
+    return XferPut(out, (DWORD)(p - out));
+}
+
+//
+// ZMODEM: send a data subpacket, ending with frame_end (ZCRCE, ZCRCG, ZCRCQ or ZCRCW).
+//
+bool ZPutData(const BYTE * buf, DWORD n, BYTE frame_end) {
+    static __declspec(thread) BYTE out[ZMODEM_SUBPACKET * 2 + 16];
+    BYTE * p = out;
+    for (DWORD i = 0; i < n; i++) {
+        p = ZEscape(p, buf[i]);
+    }
+    *p++ = ZDLE;
+    *p++ = frame_end;
+    if (Xfer.crc32) {
+        DWORD crc = ~Crc32(Crc32(0xFFFFFFFF, buf, n), &frame_end, 1);
+        for (int i = 0; i < 4; i++) {
+            p = ZEscape(p, (BYTE)(crc >> (8 * i)));
+        }
+    }
+    else {
+        WORD crc = Crc16(Crc16(0, buf, n), &frame_end, 1);
+        p = ZEscape(p, (BYTE)(crc >> 8));
+        p = ZEscape(p, (BYTE)crc);
+    }
+    return XferPut(out, (DWORD)(p - out));
+}
+
+//
+// ZMODEM: get a byte, undoing the escaping. Returns the byte, ZFRAME_END | the frame end character,
+// or a negative error. Five CANs in a row mean the other end has given up.
+//
+int ZGetByte() {
+    int c;
+    do {
+        c = XferGetByte(XFER_TIMEOUT);
+    } while (c >= 0 && ((c & 0x7F) == XON || (c & 0x7F) == XOFF));
+    if (c != ZDLE) {
+        return c;
+    }
+
+    int cans = 1;
+    while (1) {
+        c = XferGetByte(XFER_TIMEOUT);
+        if (c < 0) {
+            return c;
+        }
+        if (c == ZDLE) {
+            if (++cans >= 5) {
+                Xfer.error = "cancelled by the other end";
+                return XFER_ABORTED;
+            }
+            continue;
+        }
+        if ((c & 0x7F) == XON || (c & 0x7F) == XOFF) {
+            continue;
+        }
+        switch (c) {
+        case ZCRCE: case ZCRCG: case ZCRCQ: case ZCRCW:
+            return ZFRAME_END | c;
+        case ZRUB0:
+            return 0x7F;
+        case ZRUB1:
+            return 0xFF;
+        }
+        if ((c & 0x60) == 0x40) {
+            return c ^ 0x40;
+        }
+        return XFER_BAD;
+    }
+}
+
+//
+// ZMODEM: get a header, skipping anything before it. Returns the frame type and fills in hdr, or a negative error.
+// Remembers whether it had a CRC-32, as the data that follows uses the same.
+//
+int ZGetHeader(BYTE hdr[4]) {
+    BYTE raw[9];
+    int cans = 0;
+    bool pad = false;
+    while (1) {
+        int c = XferGetByte(XFER_TIMEOUT);
+        if (c < 0) {
+            return c;
+        }
+        if ((c & 0x7F) == ZPAD) {
+            pad = true;
+            continue;
+        }
+        if (c == ZDLE && pad) {
+            c = XferGetByte(XFER_TIMEOUT);
+            if (c < 0) {
+                return c;
+            }
+            if (c == ZHEX || c == ZBIN || c == ZBIN32) {
+                Xfer.rx_crc32 = (c == ZBIN32);
+                if (c == ZHEX) {
+                    // Pairs of hex digits, then CR LF
+                    for (int i = 0; i < 7; i++) {
+                        int hi = XferGetByte(XFER_TIMEOUT);
+                        int lo = XferGetByte(XFER_TIMEOUT);
+                        if (hi < 0 || lo < 0) {
+                            return (hi < 0) ? hi : lo;
+                        }
+                        hi = HexDigit((char)hi);
+                        lo = HexDigit((char)lo);
+                        if (hi < 0 || lo < 0) {
+                            return XFER_BAD;
+                        }
+                        raw[i] = (BYTE)(hi << 4 | lo);
+                    }
+                    if (Crc16(0, raw, 7) != 0) {
+                        return XFER_BAD;
+                    }
+                    c = XferGetByte(XFER_PURGE);
+                    if ((c & 0x7F) == '\r') {
+                        XferGetByte(XFER_PURGE);
+                    }
+                }
+                else {
+                    DWORD len = (Xfer.rx_crc32) ? 9 : 7;
+                    for (DWORD i = 0; i < len; i++) {
+                        c = ZGetByte();
+                        if (c < 0 || c > 0xFF) {
+                            return (c < 0) ? c : XFER_BAD;
+                        }
+                        raw[i] = (BYTE)c;
+                    }
+                    if (Xfer.rx_crc32 ? Crc32(0xFFFFFFFF, raw, 9) != CRC32_RESIDUE : Crc16(0, raw, 7) != 0) {
+                        return XFER_BAD;
+                    }
+                }
+                memcpy(hdr, raw + 1, 4);
+                return raw[0];
+            }
+        }
+        // Five CANs in a row, outside a header, mean the other end has given up
+        cans = (c == CAN) ? cans + 1 : 0;
+        if (cans >= 5) {
+            Xfer.error = "cancelled by the other end";
+            return XFER_ABORTED;
+        }
+        pad = false;
+    }
+}
+
+//
+// ZMODEM: get a data subpacket. Returns the frame end character, or a negative error.
+//
+int ZGetData(BYTE * buf, DWORD size, DWORD * n) {
+    *n = 0;
+    while (1) {
+        int c = ZGetByte();
+        if (c < 0) {
+            return c;
+        }
+        if (c & ZFRAME_END) {
+            BYTE frame_end = (BYTE)c;
+            BYTE crc[4];
+            DWORD crc_len = Xfer.rx_crc32 ? 4 : 2;
+            for (DWORD i = 0; i < crc_len; i++) {
+                c = ZGetByte();
+                if (c < 0 || c > 0xFF) {
+                    return (c < 0) ? c : XFER_BAD;
+                }
+                crc[i] = (BYTE)c;
+            }
+            bool good;
+            if (Xfer.rx_crc32) {
+                good = (Crc32(Crc32(Crc32(0xFFFFFFFF, buf, *n), &frame_end, 1), crc, 4) == CRC32_RESIDUE);
+            } else {
+                good = (Crc16(Crc16(Crc16(0, buf, *n), &frame_end, 1), crc, 2) == 0);
+            }
+            return good ? frame_end : XFER_BAD;
+        }
+        if (*n == size) {
+            return XFER_BAD;                  // Too long
+        }
+        buf[(*n)++] = (BYTE)c;
+    }
+}
+
+//
+// ZMODEM: put a file position in a header, and get it back. Positions are 32-bit, so ZSend() won't send larger files.
+//
+void ZSetPos(BYTE hdr[4], LONG64 pos) {
+    for (int i = 0; i < 4; i++) {
+        hdr[i] = (BYTE)(pos >> (8 * i));
+    }
+}
+
+LONG64 ZGetPos(const BYTE hdr[4]) {
+    return (LONG64)hdr[0] | (LONG64)hdr[1] << 8 | (LONG64)hdr[2] << 16 | (LONG64)hdr[3] << 24;
+}
+
+//
+// ZMODEM send. Data streams out in subpackets that need no acknowledgement (ZCRCG), so the line never sits idle
+// waiting for the receiver. The receiver only speaks up to ask for a resend from a given position (ZRPOS), which is
+// also how an interrupted transfer resumes. If the receiver has a limited buffer, we stop for an ACK each time it's full.
+//
+bool ZSend() {
+    static __declspec(thread) BYTE info[1024];
+    BYTE hdr[4] = { 0 };
+    BYTE zero[4] = { 0 };
+    int type;
+    if (Xfer.size > XFER_MAX_SIZE) {
+        Xfer.error = "ZMODEM can't send files of 4 GB or more";
+        return false;
+    }
+
+    // Start the receiver, in case the other end is a shell, and wait for it to say what it can do (ZRINIT)
+    Xfer.crc32 = false;
+    Xfer.esc_ctl = false;
+    if (!XferPut("rz\r", 3)) {
+        return false;
+    }
+    DWORD window = 0;
+    for (int tries = 0; ; tries++) {
+        if (tries > XFER_START_TIMEOUT / XFER_TIMEOUT) {
+            Xfer.error = "the receiver didn't start";
+            return false;
+        }
+        if (!ZPutHexHeader(ZRQINIT, zero)) {
+            return false;
+        }
+        type = ZGetHeader(hdr);
+        if (type == ZRINIT) {
+            Xfer.crc32 = (hdr[ZF0] & CANFC32) != 0;
+            Xfer.esc_ctl = (hdr[ZF0] & ESCCTL) != 0;
+            window = hdr[ZP0] | hdr[ZP1] << 8;
+            break;
+        }
+        if (type == ZCHALLENGE) {
+            ZPutHexHeader(ZACK, hdr);
+        }
+        if (type == XFER_CANCELLED || type == XFER_ABORTED) {
+            return false;
+        }
+    }
+
+    // Offer the file (ZFILE), and find out where to start from (ZRPOS)
+    DWORD info_len = XferFileInfo((char *)info, sizeof(info), true);
+    LONG64 pos = 0;
+    for (int tries = 0; ; tries++) {
+        if (tries > XFER_RETRIES) {
+            Xfer.error = "the receiver didn't accept the file";
+            return false;
+        }
+        BYTE file_hdr[4] = { 0 };
+        file_hdr[ZF0] = Resume ? ZCRESUM : ZCBIN;
+        if (!ZPutBinHeader(ZFILE, file_hdr) || !ZPutData(info, info_len, ZCRCW)) {
+            return false;
+        }
+        do {
+            type = ZGetHeader(hdr);
+            if (type == ZCRC) {
+                // The receiver wants the CRC of (part of) the file, to check that what it has matches
+                LONG64 len = ZGetPos(hdr);
+                len = (len == 0 || len > Xfer.size) ? Xfer.size : len;
+                DWORD crc = 0xFFFFFFFF;
+                for (LONG64 done = 0; done < len; done += MAXDWORD / 2) {
+                    crc = Crc32(crc, (BYTE *)Xfer.view + done, (DWORD)min(len - done, MAXDWORD / 2));
+                }
+                ZSetPos(hdr, ~crc);
+                ZPutHexHeader(ZCRC, hdr);
+            }
+        } while (type == ZCRC || type == ZRINIT);   // A ZRINIT here answers one of our ZRQINITs
+        if (type == ZRPOS) {
+            pos = min(ZGetPos(hdr), Xfer.size);
+            break;
+        }
+        if (type == ZSKIP) {
+            fprintf(stderr, "The receiver skipped %s.\n", Xfer.name);
+            goto finish;
+        }
+        if (type == XFER_CANCELLED || type == XFER_ABORTED) {
+            return false;
+        }
+    }
+
+    // Stream the data (ZDATA), starting again from wherever the receiver asks
+    Xfer.start_pos = pos;
+    Xfer.start = Now();
+    int errors = 0;
+    LONG64 error_pos = -1;                      // Where the last resend started. Only errors in a row there count.
+    while (1) {
+        ZSetPos(hdr, pos);
+        if (!ZPutBinHeader(ZDATA, hdr)) {
+            return false;
+        }
+        LONG64 window_start = pos;
+        bool restart = false;
+        while (!restart) {
+            DWORD n = (DWORD)min(Xfer.size - pos, ZMODEM_SUBPACKET);
+            bool last = (pos + n == Xfer.size);
+            bool wait_ack = (window > 0 && pos + n - window_start >= window);
+            BYTE frame_end = wait_ack ? ZCRCW : last ? ZCRCE : ZCRCG;
+            if (!ZPutData((BYTE *)Xfer.view + pos, n, frame_end)) {
+                return false;
+            }
+            pos += n;
+            Xfer.pos = pos;
+            XferProgress();
+
+            // With a limited receive buffer, wait until the receiver has caught up
+            if (wait_ack) {
+                type = ZGetHeader(hdr);
+                if (type == ZACK) {
+                    window_start = pos;
+                    if (!last) {
+                        ZSetPos(hdr, pos);
+                        if (!ZPutBinHeader(ZDATA, hdr)) {   // A ZCRCW ends the frame, so start another
+                            return false;
+                        }
+                        continue;
+                    }
+                }
+                else if (type == XFER_CANCELLED || type == XFER_ABORTED) {
+                    return false;
+                }
+                else {
+                    // ZRPOS, or anything unexpected: start again from where the receiver says, or from the last ACK
+                    pos = (type == ZRPOS) ? min(ZGetPos(hdr), Xfer.size) : window_start;
+                    restart = true;
+                    continue;
+                }
+            }
+            if (last) {
+                break;
+            }
+
+            // Check what the receiver has sent back, without waiting. It only speaks up if something is wrong.
+            int c;
+            while ((c = XferPeekByte()) >= 0 && (c & 0x7F) != ZPAD && c != CAN) {
+                XferGetByte(0);
+            }
+            if (c >= 0) {
+                type = ZGetHeader(hdr);
+                if (type == ZRPOS) {
+                    pos = min(ZGetPos(hdr), Xfer.size);
+                    restart = true;
+                }
+                else if (type == XFER_CANCELLED || type == XFER_ABORTED) {
+                    return false;
+                }
+            }
+        }
+        if (restart) {
+            Xfer.errors++;
+            errors = (pos > error_pos) ? 1 : errors + 1;
+            error_pos = pos;
+            if (errors > XFER_RETRIES) {
+                Xfer.error = "too many errors";
+                return false;
+            }
+            continue;
+        }
+
+        // End of file (ZEOF). The receiver answers ZRINIT once it has everything, or ZRPOS if it's missing some.
+        ZSetPos(hdr, Xfer.size);
+        if (!ZPutBinHeader(ZEOF, hdr)) {
+            return false;
+        }
+        do {
+            type = ZGetHeader(hdr);
+        } while (type == ZACK);
+        if (type == ZRINIT) {
+            break;
+        }
+        if (type == XFER_CANCELLED || type == XFER_ABORTED) {
+            return false;
+        }
+        pos = (type == ZRPOS) ? min(ZGetPos(hdr), Xfer.size) : pos;
+        Xfer.errors++;
+        errors = (pos > error_pos) ? 1 : errors + 1;
+        error_pos = pos;
+        if (errors > XFER_RETRIES) {
+            Xfer.error = "too many errors";
+            return false;
+        }
+    }
+    XferReport("Sent");
+
+finish:
+    // End the session (ZFIN), and sign off with "OO"
+    for (int tries = 0; tries < XFER_RETRIES; tries++) {
+        if (!ZPutHexHeader(ZFIN, zero)) {
+            return false;
+        }
+        type = ZGetHeader(hdr);
+        if (type == ZFIN) {
+            return XferPut("OO", 2);
+        }
+        if (type == XFER_CANCELLED || type == XFER_ABORTED) {
+            return false;
+        }
+    }
+    return true;                                // The file got there, even if the goodbye didn't
+}
+
+//
+// ZMODEM receive. Takes a batch of files into the download directory. A file that is already partly there is
+// resumed if the sender asks (sz -r), or with --resume.
+//
+bool ZReceive() {
+    static __declspec(thread) BYTE buf[ZMODEM_SUBPACKET * 8];
+    BYTE hdr[4];
+    BYTE zero[4] = { 0 };
+    BYTE init[4] = { 0 };
+    init[ZF0] = CANFDX | CANOVIO | CANFC32;     // Full duplex, overlapped I/O, CRC-32. Buffer size 0: stream away.
+    LONG64 pos = 0;
+    int tries = 0;
+    bool send_init = true;
+
+    while (1) {
+        // Between files: say we're ready (ZRINIT), and wait for a file (ZFILE) or the end (ZFIN)
+        if (send_init && !ZPutHexHeader(ZRINIT, init)) {
+            return false;
+        }
+        send_init = true;
+        int type = ZGetHeader(hdr);
+        DWORD n;
+        switch (type) {
+        case ZSINIT:
+            // The sender's settings. We don't need its attention string.
+            if (ZGetData(buf, sizeof(buf), &n) < 0) {
+                Xfer.errors++;
+                continue;
+            }
+            ZPutHexHeader(ZACK, zero);
+            send_init = false;
+            continue;
+        case ZFIN:
+            ZPutHexHeader(ZFIN, zero);
+            XferGetByte(XFER_PURGE);            // "OO"
+            XferGetByte(XFER_PURGE);
+            return true;
+        case ZFILE:
+            break;
+        case XFER_CANCELLED:
+        case XFER_ABORTED:
+            return false;
+        case XFER_TIMED_OUT:
+            if (++tries > XFER_START_TIMEOUT / XFER_TIMEOUT) {
+                Xfer.error = "the sender didn't start";
+                return false;
+            }
+            continue;
+        default:
+            continue;                           // ZRQINIT, or noise. Say we're ready again.
+        }
+
+        // ZFILE: the name and size follow
+        bool resume = Resume || hdr[ZF0] == ZCRESUM;
+        if (ZGetData(buf, sizeof(buf) - 1, &n) < 0) {
+            Xfer.errors++;
+            continue;
+        }
+        buf[n] = 0;
+        char name[MAX_PATH];
+        LONG64 size;
+        XferParseFileInfo(buf, n, name, &size);
+        if (!XferOpenOutput(name, size, resume, &pos)) {
+            XferAbort();
+            return false;
+        }
+        tries = 0;
+
+        // Take the data, asking for a resend from where we are (ZRPOS) after an error, until ZEOF
+        bool done = false;
+        bool ask = true;
+        while (!done) {
+            if (ask) {
+                ZSetPos(hdr, pos);
+                if (!ZPutHexHeader(ZRPOS, hdr)) {
+                    XferCloseOutput(false);
+                    return false;
+                }
+            }
+            ask = false;
+            type = ZGetHeader(hdr);
+            switch (type) {
+            case ZDATA:
+                if (ZGetPos(hdr) != pos) {
+                    break;                      // Still on its way from before our ZRPOS. What we asked for follows.
+                }
+                while (1) {
+                    int frame_end = ZGetData(buf, sizeof(buf), &n);
+                    if (frame_end < 0) {
+                        if (frame_end == XFER_CANCELLED || frame_end == XFER_ABORTED) {
+                            XferCloseOutput(false);
+                            return false;
+                        }
+                        Xfer.errors++;
+                        ask = true;
+                        break;
+                    }
+                    if (!XferWrite(buf, n)) {
+                        XferCloseOutput(false);
+                        XferAbort();
+                        return false;
+                    }
+                    pos += n;
+                    tries = 0;
+                    if (frame_end == ZCRCW || frame_end == ZCRCQ) {
+                        ZSetPos(hdr, pos);
+                        ZPutHexHeader(ZACK, hdr);
+                    }
+                    if (frame_end == ZCRCW || frame_end == ZCRCE) {
+                        break;                  // A header comes next
+                    }
+                }
+                break;
+            case ZEOF:
+                if (ZGetPos(hdr) == pos) {
+                    done = true;                // Otherwise it's from before a ZRPOS, and the rest is on its way
+                }
+                break;
+            case ZFILE:
+                ZGetData(buf, sizeof(buf), &n); // Our ZRPOS got lost
+                ask = true;
+                break;
+            case XFER_CANCELLED:
+            case XFER_ABORTED:
+                XferCloseOutput(false);
+                return false;
+            default:
+                Xfer.errors++;
+                ask = true;
+                break;
+            }
+            if (ask && ++tries > XFER_RETRIES) {
+                Xfer.error = "too many errors";
+                XferCloseOutput(false);
+                XferAbort();
+                return false;
+            }
+        }
+        XferCloseOutput(true);
+    }
+}
+
+//
+// Run a file transfer on the port (--upload, --download, or the upload/download hotkeys). It runs on the console
+// thread, through the same rings and port threads as the session, so received data goes to the protocol instead of
+// the console until it's done. Esc cancels. path is the file to send, or where to put what's received (the file for
+// XMODEM, the directory for YMODEM and ZMODEM).
+//
+void RunTransfer(HANDLE stdin_h, Port * port, bool receiving, const wchar_t * path) {
+    if (Sending.view != NULL) {
+        fprintf(stderr, "\nWait for the file being sent to finish first.\n");
+        return;
+    }
+    Xfer.port = port;
+    Xfer.stdin_h = stdin_h;
+    Xfer.receiving = receiving;
+    Xfer.cancelled = false;
+    Xfer.error = NULL;
+    Xfer.rx_len = 0;
+    Xfer.rx_taken = 0;
+    Xfer.pos = 0;
+    Xfer.start_pos = 0;
+    Xfer.size = 0;
+    Xfer.errors = 0;
+    Xfer.start = Now();
+    Xfer.last_progress = 0;
+    Xfer.out = NULL;
+    Xfer.line_rate = PortByteRate(port, &Xfer.baud);
+    swprintf(Xfer.path, MAX_PATH, L"%ls", path);
+
+    if (!receiving) {
+        if (!MapFileRead(path, &Xfer.file, &Xfer.mapping, &Xfer.view, &Xfer.size)) {
+            fprintf(stderr, "\nCan't open the file to send (error %u).\n", GetLastError());
+            return;
+        }
+        // The name the receiver sees is just the last part of the path
+        const wchar_t * base = path;
+        for (const wchar_t * p = path; *p != 0; p++) {
+            if (*p == '\\' || *p == '/' || *p == ':') {
+                base = p + 1;
+            }
+        }
+        WideCharToMultiByte(CP_UTF8, 0, base, -1, Xfer.name, MAX_PATH, NULL, NULL);
+        fprintf(stderr, "\nSending %s (%lld bytes) with %s. Press Esc to cancel.\n", Xfer.name, Xfer.size, ProtocolNames[Protocol]);
+    }
+    else {
+        fprintf(stderr, "\nReceiving with %s. Press Esc to cancel.\n", ProtocolNames[Protocol]);
+    }
+
+    bool ok;
+    switch (Protocol) {
+    case XFER_XMODEM:
+    case XFER_XMODEM_1K:
+        ok = receiving ? XReceive(false) : XSend(false, Protocol == XFER_XMODEM_1K);
+        break;
+    case XFER_YMODEM:
+        ok = receiving ? XReceive(true) : XSend(true, true);
+        break;
+    default:
+        ok = receiving ? ZReceive() : ZSend();
+        break;
+    }
+
+    if (!ok) {
+        XferCloseOutput(false);
+        if (Xfer.cancelled) {
+            XferAbort();
+            fprintf(stderr, "Transfer cancelled.\n");
+        } else {
+            fprintf(stderr, "Transfer failed: %s.\n", (Xfer.error != NULL) ? Xfer.error : "timed out");
+        }
+    }
+    else {
+        fprintf(stderr, "Transfer complete.\n");
+    }
+
+    // Hand the rest of what we've read back to the session
+    ConsumeRx(port, Xfer.rx_taken);
+    Xfer.rx_taken = 0;
+    Xfer.rx_len = 0;
+    if (!receiving) {
+        UnmapFile(Xfer.file, Xfer.mapping, Xfer.view);
+        Xfer.view = NULL;
+    }
+    SetConsoleTitleA(ORIGINAL_TITLE);
+}
+
+//
+// Ask where to upload from or download to (upload/download hotkeys), then run the transfer.
+//
+void PromptTransfer(HANDLE stdin_h, Port * port, bool receiving) {
+    wchar_t path[MAX_PATH];
+    char prompt[64];
+    if (receiving) {
+        snprintf(prompt, sizeof(prompt), "Download (%s) to %s: ", ProtocolNames[Protocol],
+            (Protocol == XFER_YMODEM || Protocol == XFER_ZMODEM) ? "directory" : "file");
+    } else {
+        snprintf(prompt, sizeof(prompt), "Upload (%s) file: ", ProtocolNames[Protocol]);
+    }
+    if (!PromptLine(stdin_h, prompt, path, MAX_PATH)) {
+        if (!receiving || Protocol == XFER_XMODEM || Protocol == XFER_XMODEM_1K) {
+            return;
+        }
+        path[0] = 0;                            // The current directory
+    }
+    RunTransfer(stdin_h, port, receiving, path);
+}
+
+//
+// Received data waiting to be shown, over all the ports, not counting unfinished lines being held back.
+// Sets *held_due to when the first held line is to be shown anyway, or 0 if none is held.
+//
+DWORD RxPending(LONG64 * held_due) {
+    DWORD pending = 0;
+    *held_due = 0;
+    for (DWORD i = 0; i < PortCount; i++) {
+        Port * port = &Ports[i];
+        DWORD used = RingUsed(&port->rx);
+        pending += (used > port->held) ? used - port->held : 0;
+        if (port->held > 0 && (*held_due == 0 || port->held_due < *held_due)) {
+            *held_due = port->held_due;
+        }
+    }
+    return pending;
+}
+
+//
+// Write everything a port has passed us to stdout, straight from the ring. With several ports, lines are tagged
+// with their port instead (ShowLines()), and a hex dump gets a heading each time the port changes.
+//
+void ShowRx(HANDLE stdout_h, Port * port) {
+    if (PortCount > 1 && !HexDump) {
+        ShowLines(stdout_h, port);
+        return;
+    }
+    if (PortCount > 1 && LineOwner != port && RingUsed(&port->rx) > 0) {
+        WriteShown(stdout_h, port->tag, port->tag_len);
+        WriteShown(stdout_h, "\r\n", 2);
+        LineOwner = port;
+    }
+
+    char * rx_p;
+    DWORD bytes_read;
+    while ((bytes_read = RingReadable(&port->rx, &rx_p)) > 0) {
+        DWORD bytes_written = 0;
+        LONG64 write_start = Now();
+        if (HexDump) {
+            WriteHex(stdout_h, "RX", port->shown, rx_p, bytes_read);
+            bytes_written = bytes_read;
+        }
+        else if (WriteConsoleA(stdout_h, rx_p, bytes_read, &bytes_written, NULL) == 0) {
+            ExitWithError("WriteFile(stdout_h)", true);
+        }
+        ConsoleTicks += Now() - write_start;
+        ConsoleBytes += bytes_written;
+        ConsoleWrites++;
+
+        // Log and capture only what was shown. The rest is logged when it's shown, next time.
+        LogWrite(&SessionLog, rx_p, bytes_written);
+        CaptureRx(port, rx_p, bytes_written);
+        port->shown += bytes_written;
+        ConsumeRx(port, bytes_written);
+
+        // If the console took less than we offered, keep the rest in the ring and try again next time
+        if (bytes_written < bytes_read) {
+            ConsoleShortWrites++;
+            break;
+        }
+    }
+}
+
+//
+// Several ports: write what a port has passed us to stdout a line at a time, each line starting with the port's
+// tag, so lines from different ports never run together. An unfinished line is held back until the rest arrives,
+// unless it's from the port being typed to (so echoes and prompts show straight away), it has waited
+// PARTIAL_LINE_WAIT, or the ring is filling up. Another port's unfinished line on the console is broken off first.
+//
+void ShowLines(HANDLE stdout_h, Port * port) {
+    static char out[FLUSH_SIZE + PORT_TAG_SIZE + 2];
+    bool show_partial = (port == Target) || (port->held > 0 && MsUntil(port->held_due) == 0) || RingUsed(&port->rx) > port->rx.size / 2;
+    DWORD was_held = port->held;
+    port->held = 0;
+    char * p;
+    DWORD n;
+    while ((n = RingReadable(&port->rx, &p)) > 0) {
+        // Hold back an unfinished line at the end. Data that carries on at the start of the ring isn't the end.
+        DWORD len = n;
+        if (!show_partial && RingUsed(&port->rx) == n) {
+            while (len > 0 && p[len - 1] != '\n') {
+                len--;
+            }
+            if (len == 0) {
+                port->held = n;
+                break;
+            }
+        }
+
+        // Copy it out a line at a time, tagging the start of each line
+        DWORD out_len = 0;
+        for (DWORD i = 0; i < len; ) {
+            if (out_len >= FLUSH_SIZE) {
+                WriteShown(stdout_h, out, out_len);
+                out_len = 0;
+            }
+            if (LineOwner != port) {
+                if (LineOwner != NULL) {
+                    out[out_len++] = '\r';
+                    out[out_len++] = '\n';
+                }
+                memcpy(out + out_len, port->tag, port->tag_len);
+                out_len += port->tag_len;
+                LineOwner = port;
+            }
+            const char * nl = memchr(p + i, '\n', len - i);
+            DWORD line = (nl != NULL) ? (DWORD)(nl - (p + i)) + 1 : len - i;
+            line = min(line, (DWORD)sizeof(out) - out_len);
+            memcpy(out + out_len, p + i, line);
+            out_len += line;
+            i += line;
+            if (p[i - 1] == '\n') {
+                LineOwner = NULL;
+            }
+        }
+        WriteShown(stdout_h, out, out_len);
+        CaptureRx(port, p, len);
+        port->shown += len;
+        ConsumeRx(port, len);
+    }
+    if (port->held > 0 && was_held == 0) {
+        port->held_due = Now() + PARTIAL_LINE_WAIT * QpcFrequency / 1000;
+    }
+}
+
+//
+// Several ports: write tagged output to stdout, all of it, and log it as shown. The capture gets the raw data
+// instead, from the caller.
+//
+void WriteShown(HANDLE stdout_h, const char * buf, DWORD n) {
+    LogWrite(&SessionLog, buf, n);
+    LONG64 write_start = Now();
+    for (DWORD done = 0; done < n; ) {
+        DWORD bytes_written = 0;
+        if (WriteConsoleA(stdout_h, buf + done, n - done, &bytes_written, NULL) == 0) {
+            ExitWithError("WriteConsoleA(stdout_h)", true);
+        }
+        done += bytes_written;
+        ConsoleWrites++;
+        if (done < n) {
+            ConsoleShortWrites++;
+        }
+    }
+    ConsoleTicks += Now() - write_start;
+    ConsoleBytes += n;
+}
+
+//
+// Print the statistics gathered during the session.
+//
+void PrintStats() {
+    double secs = SecondsSince(StartTime);
+    fprintf(stderr, "Session: %.1f s, CPU %.1f%%.\n", secs, CpuSeconds() * 100.0 / secs);
+    fprintf(stderr, "Console: %lld bytes in %lld writes (%lld short), %.1f MB/s while writing, %lld typed bytes dropped.\n",
+        ConsoleBytes, ConsoleWrites, ConsoleShortWrites, ConsoleTicks ? ConsoleBytes / 1048576.0 / ((double)ConsoleTicks / QpcFrequency) : 0.0,
+        TxDropped);
+    fprintf(stderr, "Wakeups: console thread %.1f/s, RX thread %.1f/s.\n", ConsoleWakeups / secs, RxWakeups / secs);
+    for (DWORD i = 0; i < PortCount; i++) {
+        Port * port = &Ports[i];
+        fprintf(stderr, "%s rx: %lld bytes in %lld reads (%.1f reads per MB), %.1f KB/s average, %.1f KB/s peak.\n", port->name,
+            port->rx_bytes, port->rx_calls, port->rx_bytes ? port->rx_calls * 1048576.0 / port->rx_bytes : 0.0, port->rx_bytes / 1024.0 / secs,
+            port->peak_rx_rate / 1024.0);
+        fprintf(stderr, "%s tx: %lld bytes in %lld writes (%.1f writes per MB), %.1f KB/s average, %.1f KB/s peak, %lld timeouts.\n", port->name,
+            port->tx_bytes, port->tx_calls, port->tx_bytes ? port->tx_calls * 1048576.0 / port->tx_bytes : 0.0, port->tx_bytes / 1024.0 / secs, 
+            port->peak_tx_rate / 1024.0, port->tx_timeouts);
+        fprintf(stderr, "%s uart: %lld overruns, %lld buffer overflows, %lld framing errors, %lld parity errors, %lld breaks, "
+            "driver queue peak %u bytes.\n", port->name, port->overruns, port->rx_overflows, port->framing_errors, port->parity_errors,
+            port->breaks, port->peak_in_queue);
+        fprintf(stderr, "%s reconnects: %lld, longest outage %.2f s.\n", port->name, port->reconnects, port->max_outage);
+        fprintf(stderr, "%s spill: %lld bytes spilled, max lag %lld bytes, %lld stalls.\n", port->name,
+            port->spill.spilled, port->spill.max_lag, port->spill.stalls);
+        fprintf(stderr, "%s peak buffer use: rx %u of %u bytes, tx %u of %u bytes.\n", port->name,
+            (DWORD)port->rx.peak, (DWORD)port->rx.size, (DWORD)port->tx.peak, (DWORD)port->tx.size);
+    }
+}
+
+//
+// Count the UART errors since the last read, and note how much is waiting in the driver. Called by the RX thread
+// after each read; one call to the driver per read.
+//
+void UartErrors(Port * port) {
+    DWORD errors = 0;
+    COMSTAT cs = { 0 };
+    if (port->is_pipe || ClearCommError(port->h, &errors, &cs) == 0) {
+        return;
+    }
+    port->overruns += (errors & CE_OVERRUN) ? 1 : 0;
+    port->rx_overflows += (errors & CE_RXOVER) ? 1 : 0;
+    port->framing_errors += (errors & CE_FRAME) ? 1 : 0;
+    port->parity_errors += (errors & CE_RXPARITY) ? 1 : 0;
+    port->breaks += (errors & CE_BREAK) ? 1 : 0;
+    port->in_queue = cs.cbInQue;
+    port->peak_in_queue = max(port->peak_in_queue, cs.cbInQue);
+}
+
+//
+// Measure each port's throughput, if STATS_INTERVAL has passed since it was last measured. Console thread only.
+// Returns true if it was measured.
+//
+bool SampleStats() {
+    double secs = SecondsSince(StatsTime);
+    if (secs * 1000 < STATS_INTERVAL) {
+        return false;
+    }
+    StatsTime = Now();
+    for (DWORD i = 0; i < PortCount; i++) {
+        Port * port = &Ports[i];
+        LONG64 rx_bytes = port->rx_bytes;
+        LONG64 tx_bytes = port->tx_bytes;
+        port->rx_rate = (rx_bytes - port->rate_rx_bytes) / secs;
+        port->tx_rate = (tx_bytes - port->rate_tx_bytes) / secs;
+        port->peak_rx_rate = max(port->peak_rx_rate, port->rx_rate);
+        port->peak_tx_rate = max(port->peak_tx_rate, port->tx_rate);
+        port->rate_rx_bytes = rx_bytes;
+        port->rate_tx_bytes = tx_bytes;
+    }
+    return true;
+}
+
+//
+// Show the status line in the title bar (status hotkey): the throughput, queues and errors of the port typing goes to.
+//
+void ShowStatus() {
+    Port * port = Target;
+    char title[512];
+    snprintf(title, sizeof(title), "spconnect: %s rx %.1f KB/s (peak %.1f), tx %.1f KB/s (peak %.1f) | queued: driver %u, rx %u, tx %u, "
+        "spilled %lld | errors: %lld overrun, %lld overflow, %lld framing, %lld parity, %lld break, %lld tx timeout | "
+        "%lld short console writes", port->name, port->rx_rate / 1024.0, port->peak_rx_rate / 1024.0, port->tx_rate / 1024.0,
+        port->peak_tx_rate / 1024.0, port->in_queue, (DWORD)RingUsed(&port->rx), (DWORD)RingUsed(&port->tx),
+        port->spill.head - port->spill.tail, port->overruns, port->rx_overflows, port->framing_errors, port->parity_errors,
+        port->breaks, port->tx_timeouts, ConsoleShortWrites);
+    SetConsoleTitleA(title);
+}
+
+//
+// Format the statistics as one line of JSON, for --stats-file and Ctrl-Break. Returns its length.
+// The counters are read while the other threads carry on, so they may be a moment apart.
+//
+DWORD FormatStats(char * out, DWORD out_size) {
+    double secs = SecondsSince(StartTime);
+    int len = snprintf(out, out_size, "{\"time\":%.3f,\"cpu\":%.3f,\"console_bytes\":%lld,\"console_writes\":%lld,"
+        "\"console_short_writes\":%lld,\"typed_dropped\":%lld,\"console_wakeups\":%lld,\"rx_wakeups\":%lld,\"ports\":[", secs,
+        CpuSeconds(), ConsoleBytes, ConsoleWrites, ConsoleShortWrites, TxDropped, ConsoleWakeups, RxWakeups);
+    for (DWORD i = 0; i < PortCount && len < (int)out_size; i++) {
+        Port * port = &Ports[i];
+        char name[2 * MAX_PATH];                    // JSON string: escape the backslashes in a pipe name
+        DWORD n = 0;
+        for (const char * p = port->name; *p != 0 && n < sizeof(name) - 2; p++) {
+            if (*p == '\\' || *p == '"') {
+                name[n++] = '\\';
+            }
+            name[n++] = *p;
+        }
+        name[n] = 0;
+        len += snprintf(out + len, out_size - len, "%s{\"name\":\"%s\",\"rx_bytes\":%lld,\"rx_reads\":%lld,\"rx_rate\":%.0f,"
+            "\"rx_peak_rate\":%.0f,\"tx_bytes\":%lld,\"tx_writes\":%lld,\"tx_rate\":%.0f,\"tx_peak_rate\":%.0f,\"tx_timeouts\":%lld,"
+            "\"driver_queue\":%u,\"driver_queue_peak\":%u,\"rx_queue\":%u,\"rx_queue_peak\":%u,\"tx_queue\":%u,\"tx_queue_peak\":%u,"
+            "\"spilled\":%lld,\"overruns\":%lld,\"overflows\":%lld,\"framing_errors\":%lld,\"parity_errors\":%lld,\"breaks\":%lld,"
+            "\"reconnects\":%lld,\"max_outage\":%.3f}",
+            (i > 0) ? "," : "", name, port->rx_bytes, port->rx_calls, port->rx_rate, port->peak_rx_rate, port->tx_bytes, port->tx_calls,
+            port->tx_rate, port->peak_tx_rate, port->tx_timeouts, port->in_queue, port->peak_in_queue, (DWORD)RingUsed(&port->rx),
+            (DWORD)port->rx.peak, (DWORD)RingUsed(&port->tx), (DWORD)port->tx.peak, port->spill.spilled, port->overruns,
+            port->rx_overflows, port->framing_errors, port->parity_errors, port->breaks, port->reconnects, port->max_outage);
+    }
+    if (len < (int)out_size) {
+        len += snprintf(out + len, out_size - len, "]}\n");
+    }
+    return min((DWORD)len, out_size - 1);
+}
+
+//
+// Append the statistics to --stats-file as JSON, or print them if there isn't one.
+//
+void WriteStats() {
+    if (QpcFrequency == 0) {
+        return;                                     // Exiting before the session started
+    }
+    static char text[STATS_TEXT_SIZE];
+    DWORD len = FormatStats(text, STATS_TEXT_SIZE);
+    if (StatsFile == NULL) {
+        fputs(text, stderr);
+        return;
+    }
+    HANDLE f = CreateFileA(StatsFile, FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    DWORD written = 0;
+    if (f == INVALID_HANDLE_VALUE || WriteFile(f, text, len, &written, NULL) == 0) {
+        fprintf(stderr, "\nWARNING: Can't write statistics to %s (error %u).\n", StatsFile, GetLastError());
+    }
+    if (f != INVALID_HANDLE_VALUE) {
+        CloseHandle(f);
+    }
+}
+
+//
+// Ctrl-Break (from the keyboard, or GenerateConsoleCtrlEvent() from another program) writes the statistics, rather
+// than ending the session. Anything else is left to the default handler.
+//
+BOOL WINAPI StatsCtrlHandler(DWORD ctrl_type) {
+    if (ctrl_type != CTRL_BREAK_EVENT) {
+        return FALSE;
+    }
+    WriteStats();
+    return TRUE;
+}
+
+//
+// Loopback test (--loopback-test). Floods the port with a known pattern and checks that it all comes back, in order.
+// Needs the port's TX wired to its RX, or a peer that echoes everything back.
+// Exercises the same threads and rings as a terminal session. Exits when done.
+//
+void LoopbackTest(HANDLE stdin_h, Port * port, DWORD megabytes) {
+    LONG64 total = (LONG64)megabytes * 1048576;
+    LONG64 sent = 0;
+    LONG64 received = 0;
+    LONG64 mismatched = 0;
+    LONG64 first_mismatch = -1;
+    double cpu_start = CpuSeconds();
+    LONG64 start = Now();
+    fprintf(stderr, "Loopback test: sending %u MB.\n", megabytes);
+
+    HANDLE wait_h[3] = { port->rx.data_event, port->tx.space_event, stdin_h };
+    while (received < total) {
+        // Fill the TX ring with the pattern, in place
+        char * p;
+        DWORD len;
+        while (sent < total && (len = RingWritable(&port->tx, &p)) > 0) {
+            len = (DWORD)min(len, total - sent);
+            for (DWORD i = 0; i < len; i++) {
+                LONG64 pos = sent + i;
+                p[i] = (char)(pos ^ (pos >> 8) ^ (pos >> 16));
+            }
+            RingCommit(&port->tx, len);
+            sent += len;
+        }
+
+        // Check what has come back
+        while ((len = RingReadable(&port->rx, &p)) > 0) {
+            for (DWORD i = 0; i < len; i++) {
+                LONG64 pos = received + i;
+                if (p[i] != (char)(pos ^ (pos >> 8) ^ (pos >> 16))) {
+                    if (first_mismatch < 0) {
+                        first_mismatch = pos;
+                    }
+                    mismatched++;
+                }
+            }
+            received += len;
+            ConsumeRx(port, len);
+        }
+        if (received >= total) {
+            break;
+        }
+
+        // Wait for progress. Give up if nothing moves for a while. Ctrl-F10 still quits.
+        DWORD wait_result = WaitForMultipleObjects(3, wait_h, FALSE, LOOPBACK_TIMEOUT);
+        if (wait_result == WAIT_FAILED) {
+            ExitWithError("WaitForMultipleObjects", true);
+        }
+        if (wait_result == WAIT_TIMEOUT) {
+            fprintf(stderr, "Loopback test: nothing received for %u ms, giving up.\n", LOOPBACK_TIMEOUT);
+            break;
+        }
+        if (wait_result == WAIT_OBJECT_0 + 2) {
+            char discard[BUF_SIZE];
+            ReadStdin(stdin_h, discard, BUF_SIZE);
+        }
+    }
+
+    double secs = SecondsSince(start);
+    fprintf(stderr, "Loopback test: sent %lld, received %lld, missing %lld, mismatched %lld bytes.\n",
+        sent, received, max(sent - received, 0), mismatched);
+    if (first_mismatch >= 0) {
+        fprintf(stderr, "Loopback test: first mismatch at offset %lld.\n", first_mismatch);
+    }
+    fprintf(stderr, "Loopback test: %.3f MB/s over %.2f s, CPU %.1f%%.\n",
+        received / 1048576.0 / secs, secs, (CpuSeconds() - cpu_start) * 100.0 / secs);
+    if (ShowStats) {
+        PrintStats();
+    }
+    RestoreConsole();
+    exit((received == total && mismatched == 0) ? 0 : 1);
+}
+
+//
+// Round-trip test (--rtt-test). Sends small probes one at a time, and times each one's way back, to show what
+// --low-latency buys: run it with and without. Needs the port's TX wired to its RX, or a peer that echoes.
+// Goes through the same threads and rings as a terminal session, so it's the round trip a user sees. Exits when done.
+//
+void RttTest(HANDLE stdin_h, Port * port, DWORD count) {
+    Histogram rtt = { 0 };
+    DWORD lost = 0;
+    fprintf(stderr, "Round-trip test: %u probes of %u bytes.\n", count, RTT_PROBE);
+
+    HANDLE wait_h[2] = { port->rx.data_event, stdin_h };
+    for (DWORD n = 0; n < count; n++) {
+        // Send a probe. It may wrap around the end of the TX ring.
+        char * p;
+        LONG64 start = Now();
+        for (DWORD sent = 0; sent < RTT_PROBE; ) {
+            DWORD len = min(RingWritable(&port->tx, &p), RTT_PROBE - sent);
+            for (DWORD i = 0; i < len; i++) {
+                p[i] = (char)(n + sent + i);
+            }
+            RingCommit(&port->tx, len);
+            sent += len;
+        }
+
+        // Wait for it to come back. Ctrl-F10 still quits.
+        DWORD received = 0;
+        while (received < RTT_PROBE) {
+            DWORD len;
+            while ((len = RingReadable(&port->rx, &p)) > 0) {
+                received += len;
+                ConsumeRx(port, len);
+            }
+            if (received >= RTT_PROBE) {
+                HistRecord(&rtt, (Now() - start) * 1000000 / QpcFrequency);
+                break;
+            }
+            LONG64 waited = (Now() - start) * 1000 / QpcFrequency;
+            if (waited >= RTT_TIMEOUT) {
+                lost++;
+                break;
+            }
+            DWORD wait_result = WaitForMultipleObjects(2, wait_h, FALSE, (DWORD)(RTT_TIMEOUT - waited));
+            if (wait_result == WAIT_FAILED) {
+                ExitWithError("WaitForMultipleObjects", true);
+            }
+            if (wait_result == WAIT_OBJECT_0 + 1) {
+                char discard[BUF_SIZE];
+                ReadStdin(stdin_h, discard, BUF_SIZE);
+            }
+        }
+    }
+
+    PrintHist("round trip", &rtt);
+    fprintf(stderr, "Round-trip test: %u of %u probes lost.%s\n", lost, count, LowLatency ? "" : " Try again with --low-latency.");
+    if (ShowStats) {
+        PrintStats();
+    }
+    RestoreConsole();
+    exit((lost == 0) ? 0 : 1);
+}
+
+//
+// Transfer test: make the two ports the two ends of a named pipe, already open, so they're set up like any other port.
+//
+void TransferTestPorts() {
+    static char name[64];
+    snprintf(name, sizeof(name), "\\\\.\\pipe\\spconnect-transfer-test-%u", GetCurrentProcessId());
+    HANDLE server = CreateNamedPipeA(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED, PIPE_TYPE_BYTE | PIPE_WAIT, 1, PIPE_BUF_SIZE, PIPE_BUF_SIZE, 0, NULL);
+    if (server == INVALID_HANDLE_VALUE) {
+        ExitWithError("CreateNamedPipeA(transfer test)", true);
+    }
+    HANDLE client = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    OVERLAPPED ov = { 0 };
+    if (client == INVALID_HANDLE_VALUE || (ConnectNamedPipe(server, &ov) == 0 && GetLastError() != ERROR_PIPE_CONNECTED)) {
+        ExitWithError("Connecting the transfer test pipe,", true);
+    }
+    for (DWORD i = 0; i < 2; i++) {
+        Ports[i].name = name;
+        Ports[i].h = (i == 0) ? client : server;
+        Ports[i].is_pipe = true;
+        Ports[i].line.baud = 0;
+    }
+    PortCount = 2;
+    Target = &Ports[0];
+}
+
+//
+// Transfer test: write a file of the loopback test pattern.
+//
+void TransferTestFile(const wchar_t * path, LONG64 size) {
+    static char buf[BUF_SIZE];
+    HANDLE f = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (f == INVALID_HANDLE_VALUE) {
+        ExitWithError("CreateFileW(transfer test)", true);
+    }
+    for (LONG64 done = 0; done < size; done += BUF_SIZE) {
+        DWORD n = (DWORD)min(BUF_SIZE, size - done);
+        for (DWORD i = 0; i < n; i++) {
+            LONG64 pos = done + i;
+            buf[i] = (char)(pos ^ (pos >> 8) ^ (pos >> 16));
+        }
+        DWORD written = 0;
+        if (WriteFile(f, buf, n, &written, NULL) == 0 || written != n) {
+            ExitWithError("WriteFile(transfer test)", true);
+        }
+    }
+    CloseHandle(f);
+}
+
+//
+// Transfer test: check that the received file matches the one sent. XMODEM can't say how long the file is, so when
+// padded, the received file may also have the padding of the last block on the end.
+//
+bool TransferTestCheck(const wchar_t * sent, const wchar_t * received, bool padded) {
+    HANDLE sent_file, sent_mapping, received_file, received_mapping;
+    char * sent_view;
+    char * received_view;
+    LONG64 sent_size, received_size;
+    if (!MapFileRead(sent, &sent_file, &sent_mapping, &sent_view, &sent_size)) {
+        ExitWithError("MapFileRead(transfer test)", true);
+    }
+    if (!MapFileRead(received, &received_file, &received_mapping, &received_view, &received_size)) {
+        UnmapFile(sent_file, sent_mapping, sent_view);
+        fprintf(stderr, "Transfer test: nothing was received.\n");
+        return false;
+    }
+    bool ok = (received_size == sent_size || (padded && received_size > sent_size && received_size - sent_size < 1024))
+        && (sent_size == 0 || memcmp(sent_view, received_view, (size_t)sent_size) == 0);
+    for (LONG64 i = sent_size; ok && i < received_size; i++) {
+        ok = (received_view[i] == CPMEOF);
+    }
+    if (!ok) {
+        fprintf(stderr, "Transfer test: received %lld bytes for %lld sent, and they don't match.\n", received_size, sent_size);
+    }
+    UnmapFile(sent_file, sent_mapping, sent_view);
+    UnmapFile(received_file, received_mapping, received_view);
+    return ok;
+}
+
+//
+// Transfer test: the receiving end, on Ports[1].
+//
+DWORD WINAPI TransferTestReceive(LPVOID param) {
+    TransferTestSide * side = (TransferTestSide *)param;
+    RunTransfer(side->never, &Ports[1], true, side->path);
+    side->start_pos = Xfer.start_pos;
+    return 0;
+}
+
+//
+// Transfer test (--transfer-test). Sends a file with each protocol from one end of a named pipe to the other (see
+// TransferTestPorts()), through the same threads and rings as a session, and checks what arrives. The file is a few
+// bytes over a whole number of MB, so the last block is a short one. The receiving end runs on a thread of its own,
+// which is why the transfer state is per thread. ZMODEM runs twice, the second time with the first half of the file
+// already received, to test resuming. Esc cancels a run. Exits when done.
+//
+void TransferTest(HANDLE stdin_h, DWORD megabytes) {
+    LONG64 size = (LONG64)megabytes * 1048576 + 1000;
+    wchar_t temp[MAX_PATH];
+    wchar_t dir[MAX_PATH];
+    wchar_t received_dir[MAX_PATH];
+    wchar_t sent[MAX_PATH];
+    wchar_t received[MAX_PATH];
+    if (GetTempPathW(MAX_PATH, temp) == 0) {
+        ExitWithError("GetTempPathW", true);
+    }
+    swprintf(dir, MAX_PATH, L"%lsspconnect-transfer-test-%u", temp, GetCurrentProcessId());
+    swprintf(received_dir, MAX_PATH, L"%ls\\received", dir);
+    swprintf(sent, MAX_PATH, L"%ls\\test.bin", dir);
+    swprintf(received, MAX_PATH, L"%ls\\test.bin", received_dir);
+    if (CreateDirectoryW(dir, NULL) == 0 || CreateDirectoryW(received_dir, NULL) == 0) {
+        ExitWithError("CreateDirectoryW(transfer test)", true);
+    }
+    TransferTestFile(sent, size);
+    TransferTestSide side = { 0 };
+    side.never = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (side.never == NULL) {
+        ExitWithError("CreateEvent(transfer test)", true);
+    }
+    CrcInit();
+
+    // Each protocol in turn, then ZMODEM again, resuming
+    DWORD failed = 0;
+    for (int run = 0; run <= XFER_PROTOCOLS; run++) {
+        Protocol = min(run, XFER_ZMODEM);
+        Resume = (run == XFER_PROTOCOLS);
+        bool xmodem = (Protocol == XFER_XMODEM || Protocol == XFER_XMODEM_1K);
+        fprintf(stderr, "\nTransfer test: %lld bytes with %s%s.", size, ProtocolNames[Protocol], Resume ? ", resuming half way" : "");
+        DeleteFileW(received);
+        if (Resume) {
+            TransferTestFile(received, size / 2);
+        }
+        side.path = xmodem ? received : received_dir;
+        side.start_pos = 0;
+        HANDLE thread = CreateThread(NULL, 0, TransferTestReceive, &side, 0, NULL);
+        if (thread == NULL) {
+            ExitWithError("CreateThread(transfer test)", true);
+        }
+        RunTransfer(stdin_h, &Ports[0], false, sent);
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+
+        bool ok = TransferTestCheck(sent, received, xmodem);
+        if (ok && Resume && side.start_pos != size / 2) {
+            fprintf(stderr, "Transfer test: resumed at %lld, not %lld.\n", side.start_pos, size / 2);
+            ok = false;
+        }
+        failed += !ok;
+        fprintf(stderr, "Transfer test: %s %s.\n", ProtocolNames[Protocol], ok ? "passed" : "FAILED");
+
+        // Throw away anything left over (e.g. the ZMODEM sender's "OO"), so it doesn't confuse the next run
+        Sleep(XFER_PURGE);
+        for (DWORD i = 0; i < 2; i++) {
+            char * p;
+            DWORD len;
+            while ((len = RingReadable(&Ports[i].rx, &p)) > 0) {
+                ConsumeRx(&Ports[i], len);
+            }
+        }
+    }
+
+    DeleteFileW(received);
+    DeleteFileW(sent);
+    RemoveDirectoryW(received_dir);
+    RemoveDirectoryW(dir);
+    fprintf(stderr, "\nTransfer test: %u of %u runs failed.\n", failed, XFER_PROTOCOLS + 1);
+    if (ShowStats) {
+        PrintStats();
+    }
+    RestoreConsole();
+    exit((failed == 0) ? 0 : 1);
+}
+
+//
+// Reconnect test: create an instance of the stand-in device's pipe.
+//
+HANDLE ReconnectTestPipe(const char * name) {
+    HANDLE h = CreateNamedPipeA(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED, PIPE_TYPE_BYTE | PIPE_WAIT, PIPE_UNLIMITED_INSTANCES,
+        PIPE_BUF_SIZE, PIPE_BUF_SIZE, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        ExitWithError("CreateNamedPipeA(reconnect test)", true);
+    }
+    return h;
+}
+
+//
+// Reconnect test: the port is the client end of the stand-in device's pipe, opened (and reopened) by name like any
+// other port. The first pipe instance is created here, so it's there to be opened.
+//
+void ReconnectTestPorts() {
+    static char name[64];
+    snprintf(name, sizeof(name), "\\\\.\\pipe\\spconnect-reconnect-test-%u", GetCurrentProcessId());
+    TestDevice.h = ReconnectTestPipe(name);
+    TestDevice.unplug = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (TestDevice.unplug == NULL) {
+        ExitWithError("CreateEvent(reconnect test)", true);
+    }
+    Ports[0].name = name;
+    Ports[0].line.baud = 0;
+    PortCount = 1;
+    Target = &Ports[0];
+    HANDLE thread = CreateThread(NULL, 0, ReconnectTestDevice, name, 0, NULL);
+    if (thread == NULL) {
+        ExitWithError("CreateThread(reconnect test)", true);
+    }
+    CloseHandle(thread);
+}
+
+//
+// Reconnect test: the stand-in device. Waits for the port to connect, echoes until unplugged, then goes away for
+// RECONNECT_TEST_OUTAGE and comes back.
+//
+DWORD WINAPI ReconnectTestDevice(LPVOID param) {
+    static char buf[PIPE_BUF_SIZE];
+    const char * name = (const char *)param;
+    OVERLAPPED ov = { 0 };
+    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (ov.hEvent == NULL) {
+        ExitWithError("CreateEvent(reconnect test device)", true);
+    }
+    while (1) {
+        DWORD n = 0;
+        if (ConnectNamedPipe(TestDevice.h, &ov) == 0 && GetLastError() != ERROR_PIPE_CONNECTED
+            && (GetLastError() != ERROR_IO_PENDING || GetOverlappedResult(TestDevice.h, &ov, &n, TRUE) == 0)) {
+            ExitWithError("ConnectNamedPipe(reconnect test device)", true);
+        }
+
+        // Echo, until unplugged or the port closes its end
+        while (1) {
+            if (ReadFile(TestDevice.h, buf, PIPE_BUF_SIZE, NULL, &ov) == 0 && GetLastError() != ERROR_IO_PENDING) {
+                break;
+            }
+            HANDLE wait_h[2] = { ov.hEvent, TestDevice.unplug };
+            if (WaitForMultipleObjects(2, wait_h, FALSE, INFINITE) != WAIT_OBJECT_0) {
+                CancelIoEx(TestDevice.h, &ov);
+                GetOverlappedResult(TestDevice.h, &ov, &n, TRUE);
+                break;
+            }
+            if (GetOverlappedResult(TestDevice.h, &ov, &n, FALSE) == 0) {
+                break;
+            }
+            DWORD written = 0;
+            if (WriteFile(TestDevice.h, buf, n, NULL, &ov) == 0
+                && (GetLastError() != ERROR_IO_PENDING || GetOverlappedResult(TestDevice.h, &ov, &written, TRUE) == 0)) {
+                break;
+            }
+        }
+
+        // Unplugged. Come back after a while, as a new pipe instance.
+        DisconnectNamedPipe(TestDevice.h);
+        CloseHandle(TestDevice.h);
+        Sleep(RECONNECT_TEST_OUTAGE);
+        TestDevice.h = ReconnectTestPipe(name);
+    }
+    return 0;
+}
+
+//
+// Reconnect test: queue a block of the loopback test pattern for the port, and check that it all comes back from the
+// device, in order. The port may be gone when it's queued: it's sent once the port is reopened.
+// Returns false if nothing comes back for the longest wait between tries at reopening, plus LOOPBACK_TIMEOUT.
+//
+bool ReconnectTestEcho(HANDLE stdin_h, Port * port, LONG64 * sent, LONG64 * received, LONG64 * mismatched) {
+    LONG64 total = *sent + RECONNECT_TEST_BLOCK;
+    char * p;
+    DWORD len;
+    while (*sent < total) {
+        while ((len = RingWritable(&port->tx, &p)) == 0) {
+            WaitForSingleObject(port->tx.space_event, LOOPBACK_TIMEOUT);
+        }
+        len = (DWORD)min(len, total - *sent);
+        for (DWORD i = 0; i < len; i++) {
+            LONG64 pos = *sent + i;
+            p[i] = (char)(pos ^ (pos >> 8) ^ (pos >> 16));
+        }
+        RingCommit(&port->tx, len);
+        *sent += len;
+    }
+
+    HANDLE wait_h[2] = { port->rx.data_event, stdin_h };
+    while (*received < total) {
+        while ((len = RingReadable(&port->rx, &p)) > 0) {
+            for (DWORD i = 0; i < len; i++) {
+                LONG64 pos = *received + i;
+                *mismatched += (p[i] != (char)(pos ^ (pos >> 8) ^ (pos >> 16)));
+            }
+            *received += len;
+            ConsumeRx(port, len);
+        }
+        if (*received >= total) {
+            break;
+        }
+        DWORD wait_result = WaitForMultipleObjects(2, wait_h, FALSE, RECONNECT_MAX + LOOPBACK_TIMEOUT);
+        if (wait_result == WAIT_FAILED) {
+            ExitWithError("WaitForMultipleObjects", true);
+        }
+        if (wait_result == WAIT_TIMEOUT) {
+            fprintf(stderr, "Reconnect test: nothing received for %u ms, giving up.\n", RECONNECT_MAX + LOOPBACK_TIMEOUT);
+            return false;
+        }
+        if (wait_result == WAIT_OBJECT_0 + 1) {
+            char discard[BUF_SIZE];
+            ReadStdin(stdin_h, discard, BUF_SIZE);
+        }
+    }
+    return true;
+}
+
+//
+// Reconnect test (--reconnect-test). Unplugs a stand-in device (see ReconnectTestDevice()) count times. Each time,
+// once the port has noticed, it queues data for the port, and checks that it gets through once the port has been
+// reopened. Then it checks the reconnect count and outage time the port reports: the outage can't be much shorter
+// than the time the device was gone, nor longer than the time from unplugging it to the data coming back.
+// Exercises the same threads and rings as a terminal session. Exits when done.
+//
+void ReconnectTest(HANDLE stdin_h, Port * port, DWORD count) {
+    LONG64 sent = 0;
+    LONG64 received = 0;
+    LONG64 mismatched = 0;
+    double longest = 0;
+    fprintf(stderr, "Reconnect test: %u outages of %u ms.\n", count, RECONNECT_TEST_OUTAGE);
+
+    // Check the device is there, then unplug it and queue data while it's gone
+    bool ok = ReconnectTestEcho(stdin_h, port, &sent, &received, &mismatched);
+    for (DWORD i = 0; i < count && ok; i++) {
+        LONG64 unplugged = Now();
+        SetEvent(TestDevice.unplug);
+        while (ReadAcquire(&port->lost) == 0 && SecondsSince(unplugged) * 1000 < LOOPBACK_TIMEOUT) {
+            Sleep(RECONNECT_MIN / 10);
+        }
+        if (ReadAcquire(&port->lost) == 0) {
+            fprintf(stderr, "Reconnect test: the port didn't notice the device going away.\n");
+            ok = false;
+            break;
+        }
+        ok = ReconnectTestEcho(stdin_h, port, &sent, &received, &mismatched);
+        longest = max(longest, SecondsSince(unplugged));
+    }
+
+    fprintf(stderr, "Reconnect test: sent %lld, received %lld, missing %lld, mismatched %lld bytes.\n",
+        sent, received, max(sent - received, 0), mismatched);
+    fprintf(stderr, "Reconnect test: %lld reconnects, longest outage %.2f s, longest wait for the data %.2f s.\n",
+        port->reconnects, port->max_outage, longest);
+    if (ok && port->reconnects != count) {
+        fprintf(stderr, "Reconnect test: expected %u reconnects.\n", count);
+        ok = false;
+    }
+    if (ok && count > 0 && (port->max_outage < (RECONNECT_TEST_OUTAGE - RECONNECT_MIN) / 1000.0 || port->max_outage > longest)) {
+        fprintf(stderr, "Reconnect test: the outage time isn't plausible.\n");
+        ok = false;
+    }
+    ok = ok && received == sent && mismatched == 0;
+    fprintf(stderr, "Reconnect test: %s.\n", ok ? "passed" : "FAILED");
+    if (ShowStats) {
+        PrintStats();
+    }
+    RestoreConsole();
+    exit(ok ? 0 : 1);
+}
+
+//
+// Daemon mode: the current time in timer wheel ticks (WHEEL_TICK ms each) since the start.
+//
+LONG64 WheelNow() {
+    return (Now() - StartTime) * 1000 / QpcFrequency / WHEEL_TICK;
+}
+
+//
+// Daemon mode: set a port's timer for the given tick, or clear it (0). A tick that has already passed is taken as
+// the next one. O(1): the port is unlinked from its old slot and put at the head of the new one.
+//
+void TimerSet(DaemonPort * dp, LONG64 tick) {
+    Worker * w = dp->worker;
+    if (dp->timer_tick != 0) {
+        if (dp->timer_prev != NULL) {
+            dp->timer_prev->timer_next = dp->timer_next;
+        } else {
+            w->wheel[dp->timer_tick % WHEEL_SLOTS] = dp->timer_next;
+        }
+        if (dp->timer_next != NULL) {
+            dp->timer_next->timer_prev = dp->timer_prev;
+        }
+    }
+    dp->timer_tick = (tick == 0) ? 0 : max(tick, w->tick + 1);
+    if (dp->timer_tick == 0) {
+        return;
+    }
+    DaemonPort ** slot = &w->wheel[dp->timer_tick % WHEEL_SLOTS];
+    dp->timer_prev = NULL;
+    dp->timer_next = *slot;
+    if (*slot != NULL) {
+        (*slot)->timer_prev = dp;
+    }
+    *slot = dp;
+}
+
+//
+// Daemon mode: run the timers that have come due since the wheel last moved on. Timers more than one turn of the
+// wheel away stay in their slot until their turn comes round.
+//
+void TimerRun(Worker * w) {
+    LONG64 now = WheelNow();
+    if (now - w->tick > WHEEL_SLOTS) {
+        w->tick = now - WHEEL_SLOTS;            // Every slot gets looked at once, however long it has been
+    }
+    while (w->tick < now) {
+        w->tick++;
+        DaemonPort * dp = w->wheel[w->tick % WHEEL_SLOTS];
+        while (dp != NULL) {
+            DaemonPort * next = dp->timer_next;
+            if (dp->timer_tick <= w->tick) {
+                TimerSet(dp, 0);
+                DaemonTimer(dp);
+            }
+            dp = next;
+        }
+    }
+}
+
+//
+// Daemon mode: set the port's timer for whichever comes first of the partial block flush, the silence check,
+// and the next attempt to reopen the port.
+//
+void DaemonSchedule(DaemonPort * dp) {
+    LONG64 due = 0;
+    if (dp->fill_len > 0 && !dp->writing) {
+        due = dp->flush_tick;
+    }
+    if (dp->connected && SilenceTime > 0 && !dp->silent) {
+        LONG64 silence_tick = dp->last_rx_tick + (LONG64)SilenceTime * 1000 / WHEEL_TICK;
+        due = (due == 0) ? silence_tick : min(due, silence_tick);
+    }
+    if (!dp->connected && !dp->dropping) {
+        due = (due == 0) ? dp->reconnect_tick : min(due, dp->reconnect_tick);
+    }
+    TimerSet(dp, due);
+}
+
+//
+// Daemon mode: the port's timer has gone off. Do whatever is due.
+//
+void DaemonTimer(DaemonPort * dp) {
+    LONG64 now = dp->worker->tick;
+    if (dp->fill_len > 0 && !dp->writing && now >= dp->flush_tick) {
+        DaemonWrite(dp);
+    }
+    if (dp->connected && SilenceTime > 0 && !dp->silent && now >= dp->last_rx_tick + (LONG64)SilenceTime * 1000 / WHEEL_TICK) {
+        dp->silent = true;
+        DaemonNote(dp, "silent", 0);
+    }
+    if (!dp->connected && !dp->dropping && now >= dp->reconnect_tick) {
+        DaemonConnect(dp);
+    }
+    DaemonSchedule(dp);
+}
+
+//
+// Daemon mode: add a note to the port's log, e.g. "--- spconnect 2024-05-01 12:00:00: com3 disconnected (error 22) ---".
+// Dropped if the block is full and can't be written yet.
+//
+void DaemonNote(DaemonPort * dp, const char * note, DWORD error) {
+    SYSTEMTIME t;
+    GetLocalTime(&t);
+    char text[MAX_PATH + 96];
+    int len = snprintf(text, sizeof(text), "\r\n--- spconnect %04u-%02u-%02u %02u:%02u:%02u: %s %s",
+        t.wYear, t.wMonth, t.wDay, t.wHour, t.wMinute, t.wSecond, dp->port->name, note);
+    if (error != 0) {
+        len += snprintf(text + len, sizeof(text) - len, " (error %u)", error);
+    }
+    len += snprintf(text + len, sizeof(text) - len, " ---\r\n");
+    if ((DWORD)len > DAEMON_BLOCK - dp->fill_len) {
+        if (dp->writing) {
+            return;
+        }
+        DaemonWrite(dp);
+    }
+    if (dp->fill_len == 0) {
+        dp->flush_tick = dp->worker->tick + DAEMON_FLUSH / WHEEL_TICK;
+    }
+    memcpy(dp->block[dp->fill] + dp->fill_len, text, len);
+    dp->fill_len += len;
+}
+
+//
+// Daemon mode: start a new log segment for the port, e.g. "com3-20240501-120000.log" in the daemon directory.
+// A segment started in the same second as an existing one is added to.
+//
+void DaemonOpenSegment(DaemonPort * dp) {
+    const char * label = strrchr(dp->port->name, '\\');
+    label = (label != NULL) ? label + 1 : dp->port->name;
+    SYSTEMTIME t;
+    GetLocalTime(&t);
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s\\%s-%04u%02u%02u-%02u%02u%02u.log", DaemonDir, label,
+        t.wYear, t.wMonth, t.wDay, t.wHour, t.wMinute, t.wSecond);
+    if (dp->log != NULL) {
+        CloseHandle(dp->log);
+    }
+    dp->log = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+    if (dp->log == INVALID_HANDLE_VALUE) {
+        ExitWithError("CreateFileA(log segment)", true);
+    }
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(dp->log, &size) == 0) {
+        ExitWithError("GetFileSizeEx(log segment)", true);
+    }
+    dp->log_pos = size.QuadPart;
+    if (CreateIoCompletionPort(dp->log, dp->worker->iocp, (ULONG_PTR)dp, 0) == NULL) {
+        ExitWithError("CreateIoCompletionPort(log segment)", true);
+    }
+}
+
+//
+// Daemon mode: start writing the filling block to the end of the log segment, and start filling the other one.
+// The caller checks that no write is in progress.
+//
+void DaemonWrite(DaemonPort * dp) {
+    if (dp->fill_len == 0) {
+        return;
+    }
+    memset(&dp->write_ov, 0, sizeof(dp->write_ov));
+    dp->write_ov.Offset = (DWORD)dp->log_pos;
+    dp->write_ov.OffsetHigh = (DWORD)(dp->log_pos >> 32);
+    if (WriteFile(dp->log, dp->block[dp->fill], dp->fill_len, NULL, &dp->write_ov) == 0 && GetLastError() != ERROR_IO_PENDING) {
+        ExitWithError("WriteFile(log segment)", true);
+    }
+    dp->writing = true;
+    dp->fill ^= 1;
+    dp->fill_len = 0;
+}
+
+//
+// Daemon mode: a block has been written. Move on to a new segment if this one is full, and pick up any reads that
+// were waiting for space.
+//
+void DaemonWritten(DaemonPort * dp, DWORD bytes, DWORD error) {
+    if (error != 0) {
+        SetLastError(error);
+        ExitWithError("WriteFile(log segment)", true);
+    }
+    dp->writing = false;
+    dp->log_pos += bytes;
+    dp->logged += bytes;
+    if (dp->log_pos >= (LONG64)SegmentSize * 1048576) {
+        DaemonOpenSegment(dp);
+    }
+    DaemonTakeReads(dp);
+    if (dp->fill_len > DAEMON_BLOCK - BUF_SIZE && !dp->writing) {
+        DaemonWrite(dp);
+    }
+    DaemonSchedule(dp);
+}
+
+//
+// Daemon mode: open the port and start reading it. If it can't be opened, try again in DAEMON_RECONNECT.
+//
+void DaemonConnect(DaemonPort * dp) {
+    Port * port = dp->port;
+    if (!OpenPort(port) || CreateIoCompletionPort(port->h, dp->worker->iocp, (ULONG_PTR)dp, 0) == NULL) {
+        DWORD error = GetLastError();
+        if (port->h != INVALID_HANDLE_VALUE) {
+            CloseHandle(port->h);
+            port->h = INVALID_HANDLE_VALUE;
+        }
+        if (error != dp->open_error) {
+            dp->open_error = error;
+            DaemonNote(dp, "can't be opened", error);
+        }
+        dp->reconnect_tick = dp->worker->tick + DAEMON_RECONNECT / WHEEL_TICK;
+        return;
+    }
+    dp->open_error = 0;
+    dp->connected = true;
+    dp->silent = false;
+    dp->last_rx_tick = dp->worker->tick;
+    port->rx_next = 0;
+    DaemonNote(dp, "connected", 0);
+    for (DWORD i = 0; i < RX_READS; i++) {
+        port->rx_done[i] = false;
+        if (!DaemonArm(dp, i)) {
+            DaemonDrop(dp, GetLastError());
+            return;
+        }
+    }
+}
+
+//
+// Daemon mode: start read i on the port. Returns false if the port has failed.
+//
+bool DaemonArm(DaemonPort * dp, DWORD i) {
+    Port * port = dp->port;
+    if (ReadFile(port->h, port->rx_buf + i * BUF_SIZE, BUF_SIZE, NULL, &port->rx_ov[i]) == 0 && GetLastError() != ERROR_IO_PENDING) {
+        return false;
+    }
+    dp->reads_pending++;
+    return true;
+}
+
+//
+// Daemon mode: the port has failed (e.g. a USB adapter was unplugged). Cancel its reads, and close it once they
+// have all completed.
+//
+void DaemonDrop(DaemonPort * dp, DWORD error) {
+    dp->connected = false;
+    dp->dropping = true;
+    dp->drop_error = error;
+    CancelIoEx(dp->port->h, NULL);
+    if (dp->reads_pending == 0) {
+        DaemonClosed(dp);
+    }
+}
+
+//
+// Daemon mode: all of a failed port's reads have completed. Close it, and try to reopen it in DAEMON_RECONNECT.
+//
+void DaemonClosed(DaemonPort * dp) {
+    CloseHandle(dp->port->h);
+    dp->dropping = false;
+    dp->disconnects++;
+    DaemonNote(dp, "disconnected", dp->drop_error);
+    dp->reconnect_tick = dp->worker->tick + DAEMON_RECONNECT / WHEEL_TICK;
+    DaemonSchedule(dp);
+}
+
+//
+// Daemon mode: a read on the port has completed.
+//
+void DaemonReadDone(DaemonPort * dp, OVERLAPPED * ov, DWORD bytes, DWORD error) {
+    Port * port = dp->port;
+    DWORD i = (DWORD)(ov - port->rx_ov);
+    dp->reads_pending--;
+    port->rx_done[i] = true;
+    dp->rx_len[i] = bytes;
+    dp->rx_error[i] = error;
+    if (dp->dropping) {
+        if (dp->reads_pending == 0) {
+            DaemonClosed(dp);
+        }
+        return;
+    }
+    DaemonTakeReads(dp);
+}
+
+//
+// Daemon mode: copy the port's completed reads into the filling block, in the order they were issued, re-arming
+// each. When the block is nearly full it is written. If the other block is still being written, the reads wait
+// (unarmed) until it's done, so a slow disk holds the data back in the driver rather than losing it.
+//
+void DaemonTakeReads(DaemonPort * dp) {
+    Port * port = dp->port;
+    while (dp->connected && port->rx_done[port->rx_next]) {
+        DWORD cur = port->rx_next;
+        if (dp->rx_error[cur] != 0) {
+            DaemonDrop(dp, dp->rx_error[cur]);
+            return;
+        }
+        DWORD n = dp->rx_len[cur];
+        if (n > DAEMON_BLOCK - dp->fill_len) {
+            if (dp->writing) {
+                return;
+            }
+            DaemonWrite(dp);
+        }
+        if (n > 0) {
+            if (dp->fill_len == 0) {
+                dp->flush_tick = dp->worker->tick + DAEMON_FLUSH / WHEEL_TICK;
+                if (dp->timer_tick == 0 || dp->flush_tick < dp->timer_tick) {
+                    TimerSet(dp, dp->flush_tick);
+                }
+            }
+            memcpy(dp->block[dp->fill] + dp->fill_len, port->rx_buf + cur * BUF_SIZE, n);
+            dp->fill_len += n;
+            dp->last_rx_tick = dp->worker->tick;
+            if (dp->silent) {
+                dp->silent = false;
+                DaemonSchedule(dp);
+            }
+        }
+        port->rx_bytes += n;
+        port->rx_calls++;
+        port->rx_done[cur] = false;
+        port->rx_next = (cur + 1) % RX_READS;
+        if (!DaemonArm(dp, cur)) {
+            DaemonDrop(dp, GetLastError());
+            return;
+        }
+    }
+    if (dp->fill_len > DAEMON_BLOCK - BUF_SIZE && !dp->writing) {
+        DaemonWrite(dp);
+    }
+}
+
+//
+// Daemon mode worker thread. Runs the event loop for its share of the ports: read and write completions from its
+// completion port, and its timer wheel. A completion with no OVERLAPPED tells it to stop: it finishes writing
+// every port's log, and returns.
+//
+DWORD WINAPI DaemonWorkerThread(LPVOID param) {
+    Worker * w = (Worker *)param;
+    while (1) {
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED * ov = NULL;
+        DWORD timeout = MsUntil(StartTime + (w->tick + 1) * WHEEL_TICK * QpcFrequency / 1000);
+        DWORD error = 0;
+        if (GetQueuedCompletionStatus(w->iocp, &bytes, &key, &ov, timeout) == 0) {
+            error = GetLastError();
+            if (ov == NULL && error != WAIT_TIMEOUT) {
+                ExitWithError("GetQueuedCompletionStatus(worker)", true);
+            }
+        }
+        if (ov == NULL && key != 0) {
+            break;
+        }
+        if (ov != NULL) {
+            DaemonPort * dp = (DaemonPort *)key;
+            if (ov == &dp->write_ov) {
+                DaemonWritten(dp, bytes, error);
+            } else {
+                DaemonReadDone(dp, ov, bytes, error);
+            }
+        }
+        TimerRun(w);
+    }
+    return 0;
+}
+
+//
+// Daemon and server modes: Ctrl-C, Ctrl-Break or closing the window stops them cleanly.
+//
+BOOL WINAPI StopCtrlHandler(DWORD ctrl_type) {
+    SetEvent(StopEvent);
+    return TRUE;
+}
+
+//
+// Daemon benchmark (--daemon-bench). Feeds lines of text through named pipe pairs (standing in for serial ports) to
+// the daemon, at BenchRate KB/s in total, for BENCH_TIME seconds, and reports the workers' CPU use per port.
+// pipes are the server ends, which the daemon's ports are connected to.
+//
+void DaemonBench(Worker * workers, DWORD worker_count, DaemonPort * dps, HANDLE * pipes) {
+    for (DWORD i = 0; i < BenchPorts; i++) {
+        if (ConnectNamedPipe(pipes[i], NULL) == 0 && GetLastError() != ERROR_PIPE_CONNECTED) {
+            ExitWithError("ConnectNamedPipe(bench)", true);
+        }
+    }
+
+    // A block of numbered lines to send to every port each BENCH_TICK
+    DWORD per_tick = max((DWORD)((LONG64)BenchRate * 1024 * BENCH_TICK / 1000 / BenchPorts), 1);
+    char * block = VirtualAlloc(NULL, per_tick, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (block == NULL) {
+        ExitWithError("VirtualAlloc(bench)", true);
+    }
+    for (DWORD i = 0; i < per_tick; i++) {
+        block[i] = (i % 64 == 63) ? '\n' : (char)('0' + i % 64 % 10);
+    }
+
+    FILETIME created, exited, kernel, user;
+    LONG64 cpu_start = 0;
+    for (DWORD i = 0; i < worker_count; i++) {
+        GetThreadTimes(workers[i].thread, &created, &exited, &kernel, &user);
+        cpu_start += ((LONG64)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) + ((LONG64)user.dwHighDateTime << 32 | user.dwLowDateTime);
+    }
+
+    fprintf(stderr, "Daemon benchmark: %u ports, %u KB/s for %u s.\n", BenchPorts, BenchRate, BENCH_TIME);
+    HANDLE timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (timer == NULL) {
+        timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);        // Before Windows 10 1803
+    }
+    if (timer == NULL) {
+        ExitWithError("CreateWaitableTimerExW(bench)", true);
+    }
+    LONG64 start = Now();
+    LONG64 sent = 0;
+    for (LONG64 tick = 1; tick <= BENCH_TIME * 1000 / BENCH_TICK; tick++) {
+        for (DWORD i = 0; i < BenchPorts; i++) {
+            DWORD written = 0;
+            if (WriteFile(pipes[i], block, per_tick, &written, NULL) == 0) {
+                ExitWithError("WriteFile(bench)", true);
+            }
+            sent += written;
+        }
+        DWORD ms = MsUntil(start + tick * BENCH_TICK * QpcFrequency / 1000);
+        if (ms > 0) {
+            PaceWait(timer, ms);
+        }
+    }
+    double secs = SecondsSince(start);
+
+    // Give the daemon time to take the last of it, then stop it (which writes out the rest)
+    Sleep(DAEMON_FLUSH);
+    LONG64 cpu_end = 0;
+    for (DWORD i = 0; i < worker_count; i++) {
+        GetThreadTimes(workers[i].thread, &created, &exited, &kernel, &user);
+        cpu_end += ((LONG64)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) + ((LONG64)user.dwHighDateTime << 32 | user.dwLowDateTime);
+    }
+    double cpu = (cpu_end - cpu_start) / 1e7;
+    SetEvent(StopEvent);
+    for (DWORD i = 0; i < worker_count; i++) {
+        PostQueuedCompletionStatus(workers[i].iocp, 0, 1, NULL);
+        WaitForSingleObject(workers[i].thread, INFINITE);
+    }
+    LONG64 logged = 0;
+    for (DWORD i = 0; i < BenchPorts; i++) {
+        logged += dps[i].port->rx_bytes;
+    }
+
+    fprintf(stderr, "Daemon benchmark: sent %.1f KB/s, %lld of %lld bytes received.\n", sent / 1024.0 / secs, logged, sent);
+    fprintf(stderr, "Daemon benchmark: workers used %.3f s CPU over %.1f s (%.1f%% of a core), %.3f%% of a core per port, %.2f us per KB.\n",
+        cpu, secs, cpu * 100.0 / secs, cpu * 100.0 / secs / BenchPorts, (sent > 0) ? cpu * 1e6 / (sent / 1024.0) : 0.0);
+}
+
+//
+// Daemon mode (--daemon). Log every port to its own files in dir, with no console, until Ctrl-C. Exits when done.
+//
+void RunDaemon(const char * dir) {
+    if (CreateDirectoryA(dir, NULL) == 0 && GetLastError() != ERROR_ALREADY_EXISTS) {
+        ExitWithError("CreateDirectoryA(daemon)", true);
+    }
+    StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (StopEvent == NULL) {
+        ExitWithError("CreateEvent(daemon)", true);
+    }
+    SetConsoleCtrlHandler(StopCtrlHandler, TRUE);
+
+    // The benchmark connects to named pipes that it feeds itself
+    static HANDLE pipes[MAX_PORTS];
+    static char pipe_names[MAX_PORTS][64];
+    for (DWORD i = 0; i < BenchPorts; i++) {
+        snprintf(pipe_names[i], sizeof(pipe_names[i]), "\\\\.\\pipe\\spconnect-bench-%u-%u", GetCurrentProcessId(), i);
+        pipes[i] = CreateNamedPipeA(pipe_names[i], PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_WAIT, 1, 65536, 65536, 0, NULL);
+        if (pipes[i] == INVALID_HANDLE_VALUE) {
+            ExitWithError("CreateNamedPipeA(bench)", true);
+        }
+        Ports[PortCount].name = pipe_names[i];
+        PortCount++;
+    }
+
+    // One worker per core, up to one per port, with the ports dealt out between them
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    DWORD worker_count = min(max(si.dwNumberOfProcessors, 1), PortCount);
+    Worker * workers = VirtualAlloc(NULL, worker_count * sizeof(Worker), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    DaemonPort * dps = VirtualAlloc(NULL, PortCount * sizeof(DaemonPort), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (workers == NULL || dps == NULL) {
+        ExitWithError("VirtualAlloc(daemon)", true);
+    }
+    for (DWORD i = 0; i < worker_count; i++) {
+        workers[i].iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+        if (workers[i].iocp == NULL) {
+            ExitWithError("CreateIoCompletionPort(worker)", true);
+        }
+    }
+    for (DWORD i = 0; i < PortCount; i++) {
+        DaemonPort * dp = &dps[i];
+        dp->port = &Ports[i];
+        dp->worker = &workers[i % worker_count];
+        dp->port->rx_buf = VirtualAlloc(NULL, RX_READS * BUF_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        dp->block[0] = VirtualAlloc(NULL, 2 * DAEMON_BLOCK, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (dp->port->rx_buf == NULL || dp->block[0] == NULL) {
+            ExitWithError("VirtualAlloc(daemon port)", true);
+        }
+        dp->block[1] = dp->block[0] + DAEMON_BLOCK;
+        DaemonOpenSegment(dp);
+        DaemonConnect(dp);
+        DaemonSchedule(dp);
+    }
+    for (DWORD i = 0; i < worker_count; i++) {
+        workers[i].thread = CreateThread(NULL, 0, DaemonWorkerThread, &workers[i], 0, NULL);
+        if (workers[i].thread == NULL) {
+            ExitWithError("CreateThread(worker)", true);
+        }
+        SetThreadIdealProcessor(workers[i].thread, i);
+    }
+
+    if (BenchPorts > 0) {
+        DaemonBench(workers, worker_count, dps, pipes);
+    }
+    else {
+        fprintf(stderr, "Logging %u ports to %s with %u workers. Press Ctrl-C to stop.\n", PortCount, dir, worker_count);
+        WaitForSingleObject(StopEvent, INFINITE);
+        for (DWORD i = 0; i < worker_count; i++) {
+            PostQueuedCompletionStatus(workers[i].iocp, 0, 1, NULL);
+            WaitForSingleObject(workers[i].thread, INFINITE);
+        }
+    }
+
+    // The workers have stopped, so write out what's left of every port's log
+    LONG64 logged = 0;
+    DWORD disconnects = 0;
+    for (DWORD i = 0; i < PortCount; i++) {
+        DaemonPort * dp = &dps[i];
+        DWORD bytes = 0;
+        if (dp->writing && GetOverlappedResult(dp->log, &dp->write_ov, &bytes, TRUE) != 0) {
+            dp->logged += bytes;
+            dp->log_pos += bytes;
+        }
+        dp->writing = false;
+        DaemonWrite(dp);
+        if (dp->writing && GetOverlappedResult(dp->log, &dp->write_ov, &bytes, TRUE) != 0) {
+            dp->logged += bytes;
+        }
+        CloseHandle(dp->log);
+        logged += dp->logged;
+        disconnects += dp->disconnects;
+        if (ShowStats) {
+            fprintf(stderr, "%s: %lld bytes in %lld reads, %u disconnects.\n", dp->port->name, dp->port->rx_bytes, dp->port->rx_calls, dp->disconnects);
+        }
+    }
+    fprintf(stderr, "spconnect stopping. Logged %lld bytes from %u ports, %u disconnects.\n", logged, PortCount, disconnects);
+    exit(0);
+}
+
+//
+// Pipe mode RX thread: pass everything from the port to the output. A read is always pending on the port while the
+// last one is being written out. Stops the session if the output goes away (e.g. the end of a pipeline quits).
+//
+DWORD WINAPI PipeRxThread(LPVOID param) {
+    Port * port = Piped.port;
+    for (DWORD i = 0; i < RX_READS; i++) {
+        StartPortRead(port, &port->rx_ov[i], port->rx_buf + i * PIPE_BUF_SIZE, PIPE_BUF_SIZE);
+    }
+    while (1) {
+        DWORD cur = port->rx_next;
+        char * buf = port->rx_buf + cur * PIPE_BUF_SIZE;
+        WaitForSingleObject(port->rx_ov[cur].hEvent, INFINITE);
+        DWORD n = FinishPortRead(port, &port->rx_ov[cur]);
+        port->rx_bytes += n;
+        port->rx_calls++;
+        if (n > 0) {
+            WriteRelease64(&Piped.last_rx, Now());
+            DWORD written = 0;
+            if (WriteFile(Piped.out, buf, n, &written, NULL) == 0) {
+                SetEvent(StopEvent);
+                return 0;
+            }
+        }
+        StartPortRead(port, &port->rx_ov[cur], buf, PIPE_BUF_SIZE);
+        port->rx_next = (cur + 1) % RX_READS;
+    }
+    return 0;
+}
+
+//
+// Pipe mode TX thread: pass everything from the input to the port. While one block is being written to the port,
+// the next is read from the input. Sets Piped.input_done when the input ends and it has all been written.
+//
+DWORD WINAPI PipeTxThread(LPVOID param) {
+    static char buf[2][PIPE_BUF_SIZE];
+    Port * port = Piped.port;
+    OVERLAPPED ov = { 0 };
+    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (ov.hEvent == NULL) {
+        ExitWithError("CreateEvent(pipe)", true);
+    }
+    DWORD cur = 0;
+    DWORD writing = 0;                              // Bytes of the other buffer being written
+    while (1) {
+        DWORD n = 0;
+        bool more = ReadFile(Piped.in, buf[cur], PIPE_BUF_SIZE, &n, NULL) != 0 && n > 0;     // Not at the end of the input
+        PipeWriteWait(port, &ov, buf[cur ^ 1], writing);
+        if (!more) {
+            break;
+        }
+        if (WriteFile(port->h, buf[cur], n, NULL, &ov) == 0 && GetLastError() != ERROR_IO_PENDING) {
+            ExitWithError("WriteFile(port)", true);
+        }
+        writing = n;
+        cur ^= 1;
+    }
+    SetEvent(Piped.input_done);
+    return 0;
+}
+
+//
+// Pipe mode: wait for the write of len bytes from buf to the port to finish. If it times out part way (-w), the rest
+// is written again.
+//
+void PipeWriteWait(Port * port, OVERLAPPED * ov, const char * buf, DWORD len) {
+    DWORD done = 0;
+    while (done < len) {
+        DWORD n = 0;
+        if (GetOverlappedResult(port->h, ov, &n, TRUE) == 0) {
+            ExitWithError("WriteFile(port)", true);
+        }
+        port->tx_bytes += n;
+        port->tx_calls++;
+        done += n;
+        if (done < len) {
+            port->tx_timeouts++;
+            if (WriteFile(port->h, buf + done, len - done, NULL, ov) == 0 && GetLastError() != ERROR_IO_PENDING) {
+                ExitWithError("WriteFile(port)", true);
+            }
+        }
+    }
+}
+
+//
+// Pipe mode: open the port, and start passing data between it and in and out.
+//
+void PipeStart(HANDLE in, HANDLE out) {
+    Port * port = &Ports[0];
+    Piped.in = in;
+    Piped.out = out;
+    Piped.port = port;
+    Piped.input_done = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (Piped.input_done == NULL) {
+        ExitWithError("CreateEvent(pipe)", true);
+    }
+    InitPort(port);
+    port->rx_buf = VirtualAlloc(NULL, RX_READS * PIPE_BUF_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (port->rx_buf == NULL) {
+        ExitWithError("VirtualAlloc(pipe)", true);
+    }
+    for (DWORD i = 0; i < RX_READS; i++) {
+        port->rx_ov[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (port->rx_ov[i].hEvent == NULL) {
+            ExitWithError("CreateEvent(pipe)", true);
+        }
+    }
+    HANDLE rx_thread = CreateThread(NULL, 0, PipeRxThread, NULL, 0, NULL);
+    HANDLE tx_thread = CreateThread(NULL, 0, PipeTxThread, NULL, 0, NULL);
+    if (rx_thread == NULL || tx_thread == NULL) {
+        ExitWithError("CreateThread(pipe)", true);
+    }
+    SetThreadPriority(rx_thread, THREAD_PRIORITY_HIGHEST);
+}
+
+//
+// Pipe mode, for when stdin or stdout isn't a console. Runs until Ctrl-C, the output going away, or the input ending
+// and the port then being quiet for Linger ms. Exits when done.
+//
+void RunPipe() {
+    StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (StopEvent == NULL) {
+        ExitWithError("CreateEvent(pipe)", true);
+    }
+    SetConsoleCtrlHandler(StopCtrlHandler, TRUE);
+    PipeStart(GetStdHandle(STD_INPUT_HANDLE), GetStdHandle(STD_OUTPUT_HANDLE));
+
+    // Once the input has all gone, give the device time to answer it
+    HANDLE wait_h[2] = { StopEvent, Piped.input_done };
+    if (WaitForMultipleObjects(2, wait_h, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+        LONG64 input_end = Now();
+        while (1) {
+            LONG64 quiet_since = max(ReadAcquire64(&Piped.last_rx), input_end);
+            DWORD ms = MsUntil(quiet_since + Linger * QpcFrequency / 1000);
+            if (ms == 0 || WaitForSingleObject(StopEvent, ms) != WAIT_TIMEOUT) {
+                break;
+            }
+        }
+    }
+    if (ShowStats) {
+        PrintStats();
+    }
+    exit(0);
+}
+
+//
+// Pipe benchmark: the device. Echoes everything back.
+//
+DWORD WINAPI PipeBenchEcho(LPVOID param) {
+    static char buf[PIPE_BUF_SIZE];
+    HANDLE h = (HANDLE)param;
+    DWORD n = 0;
+    DWORD written = 0;
+    while (ReadFile(h, buf, PIPE_BUF_SIZE, &n, NULL) != 0 && WriteFile(h, buf, n, &written, NULL) != 0) {
+    }
+    return 0;
+}
+
+//
+// Pipe benchmark: the start of the pipeline. Writes PipeBenchMB of the loopback test pattern, then ends.
+//
+DWORD WINAPI PipeBenchFeed(LPVOID param) {
+    static char buf[PIPE_BUF_SIZE];
+    HANDLE h = (HANDLE)param;
+    LONG64 total = (LONG64)PipeBenchMB * 1048576;
+    for (LONG64 sent = 0; sent < total; ) {
+        DWORD len = (DWORD)min(PIPE_BUF_SIZE, total - sent);
+        for (DWORD i = 0; i < len; i++) {
+            LONG64 pos = sent + i;
+            buf[i] = (char)(pos ^ (pos >> 8) ^ (pos >> 16));
+        }
+        DWORD written = 0;
+        if (WriteFile(h, buf, len, &written, NULL) == 0) {
+            ExitWithError("WriteFile(pipe bench)", true);
+        }
+        sent += written;
+    }
+    CloseHandle(h);
+    return 0;
+}
+
+//
+// Pipe benchmark (--pipe-bench). Measures pipe mode end to end: anonymous pipes stand in for stdin and stdout, as in
+// a shell pipeline, and a named pipe that echoes everything stands in for the port. Checks that everything comes
+// back in order, and reports the throughput and CPU use. Exits when done.
+//
+void PipeBench(DWORD megabytes) {
+    static char name[64];
+    snprintf(name, sizeof(name), "\\\\.\\pipe\\spconnect-pipe-bench-%u", GetCurrentProcessId());
+    HANDLE device = CreateNamedPipeA(name, PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_WAIT, 1, PIPE_BUF_SIZE, PIPE_BUF_SIZE, 0, NULL);
+    if (device == INVALID_HANDLE_VALUE) {
+        ExitWithError("CreateNamedPipeA(pipe bench)", true);
+    }
+    Ports[0].name = name;
+    Ports[0].line.baud = 0;
+    PortCount = 1;
+    HANDLE in_r, in_w, out_r, out_w;
+    if (CreatePipe(&in_r, &in_w, NULL, PIPE_BUF_SIZE) == 0 || CreatePipe(&out_r, &out_w, NULL, PIPE_BUF_SIZE) == 0) {
+        ExitWithError("CreatePipe(pipe bench)", true);
+    }
+    StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (StopEvent == NULL) {
+        ExitWithError("CreateEvent(pipe bench)", true);
+    }
+
+    fprintf(stderr, "Pipe benchmark: sending %u MB.\n", megabytes);
+    double cpu_start = CpuSeconds();
+    LONG64 start = Now();
+    PipeStart(in_r, out_w);
+    if (ConnectNamedPipe(device, NULL) == 0 && GetLastError() != ERROR_PIPE_CONNECTED) {
+        ExitWithError("ConnectNamedPipe(pipe bench)", true);
+    }
+    HANDLE echo_thread = CreateThread(NULL, 0, PipeBenchEcho, device, 0, NULL);
+    HANDLE feed_thread = CreateThread(NULL, 0, PipeBenchFeed, in_w, 0, NULL);
+    if (echo_thread == NULL || feed_thread == NULL) {
+        ExitWithError("CreateThread(pipe bench)", true);
+    }
+
+    // Check what comes out of the end of the pipeline
+    static char buf[PIPE_BUF_SIZE];
+    LONG64 total = (LONG64)megabytes * 1048576;
+    LONG64 received = 0;
+    LONG64 mismatched = 0;
+    while (received < total) {
+        DWORD n = 0;
+        if (ReadFile(out_r, buf, PIPE_BUF_SIZE, &n, NULL) == 0) {
+            ExitWithError("ReadFile(pipe bench)", true);
+        }
+        for (DWORD i = 0; i < n; i++) {
+            LONG64 pos = received + i;
+            mismatched += (buf[i] != (char)(pos ^ (pos >> 8) ^ (pos >> 16)));
+        }
+        received += n;
+    }
+
+    double secs = SecondsSince(start);
+    fprintf(stderr, "Pipe benchmark: received %lld bytes, mismatched %lld.\n", received, mismatched);
+    fprintf(stderr, "Pipe benchmark: %.1f MB/s over %.2f s, CPU %.1f%% (including the feed, echo and check threads).\n",
+        received / 1048576.0 / secs, secs, (CpuSeconds() - cpu_start) * 100.0 / secs);
+    if (ShowStats) {
+        PrintStats();
+    }
+    exit((mismatched == 0) ? 0 : 1);
+}
+
+//
+// Server mode: send the client what it's waiting for: the rest of the current block from the port (with each 0xFF
+// doubled, for telnet), then any telnet replies. Returns false if the connection has failed.
+//
+bool ClientSend(Client * c) {
+    while (Serve.out != NULL && !c->suspended && (c->sent < Serve.out_len || c->iac_pending)) {
+        const char * p = Serve.out + c->sent;
+        int n = Serve.out_len - c->sent;
+        if (c->iac_pending) {
+            p = "\xff";
+            n = 1;
+        }
+        else if (Rfc2217) {
+            const char * iac = memchr(p, TN_IAC, n);
+            if (iac != NULL) {
+                n = (int)(iac - p) + 1;             // Up to and including the 0xFF, then the escaping 0xFF
+            }
+        }
+        int r = send(c->s, p, n, 0);
+        if (r == SOCKET_ERROR) {
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+        if (c->iac_pending) {
+            c->iac_pending = false;
+            continue;
+        }
+        c->sent += r;
+        c->iac_pending = Rfc2217 && (BYTE)Serve.out[c->sent - 1] == TN_IAC;
+    }
+    while (c->ctl_len > 0 && !c->iac_pending) {
+        int r = send(c->s, (const char *)c->ctl, c->ctl_len, 0);
+        if (r == SOCKET_ERROR) {
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+        memmove(c->ctl, c->ctl + r, c->ctl_len - r);
+        c->ctl_len -= r;
+    }
+    return true;
+}
+
+//
+// Server mode: disconnect client i. If it was in control, the client that has been connected longest takes over.
+//
+void ClientClose(DWORD i) {
+    Client * c = &Serve.clients[i];
+    bool control = c->control;
+    fprintf(stderr, "%s disconnected.\n", c->name);
+    closesocket(c->s);
+    WSACloseEvent(c->event);
+    Serve.client_count--;
+    memmove(c, c + 1, (Serve.client_count - i) * sizeof(Client));
+    if (control && Serve.client_count > 0) {
+        Serve.clients[0].control = true;
+        Serve.clients[0].stalled = 0;
+        fprintf(stderr, "%s is now in control.\n", Serve.clients[0].name);
+    }
+}
+
+//
+// Server mode: take new connections. The first client is in control of the port; the rest can only watch.
+//
+void ClientAccept(SOCKET listen_s) {
+    while (1) {
+        struct sockaddr_storage sa;
+        int sa_len = sizeof(sa);
+        SOCKET s = accept(listen_s, (struct sockaddr *)&sa, &sa_len);
+        if (s == INVALID_SOCKET) {
+            return;                                 // WSAEWOULDBLOCK, or a connection that has already gone
+        }
+        char host[NI_MAXHOST], serv[NI_MAXSERV];
+        if (getnameinfo((struct sockaddr *)&sa, sa_len, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+            snprintf(host, sizeof(host), "?");
+            snprintf(serv, sizeof(serv), "?");
+        }
+        if (Serve.client_count == SERVE_CLIENTS) {
+            fprintf(stderr, "Refused %s:%s, already serving %u clients.\n", host, serv, SERVE_CLIENTS);
+            closesocket(s);
+            continue;
+        }
+
+        Client * c = &Serve.clients[Serve.client_count];
+        memset(c, 0, sizeof(Client));
+        c->s = s;
+        c->event = WSACreateEvent();
+        if (c->event == WSA_INVALID_EVENT || WSAEventSelect(s, c->event, FD_READ | FD_WRITE | FD_CLOSE) != 0) {
+            ExitWithError("WSAEventSelect(client)", true);
+        }
+        BOOL nodelay = TRUE;                        // Typing goes out a key at a time
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+        snprintf(c->name, sizeof(c->name), "%s:%s", host, serv);
+        c->control = (Serve.client_count == 0);
+        c->sent = (Serve.out != NULL) ? Serve.out_len : 0;     // It starts with the next block from the port
+        if (Rfc2217) {
+            static const BYTE hello[] = {
+                TN_IAC, TN_WILL, TN_BINARY, TN_IAC, TN_DO, TN_BINARY, TN_IAC, TN_WILL, TN_SGA, TN_IAC, TN_DO, TN_SGA,
+                TN_IAC, TN_DO, TN_COM_PORT };
+            TelnetReply(c, hello, sizeof(hello));
+            c->options[TN_BINARY] = TN_US | TN_THEM;
+            c->options[TN_SGA] = TN_US | TN_THEM;
+            c->options[TN_COM_PORT] = TN_THEM;
+        }
+        Serve.client_count++;
+        fprintf(stderr, "%s connected (%s).\n", c->name, c->control ? "in control" : "watching");
+    }
+}
+
+//
+// Server mode: take what the client has sent. From the client in control it goes straight into the port write buffer
+// (once the last write has finished), and is written. From the others, only telnet commands are acted on.
+// Returns false if the client has disconnected.
+//
+bool ClientReceive(Client * c) {
+    static char discard[BUF_SIZE];
+    while (c->readable) {
+        if (c->control && Serve.writing) {
+            return true;                            // Picked up again when the write completes
+        }
+        char * buf = c->control ? Serve.tx_buf : discard;
+        int r = recv(c->s, buf, BUF_SIZE, 0);
+        if (r == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+            c->readable = false;
+            break;
+        }
+        if (r == SOCKET_ERROR || r == 0) {
+            return false;
+        }
+        DWORD n = Rfc2217 ? TelnetInput(c, (BYTE *)buf, r) : r;
+        if (c->control && n > 0) {
+            HANDLE event = Serve.tx_ov.hEvent;
+            memset(&Serve.tx_ov, 0, sizeof(Serve.tx_ov));
+            Serve.tx_ov.hEvent = event;
+            if (WriteFile(Serve.port->h, Serve.tx_buf, n, NULL, &Serve.tx_ov) == 0 && GetLastError() != ERROR_IO_PENDING) {
+                ExitWithError("WriteFile(port)", true);
+            }
+            Serve.writing = true;
+            Serve.tx_pos = 0;
+            Serve.tx_len = n;
+            Serve.tx_bytes += n;
+        }
+    }
+    return true;
+}
+
+//
+// Server mode: take the telnet commands out of data received from a client, in place, and act on them.
+// Returns the length of the data left. A command split between two receives is carried over.
+//
+DWORD TelnetInput(Client * c, BYTE * buf, DWORD len) {
+    DWORD out = 0;
+    for (DWORD i = 0; i < len; i++) {
+        BYTE b = buf[i];
+        switch (c->tn_state) {
+        case 0:
+            if (b == TN_IAC) {
+                c->tn_state = TN_IAC;
+            } else {
+                buf[out++] = b;
+            }
+            break;
+        case TN_IAC:
+            c->tn_state = 0;
+            if (b == TN_IAC) {
+                buf[out++] = b;                     // Escaped 0xFF
+            }
+            else if (b >= TN_WILL && b <= TN_DONT) {
+                c->tn_state = b;                    // The option follows
+            }
+            else if (b == TN_SB) {
+                c->sb_len = 0;
+                c->tn_state = TN_SB;
+            }
+            break;                                  // Anything else (e.g. NOP) is ignored
+        case TN_WILL:
+        case TN_WONT:
+        case TN_DO:
+        case TN_DONT:
+            TelnetOption(c, c->tn_state, b);
+            c->tn_state = 0;
+            break;
+        case TN_SB:
+            if (b == TN_IAC) {
+                c->tn_state = TN_SE;                // IAC within a subnegotiation: either IAC SE, or an escaped 0xFF
+            }
+            else if (c->sb_len < TELNET_SB_SIZE) {
+                c->sb[c->sb_len++] = b;
+            }
+            break;
+        case TN_SE:
+            c->tn_state = TN_SB;
+            if (b == TN_SE) {
+                if (c->sb_len > 0 && c->sb[0] == TN_COM_PORT) {
+                    ComPortCommand(c, c->sb, c->sb_len);
+                }
+                c->tn_state = 0;
+            }
+            else if (c->sb_len < TELNET_SB_SIZE) {
+                c->sb[c->sb_len++] = b;
+            }
+            break;
+        }
+    }
+    return out;
+}
+
+//
+// Server mode: queue a telnet reply to the client. A client that doesn't read its replies loses them.
+//
+void TelnetReply(Client * c, const BYTE * reply, DWORD len) {
+    if (c->ctl_len + len <= TELNET_CTL_SIZE) {
+        memcpy(c->ctl + c->ctl_len, reply, len);
+        c->ctl_len += len;
+    }
+}
+
+//
+// Server mode: the client has sent WILL, WONT, DO or DONT for a telnet option. We do binary, suppress go-ahead, and
+// (from the client) the RFC 2217 com port option. We only answer a change, so the two ends never loop.
+//
+void TelnetOption(Client * c, BYTE command, BYTE option) {
+    BYTE reply[3] = { TN_IAC, 0, option };
+    BYTE * state = &c->options[option];
+    bool ours = (option == TN_BINARY || option == TN_SGA);
+    switch (command) {
+    case TN_WILL:
+        if (!(*state & TN_THEM)) {
+            reply[1] = (ours || option == TN_COM_PORT) ? TN_DO : TN_DONT;
+            *state |= (reply[1] == TN_DO) ? TN_THEM : 0;
+        }
+        break;
+    case TN_WONT:
+        if (*state & TN_THEM) {
+            reply[1] = TN_DONT;
+            *state &= ~TN_THEM;
+        }
+        break;
+    case TN_DO:
+        if (!(*state & TN_US)) {
+            reply[1] = ours ? TN_WILL : TN_WONT;
+            *state |= ours ? TN_US : 0;
+        }
+        break;
+    case TN_DONT:
+        if (*state & TN_US) {
+            reply[1] = TN_WONT;
+            *state &= ~TN_US;
+        }
+        break;
+    }
+    if (reply[1] != 0) {
+        TelnetReply(c, reply, 3);
+    }
+}
+
+//
+// Server mode: an RFC 2217 command from the client (sb is the subnegotiation, starting with the option).
+// Settings are mapped onto ConfigureSerialPort(), and the control lines onto EscapeCommFunction(). Only the client in control can change them; the
+// others' requests are answered as queries. We always reply with the port's actual setting. Line and modem state
+// notifications aren't sent.
+//
+void ComPortCommand(Client * c, const BYTE * sb, DWORD len) {
+    if (len < 2) {
+        return;
+    }
+    Port * port = Serve.port;
+    BYTE code = sb[1];
+    const BYTE * value = sb + 2;
+    DWORD n = len - 2;
+    BYTE v = (n > 0) ? value[0] : 0;
+    BYTE reply[4] = { v };
+
+    // A named pipe has no settings, so it reports 8N1 and the baud rate given
+    DCB dcb = { 0 };
+    dcb.DCBlength = sizeof(dcb);
+    bool settable = !port->is_pipe && GetCommState(port->h, &dcb) != 0;
+    if (!settable) {
+        dcb.BaudRate = port->line.baud;
+        dcb.ByteSize = 8;
+        dcb.Parity = NOPARITY;
+        dcb.StopBits = ONESTOPBIT;
+    }
+    bool set = settable && c->control;
+    LineSettings ls = { dcb.BaudRate, dcb.ByteSize, dcb.Parity, dcb.StopBits, FLOW_LEAVE, 0, 0 };
+
+    static const BYTE stop_to_dcb[4] = { 0, ONESTOPBIT, TWOSTOPBITS, ONE5STOPBITS };    // RFC 2217 1, 2, 1.5
+    static const BYTE stop_from_dcb[3] = { 1, 3, 2 };
+    switch (code) {
+    case 0:                                         // SIGNATURE. Only answered when asked for ours.
+        if (n == 0) {
+            ComPortReply(c, 100, (const BYTE *)"spconnect", 9);
+        }
+        return;
+    case 1:                                         // SET-BAUDRATE, 4 bytes in network order. 0 asks.
+        if (n < 4) {
+            return;
+        }
+        DWORD baud = (DWORD)value[0] << 24 | (DWORD)value[1] << 16 | (DWORD)value[2] << 8 | value[3];
+        ls.baud = baud;
+        if (baud != 0 && set && ConfigureSerialPort(port, &ls)) {
+            dcb.BaudRate = port->line.baud = baud;
+            fprintf(stderr, "%s set the baud rate to %u.\n", c->name, baud);
+        }
+        reply[0] = (BYTE)(dcb.BaudRate >> 24);
+        reply[1] = (BYTE)(dcb.BaudRate >> 16);
+        reply[2] = (BYTE)(dcb.BaudRate >> 8);
+        reply[3] = (BYTE)dcb.BaudRate;
+        ComPortReply(c, 101, reply, 4);
+        return;
+    case 2:                                         // SET-DATASIZE, 5 to 8
+        ls.data_bits = v;
+        if (v >= 5 && v <= 8 && set && ConfigureSerialPort(port, &ls)) {
+            dcb.ByteSize = v;
+        }
+        reply[0] = dcb.ByteSize;
+        break;
+    case 3:                                         // SET-PARITY: none, odd, even, mark, space (DCB order, plus 1)
+        ls.parity = v - 1;
+        if (v >= 1 && v <= 5 && set && ConfigureSerialPort(port, &ls)) {
+            dcb.Parity = v - 1;
+        }
+        reply[0] = dcb.Parity + 1;
+        break;
+    case 4:                                         // SET-STOPSIZE
+        ls.stop_bits = stop_to_dcb[v % 4];
+        if (v >= 1 && v <= 3 && set && ConfigureSerialPort(port, &ls)) {
+            dcb.StopBits = stop_to_dcb[v];
+        }
+        reply[0] = stop_from_dcb[dcb.StopBits % 3];
+        break;
+    case 5:                                         // SET-CONTROL: flow control, break, DTR and RTS
+        if (v >= 1 && v <= 3 && set) {
+            ls.flow = (v == 2) ? FLOW_XONXOFF : (v == 3) ? FLOW_RTSCTS : 0;
+            ConfigureSerialPort(port, &ls);
+            GetCommState(port->h, &dcb);
+            Serve.dtr = (dcb.fDtrControl != DTR_CONTROL_DISABLE);   // Setting flow control turns DTR and RTS back on
+            Serve.rts = (dcb.fRtsControl != RTS_CONTROL_DISABLE);
+        }
+        else if (v >= 5 && v <= 6 && set) {
+            Serve.brk = (v == 5) ? SetCommBreak(port->h) != 0 : ClearCommBreak(port->h) == 0;
+        }
+        else if ((v == 8 || v == 9) && set && EscapeCommFunction(port->h, (v == 8) ? SETDTR : CLRDTR) != 0) {
+            Serve.dtr = (v == 8);
+        }
+        else if ((v == 11 || v == 12) && set && EscapeCommFunction(port->h, (v == 11) ? SETRTS : CLRRTS) != 0) {
+            Serve.rts = (v == 11);
+        }
+        if (v <= 3) {
+            reply[0] = dcb.fOutX ? 2 : dcb.fOutxCtsFlow ? 3 : 1;
+        } else if (v <= 6) {
+            reply[0] = Serve.brk ? 5 : 6;
+        } else if (v <= 9) {
+            reply[0] = Serve.dtr ? 8 : 9;
+        } else if (v <= 12) {
+            reply[0] = Serve.rts ? 11 : 12;
+        }
+        break;
+    case 8:                                         // FLOWCONTROL-SUSPEND and -RESUME: stop and start sending to it
+    case 9:
+        c->suspended = (code == 8);
+        ComPortReply(c, code + 100, NULL, 0);
+        return;
+    case 12:                                        // PURGE-DATA: 1 what the port has received, 2 what it's sending, 3 both
+        if (set) {
+            PurgeComm(port->h, ((v & 1) ? PURGE_RXCLEAR : 0) | ((v & 2) ? PURGE_TXCLEAR : 0));
+        }
+        break;
+    case 10:                                        // SET-LINESTATE-MASK and SET-MODEMSTATE-MASK are acknowledged
+    case 11:
+        break;
+    default:
+        return;
+    }
+    ComPortReply(c, code + 100, reply, 1);
+}
+
+//
+// Server mode: queue an RFC 2217 reply, IAC SB COM-PORT-OPTION code value IAC SE, with any 0xFF in the value doubled.
+//
+void ComPortReply(Client * c, BYTE code, const BYTE * value, DWORD len) {
+    BYTE reply[TELNET_SB_SIZE];
+    DWORD n = 0;
+    reply[n++] = TN_IAC;
+    reply[n++] = TN_SB;
+    reply[n++] = TN_COM_PORT;
+    reply[n++] = code;
+    for (DWORD i = 0; i < len && n < TELNET_SB_SIZE - 4; i++) {
+        reply[n++] = value[i];
+        if (value[i] == TN_IAC) {
+            reply[n++] = TN_IAC;
+        }
+    }
+    reply[n++] = TN_IAC;
+    reply[n++] = TN_SE;
+    TelnetReply(c, reply, n);
+}
+
+//
+// Server mode (--serve). Share the port over TCP on [address:]port, with no console, until Ctrl-C. Exits when done.
+// Everything runs on this thread: it waits on the port's reads and write, the listening socket and the clients.
+//
+void RunServer(const char * addr) {
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        ExitWithError("WSAStartup failed.", false);
+    }
+    StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (StopEvent == NULL) {
+        ExitWithError("CreateEvent(server)", true);
+    }
+    SetConsoleCtrlHandler(StopCtrlHandler, TRUE);
+
+    // Listen on the address given, or on every interface if there's only a port number
+    char host[256];
+    const char * service = addr;
+    const char * colon = strrchr(addr, ':');
+    if (colon != NULL) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+        service = colon + 1;
+    }
+    struct addrinfo hints = { 0 };
+    struct addrinfo * ai = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo((colon != NULL) ? host : NULL, service, &hints, &ai) != 0) {
+        fprintf(stderr, "Can't serve on %s.\n%s", addr, SHORT_HELP_MSG);
+        exit(1);
+    }
+    SOCKET listen_s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (listen_s == INVALID_SOCKET) {
+        ExitWithError("socket", true);
+    }
+    if (bind(listen_s, ai->ai_addr, (int)ai->ai_addrlen) != 0) {
+        ExitWithError("bind", true);
+    }
+    freeaddrinfo(ai);
+    WSAEVENT listen_event = WSACreateEvent();
+    if (listen(listen_s, SOMAXCONN) != 0 || listen_event == WSA_INVALID_EVENT || WSAEventSelect(listen_s, listen_event, FD_ACCEPT) != 0) {
+        ExitWithError("listen", true);
+    }
+
+    // Open the port, and start reading it
+    Port * port = &Ports[0];
+    Serve.port = port;
+    InitPort(port);
+    port->rx_buf = VirtualAlloc(NULL, RX_READS * BUF_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    Serve.tx_ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (port->rx_buf == NULL || Serve.tx_ov.hEvent == NULL) {
+        ExitWithError("VirtualAlloc(server)", true);
+    }
+    DCB dcb = { 0 };
+    dcb.DCBlength = sizeof(dcb);
+    if (!port->is_pipe && GetCommState(port->h, &dcb) != 0) {
+        Serve.dtr = (dcb.fDtrControl != DTR_CONTROL_DISABLE);
+        Serve.rts = (dcb.fRtsControl != RTS_CONTROL_DISABLE);
+    }
+    for (DWORD i = 0; i < RX_READS; i++) {
+        port->rx_ov[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (port->rx_ov[i].hEvent == NULL) {
+            ExitWithError("CreateEvent(server)", true);
+        }
+        StartPortRead(port, &port->rx_ov[i], port->rx_buf + i * BUF_SIZE, BUF_SIZE);
+        Serve.rx_pending[i] = true;
+    }
+    port->rx_next = 0;
+    fprintf(stderr, "Serving %s on %s%s. Press Ctrl-C to stop.\n", port->name, addr, Rfc2217 ? " (RFC 2217)" : "");
+
+    while (1) {
+        // Wait for: Ctrl-C, a connection, a read or the write on the port, and network events from the clients.
+        // A watching client holding up the port is given until SERVE_STALL.
+        HANDLE wait_h[3 + RX_READS + SERVE_CLIENTS];
+        DWORD wait_count = 0;
+        wait_h[wait_count++] = StopEvent;
+        wait_h[wait_count++] = listen_event;
+        for (DWORD i = 0; i < RX_READS; i++) {
+            if (Serve.rx_pending[i]) {
+                wait_h[wait_count++] = port->rx_ov[i].hEvent;
+            }
+        }
+        if (Serve.writing) {
+            wait_h[wait_count++] = Serve.tx_ov.hEvent;
+        }
+        DWORD timeout = INFINITE;
+        for (DWORD i = 0; i < Serve.client_count; i++) {
+            wait_h[wait_count++] = Serve.clients[i].event;
+            if (Serve.clients[i].stalled != 0) {
+                timeout = min(timeout, MsUntil(Serve.clients[i].stalled + SERVE_STALL * QpcFrequency / 1000));
+            }
+        }
+        if (WaitForMultipleObjects(wait_count, wait_h, FALSE, timeout) == WAIT_FAILED) {
+            ExitWithError("WaitForMultipleObjects(server)", true);
+        }
+        if (WaitForSingleObject(StopEvent, 0) == WAIT_OBJECT_0) {
+            break;
+        }
+
+        // New connections
+        WSANETWORKEVENTS ne;
+        if (WSAEnumNetworkEvents(listen_s, listen_event, &ne) == 0 && (ne.lNetworkEvents & FD_ACCEPT)) {
+            ClientAccept(listen_s);
+        }
+
+        // The write to the port. If it timed out part way (-w), the rest is written again.
+        DWORD n = 0;
+        if (Serve.writing && GetOverlappedResult(port->h, &Serve.tx_ov, &n, FALSE) != 0) {
+            Serve.tx_pos += n;
+            Serve.writing = (Serve.tx_pos < Serve.tx_len);
+            if (Serve.writing && WriteFile(port->h, Serve.tx_buf + Serve.tx_pos, Serve.tx_len - Serve.tx_pos, NULL, &Serve.tx_ov) == 0
+                && GetLastError() != ERROR_IO_PENDING) {
+                ExitWithError("WriteFile(port)", true);
+            }
+        }
+        else if (Serve.writing && GetLastError() != ERROR_IO_INCOMPLETE) {
+            ExitWithError("WriteFile(port)", true);
+        }
+
+        // Data and telnet commands from the clients
+        for (DWORD i = 0; i < Serve.client_count; ) {
+            Client * c = &Serve.clients[i];
+            if (WSAEnumNetworkEvents(c->s, c->event, &ne) == 0 && (ne.lNetworkEvents & (FD_READ | FD_CLOSE))) {
+                c->readable = true;                 // On FD_CLOSE, recv() takes what's left, then finds the end
+            }
+            if (!ClientReceive(c)) {
+                ClientClose(i);
+                continue;
+            }
+            i++;
+        }
+
+        // Reads from the port that have completed
+        for (DWORD i = 0; i < RX_READS; i++) {
+            if (Serve.rx_pending[i] && GetOverlappedResult(port->h, &port->rx_ov[i], &Serve.rx_len[i], FALSE) != 0) {
+                Serve.rx_pending[i] = false;
+            }
+            else if (Serve.rx_pending[i] && GetLastError() != ERROR_IO_INCOMPLETE) {
+                ExitWithError("ReadFile(port)", true);
+            }
+        }
+
+        // Send each block from the port to every client, in the order the reads were issued. A read is only re-armed
+        // once every client has its block, so the port is held up by the slowest client (and the clients are never
+        // sent different data), but a watching client that holds it up for SERVE_STALL is disconnected.
+        while (1) {
+            DWORD cur = port->rx_next;
+            if (Serve.out == NULL && !Serve.rx_pending[cur]) {
+                Serve.out = port->rx_buf + cur * BUF_SIZE;
+                Serve.out_len = Serve.rx_len[cur];
+                Serve.rx_bytes += Serve.out_len;
+                for (DWORD i = 0; i < Serve.client_count; i++) {
+                    Serve.clients[i].sent = 0;
+                }
+            }
+            bool done = true;
+            for (DWORD i = 0; i < Serve.client_count; ) {
+                Client * c = &Serve.clients[i];
+                if (!ClientSend(c)) {
+                    ClientClose(i);
+                    continue;
+                }
+                if (Serve.out != NULL && (c->sent < Serve.out_len || c->iac_pending)) {
+                    if (c->stalled == 0 && !c->control) {
+                        c->stalled = Now();
+                    }
+                    else if (c->stalled != 0 && MsUntil(c->stalled + SERVE_STALL * QpcFrequency / 1000) == 0) {
+                        fprintf(stderr, "%s isn't keeping up.\n", c->name);
+                        ClientClose(i);
+                        continue;
+                    }
+                    done = false;
+                }
+                else {
+                    c->stalled = 0;
+                }
+                i++;
+            }
+            if (Serve.out == NULL || !done) {
+                break;
+            }
+            Serve.out = NULL;
+            StartPortRead(port, &port->rx_ov[cur], port->rx_buf + cur * BUF_SIZE, BUF_SIZE);
+            Serve.rx_pending[cur] = true;
+            port->rx_next = (cur + 1) % RX_READS;
+        }
+    }
+
+    while (Serve.client_count > 0) {
+        ClientClose(Serve.client_count - 1);
+    }
+    closesocket(listen_s);
+    WSACleanup();
+    fprintf(stderr, "spconnect stopping. %lld bytes from the port, %lld to it.\n", Serve.rx_bytes, Serve.tx_bytes);
+    exit(0);
+}
+
+//
+// Main function - program entry point.
+//
+int main(int argc, char* argv[]) {
+    LineSettings line = { 0 };      // From -c. A baud rate of 0 leaves the ports as they are.
 
     // Process arguments
     for(int i=1; i<argc; i++) {
@@ -324,8 +6677,21 @@ int main(int argc, char* argv[]) {
         }
 
         if(argv[i][0] != '-') {
-            // this argument must be a serial port
-            sp_s = argv[i];
+            // this argument must be a serial port, maybe with its own settings (e.g. com1:115200 or com1:921600,8,n,1,rtscts)
+            if (PortCount == MAX_PORTS) {
+                fprintf(stderr, "Too many ports, the most is %u.\n%s", MAX_PORTS, SHORT_HELP_MSG);
+                exit(1);
+            }
+            Port * port = &Ports[PortCount++];
+            port->name = argv[i];
+            char * spec = strrchr(argv[i], ':');
+            if (spec != NULL && spec[1] >= '0' && spec[1] <= '9') {
+                *spec++ = 0;
+                if (!ParseLineSettings(spec, &port->line)) {
+                    fprintf(stderr, "Bad settings for %s: %s\n%s", port->name, spec, SHORT_HELP_MSG);
+                    exit(1);
+                }
+            }
         } else {
             // match options
             
@@ -339,17 +6705,328 @@ int main(int argc, char* argv[]) {
             if (strcmp(arg, "--local-echo") == 0 || strcmp(arg, "-l") == 0) {
                 LocalEcho = true;
             }
-            else if (strcmp(arg, "--system-codepage") == 0 || strcmp(arg, "-s") == 0) {
-                SystemCP = true;
+            else if (strcmp(arg, "--system-codepage") == 0 || strcmp(arg, "-s") == 0) {
+                SystemCP = true;
+            }
+            else if (strcmp(arg, "--replace-cr") == 0 || strcmp(arg, "-r") == 0) {
+                ReplaceCR = true;
+            }
+            else if (strcmp(arg, "--disable-vt") == 0 || strcmp(arg, "-d") == 0) {
+                DisableVT = true;
+            }
+            else if (strcmp(arg, "--debug-input") == 0) {
+                DebugInput = true;
+            }
+            else if (strcmp(arg, "--hex-dump") == 0 || strcmp(arg, "-x") == 0) {
+                HexDump = true;
+            }
+            else if (strcmp(arg, "--stats") == 0) {
+                ShowStats = true;
+            }
+            else if (strcmp(arg, "--log") == 0) {
+                // check we have a follow-up filename
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No log file specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                LogPath = argv[i];
+            }
+            else if (strcmp(arg, "--log-sent") == 0) {
+                LogSent = true;
+            }
+            else if (strcmp(arg, "--capture") == 0) {
+                // check we have a follow-up filename
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No capture file specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                CapturePath = argv[i];
+            }
+            else if (strcmp(arg, "--dump") == 0) {
+                // check we have a follow-up filename
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No capture file specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                DumpPath = argv[i];
+            }
+            else if (strcmp(arg, "--from") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No start time specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                DumpFrom = atof(argv[i]);
+            }
+            else if (strcmp(arg, "--send-file") == 0) {
+                // check we have a follow-up filename
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No file to send specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                SendFilePath = argv[i];
+            }
+            else if (strcmp(arg, "--send-rate") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No send rate specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                SendRate = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--send-prompt") == 0) {
+                // check we have a follow-up string
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No prompt specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                SendPrompt = argv[i];
+                if (strlen(SendPrompt) < 1 || strlen(SendPrompt) > SEND_PROMPT_MAX) {
+                    fprintf(stderr, "Invalid prompt: %s\n%s", argv[i], SHORT_HELP_MSG);
+                    exit(1);
+                }
+            }
+            else if (strcmp(arg, "--upload") == 0) {
+                // check we have a follow-up filename
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No file to upload specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                UploadPath = argv[i];
+            }
+            else if (strcmp(arg, "--download") == 0) {
+                // check we have a follow-up filename
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No download file or directory specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                DownloadPath = argv[i];
             }
-            else if (strcmp(arg, "--replace-cr") == 0 || strcmp(arg, "-r") == 0) {
-                ReplaceCR = true;
+            else if (strcmp(arg, "--protocol") == 0) {
+                // check we have a follow-up protocol name
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No protocol specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                StrToLower(argv[i], strlen(argv[i]));
+                for (Protocol = 0; Protocol < XFER_PROTOCOLS; Protocol++) {
+                    if (strcmp(argv[i], ProtocolNames[Protocol]) == 0) {
+                        break;
+                    }
+                }
+                if (Protocol == XFER_PROTOCOLS) {
+                    fprintf(stderr, "Unknown protocol: %s\n%s", argv[i], SHORT_HELP_MSG);
+                    exit(1);
+                }
             }
-            else if (strcmp(arg, "--disable-vt") == 0 || strcmp(arg, "-d") == 0) {
-                DisableVT = true;
+            else if (strcmp(arg, "--resume") == 0) {
+                Resume = true;
             }
-            else if (strcmp(arg, "--debug-input") == 0) {
-                DebugInput = true;
+            else if (strcmp(arg, "--transfer-test") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No transfer test size specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                TransferTestMB = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--stats-file") == 0) {
+                // check we have a follow-up file name
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No statistics file specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                StatsFile = argv[i];
+            }
+            else if (strcmp(arg, "--latency") == 0) {
+                LatencyProbe = true;
+            }
+            else if (strcmp(arg, "--loopback-test") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No loopback test size specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                LoopbackTestMB = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--autobaud") == 0) {
+                AutoBaud = true;
+            }
+            else if (strcmp(arg, "--no-reconnect") == 0) {
+                NoReconnect = true;
+            }
+            else if (strcmp(arg, "--reconnect-test") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No reconnect test count specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                ReconnectTestCount = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--low-latency") == 0) {
+                LowLatency = true;
+            }
+            else if (strcmp(arg, "--rtt-test") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No round-trip test count specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                RttTestCount = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--daemon") == 0) {
+                // check we have a follow-up directory
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No log directory specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                DaemonDir = argv[i];
+            }
+            else if (strcmp(arg, "--segment-size") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No segment size specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                SegmentSize = max(atoi(argv[i]), 1);
+            }
+            else if (strcmp(arg, "--silence") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No silence time specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                SilenceTime = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--daemon-bench") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No number of benchmark ports specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                BenchPorts = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--bench-rate") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No benchmark rate specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                BenchRate = max(atoi(argv[i]), 1);
+            }
+            else if (strcmp(arg, "--linger") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No linger time specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                Linger = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--pipe-bench") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No pipe benchmark size specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                PipeBenchMB = max(atoi(argv[i]), 1);
+            }
+            else if (strcmp(arg, "--hex-bench") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No hex benchmark size specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                HexBenchMB = max(atoi(argv[i]), 1);
+            }
+            else if (strcmp(arg, "--serve") == 0) {
+                // check we have a follow-up address
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No address to serve on specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                ServeAddr = argv[i];
+            }
+            else if (strcmp(arg, "--rfc2217") == 0) {
+                Rfc2217 = true;
+            }
+            else if (strcmp(arg, "--spill-size") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No spill size specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                SpillSize = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--max-fps") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No frame rate specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                MaxFps = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--ring-size") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No buffer size specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                RingSize = atoi(argv[i]);
+                if (RingSize < 1 || RingSize > 1024 * 1024) {
+                    fprintf(stderr, "Invalid buffer size: %s\n%s", argv[i], SHORT_HELP_MSG);
+                    exit(1);
+                }
+            }
+            else if (strcmp(arg, "--hotkey") == 0 || strcmp(arg, "-k") == 0) {
+                // check we have a follow-up action=key
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No hotkey specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                StrToLower(argv[i], strlen(argv[i]));
+                char * key = strchr(argv[i], '=');
+                int action = HOTKEY_COUNT;
+                if (key != NULL) {
+                    *key++ = 0;
+                    for (action = 0; action < HOTKEY_COUNT; action++) {
+                        if (strcmp(argv[i], Hotkeys[action].action) == 0) {
+                            break;
+                        }
+                    }
+                }
+                if (action == HOTKEY_COUNT || Hotkeys[action].pass_through) {
+                    fprintf(stderr, "Unknown hotkey action: %s\n%s", argv[i], SHORT_HELP_MSG);
+                    exit(1);
+                }
+                Hotkeys[action].key = key;
             }
             else if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
                 fprintf(stderr, "\n%s", README);
@@ -364,14 +7041,35 @@ int main(int argc, char* argv[]) {
                 i++;
                 WriteTimeout = atoi(argv[i]);
             }
-            else if (strcmp(arg, "--configure-port") == 0 || strcmp(arg, "-c") == 0) {
+            else if (strcmp(arg, "--char-delay") == 0) {
+                // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No character delay specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                CharDelay = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--line-delay") == 0) {
                 // check we have a follow-up number
+                if((i+1) >= argc) {
+                    fprintf(stderr, "No line delay specified.\n%s", SHORT_HELP_MSG);
+                    exit(1);
+                }
+                i++;
+                LineDelay = atoi(argv[i]);
+            }
+            else if (strcmp(arg, "--configure-port") == 0 || strcmp(arg, "-c") == 0) {
+                // check we have follow-up settings
                 if((i+1) >= argc) {
                     fprintf(stderr, "No baud rate specified.\n%s", SHORT_HELP_MSG);
                     exit(1);
                 }
                 i++;
-                BaudRate = atoi(argv[i]);
+                if (!ParseLineSettings(argv[i], &line)) {
+                    fprintf(stderr, "Bad port settings: %s\n%s", argv[i], SHORT_HELP_MSG);
+                    exit(1);
+                }
             }
             else {
                 fprintf(stderr, "Unknown option: %s\n%s", argv[i], SHORT_HELP_MSG);
@@ -380,41 +7078,332 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    // Check that we have a serial port
-    if (sp_s[0] == 0) {
+    // Print a capture file, if requested. This doesn't need a serial port.
+    if (DumpPath != NULL) {
+        DumpCapture(DumpPath);
+        exit(0);
+    }
+
+    // Set up the hotkeys
+    for (int i = 0; i < HOTKEY_COUNT; i++) {
+        if (Hotkeys[i].pass_through) {
+            continue;
+        }
+        if (!ParseHotkey(&Hotkeys[i], Hotkeys[i].key)) {
+            fprintf(stderr, "Unknown key for hotkey %s: %s\n%s", Hotkeys[i].action, Hotkeys[i].key, SHORT_HELP_MSG);
+            exit(1);
+        }
+    }
+
+    // Check that we have a serial port. Ports without a baud rate of their own get the one from -c, if any.
+    if (PortCount == 0 && BenchPorts == 0 && PipeBenchMB == 0 && HexBenchMB == 0 && TransferTestMB == 0 && ReconnectTestCount == 0) {
         fprintf(stderr, "Please specify a serial port. e.g. 'spconnect com1'.\n%s", SHORT_HELP_MSG);
         exit(1);
     }
+    if (BenchPorts > 0 && DaemonDir == NULL) {
+        fprintf(stderr, "The daemon benchmark needs a log directory (--daemon).\n%s", SHORT_HELP_MSG);
+        exit(1);
+    }
+    if (PortCount + BenchPorts > MAX_PORTS) {
+        fprintf(stderr, "Too many ports, the most is %u.\n%s", MAX_PORTS, SHORT_HELP_MSG);
+        exit(1);
+    }
+    if (ServeAddr != NULL && (PortCount != 1 || DaemonDir != NULL)) {
+        fprintf(stderr, "Serve one port at a time, without --daemon.\n%s", SHORT_HELP_MSG);
+        exit(1);
+    }
+    if (DaemonDir == NULL && PortCount > MAXIMUM_WAIT_OBJECTS) {
+        fprintf(stderr, "Too many ports for a terminal session, the most is %u. Use --daemon to log more.\n%s", MAXIMUM_WAIT_OBJECTS, SHORT_HELP_MSG);
+        exit(1);
+    }
+    for (DWORD i = 0; i < PortCount; i++) {
+        if (Ports[i].line.baud == 0) {
+            Ports[i].line = line;
+        }
+    }
+
+    // Start the clock, for statistics
+    LARGE_INTEGER qpf;
+    QueryPerformanceFrequency(&qpf);
+    QpcFrequency = qpf.QuadPart;
+    StartTime = Now();
+    StatsTime = StartTime;
+    ConsoleThreadId = GetCurrentThreadId();
+
+    // The hex dump benchmark doesn't need a port either, just the clock
+    if (HexBenchMB > 0) {
+        HexBench(HexBenchMB);
+    }
+
+    // Daemon and server modes have no console. They run until stopped, then exit.
+    if (DaemonDir != NULL) {
+        RunDaemon(DaemonDir);
+    }
+    if (ServeAddr != NULL) {
+        RunServer(ServeAddr);
+    }
+
+    // Pipe mode, if stdin or stdout isn't a console (e.g. in a shell pipeline). It has one port.
+    DWORD console_mode;
+    if (PipeBenchMB > 0) {
+        PipeBench(PipeBenchMB);
+    }
+    if (GetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), &console_mode) == 0 || GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &console_mode) == 0) {
+        // The tests and transfers run in a console session, and pipe mode would quietly skip them
+        const char * console_only = (LoopbackTestMB > 0) ? "--loopback-test" : (RttTestCount > 0) ? "--rtt-test"
+            : (TransferTestMB > 0) ? "--transfer-test" : (ReconnectTestCount > 0) ? "--reconnect-test" : (UploadPath != NULL) ? "--upload" : (DownloadPath != NULL) ? "--download"
+            : (SendFilePath != NULL) ? "--send-file" : NULL;
+        if (console_only != NULL) {
+            fprintf(stderr, "%s needs stdin and stdout to be the console, not a pipe or file.\n%s", console_only, SHORT_HELP_MSG);
+            exit(1);
+        }
+        if (PortCount > 1) {
+            fprintf(stderr, "Only one port at a time when stdin or stdout isn't a console.\n%s", SHORT_HELP_MSG);
+            exit(1);
+        }
+        RunPipe();
+    }
 
-    // Initialize stdin and stdout and the serial port
+    // Initialize stdin and stdout
     HANDLE stdin_h  = InitStdin();
     HANDLE stdout_h = InitStdout();
-    HANDLE port_h   = InitPort(sp_s);
+    SetConsoleCtrlHandler(StatsCtrlHandler, TRUE);
+
+    // The transfer and reconnect tests bring their own named pipes, in place of any ports given
+    if (TransferTestMB > 0) {
+        TransferTestPorts();
+    }
+    if (ReconnectTestCount > 0) {
+        ReconnectTestPorts();
+    }
+
+    // Open and configure the serial ports, and set up the buffers between the console and the serial port threads.
+    // Reads on every port complete to the one completion port, so one RX thread serves them all.
+    RxCompletion = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    RxReady = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (RxCompletion == NULL || RxReady == NULL) {
+        ExitWithError("CreateIoCompletionPort", true);
+    }
+    for (DWORD i = 0; i < PortCount; i++) {
+        static const int tag_colours[] = { 36, 33, 35, 32, 34, 31 };
+        Port * port = &Ports[i];
+        if (port->h == NULL) {
+            InitPort(port);
+        }
+        if (CreateIoCompletionPort(port->h, RxCompletion, (ULONG_PTR)port, 0) == NULL) {
+            ExitWithError("CreateIoCompletionPort(port)", true);
+        }
+        // A named pipe isn't reopened, except the reconnect test's, which stands in for a device that goes away
+        port->reconnect = !NoReconnect && (!port->is_pipe || ReconnectTestCount > 0);
+        if (port->reconnect && port->line.baud == 0) {
+            SaveLineSettings(port);
+        }
+        port->connected = CreateEvent(NULL, TRUE, TRUE, NULL);
+        if (port->connected == NULL) {
+            ExitWithError("CreateEvent(connected)", true);
+        }
+        // RX reads are timestamped for the latency probe and the capture. Spilled reads are too, so there's room for
+        // a mark per full read in the spill file.
+        RingInit(&port->rx, RingSize * 1024, (LatencyProbe || CapturePath != NULL) ? MARK_COUNT + SpillSize * (1048576 / BUF_SIZE) : 0);
+        RingInit(&port->tx, RingSize * 1024, LatencyProbe ? MARK_COUNT : 0);
+        port->rx_buf = VirtualAlloc(NULL, RX_READS * BUF_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (port->rx_buf == NULL) {
+            ExitWithError("VirtualAlloc(rx_buf)", true);
+        }
+
+        // Tag for each line from the port, e.g. "[com1] " in colour. A pipe is tagged with the last part of its name.
+        const char * label = strrchr(port->name, '\\');
+        label = (label != NULL) ? label + 1 : port->name;
+        if (DisableVT) {
+            snprintf(port->tag, PORT_TAG_SIZE, "[%.40s] ", label);
+        } else {
+            snprintf(port->tag, PORT_TAG_SIZE, "\x1b[%dm[%.40s]\x1b[0m ", tag_colours[i % 6], label);
+        }
+        port->tag_len = (DWORD)strlen(port->tag);
+    }
+
+    // Start the serial port threads.
+    // The RX thread gets a higher priority, so the UART FIFOs are emptied promptly even when the console is busy.
+    Sending.done_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    Sending.prompt_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (Sending.done_event == NULL || Sending.prompt_event == NULL) {
+        ExitWithError("CreateEvent(send)", true);
+    }
+    HANDLE rx_thread = CreateThread(NULL, 0, SerialRxThread, NULL, 0, NULL);
+    HANDLE tx_thread = CreateThread(NULL, 0, SerialTxThread, NULL, 0, NULL);
+    if (rx_thread == NULL || tx_thread == NULL) {
+        ExitWithError("CreateThread", true);
+    }
+    SetThreadPriority(rx_thread, THREAD_PRIORITY_HIGHEST);
+
+    // Run the loopback or round-trip test instead of a terminal session, if requested. With several ports, it uses the first.
+    if (LoopbackTestMB > 0) {
+        LoopbackTest(stdin_h, Target, LoopbackTestMB);
+    }
+    if (RttTestCount > 0) {
+        RttTest(stdin_h, Target, RttTestCount);
+    }
+    if (TransferTestMB > 0) {
+        TransferTest(stdin_h, TransferTestMB);
+    }
+    if (ReconnectTestCount > 0) {
+        ReconnectTest(stdin_h, Target, ReconnectTestCount);
+    }
 
-    // Configure serial port, if requested.
-    if(BaudRate != 0) {
-        ConfigureSerialPort(port_h, BaudRate);
+    // Start the session log and capture, if requested
+    if (LogPath != NULL) {
+        OpenLog(&SessionLog, LogPath);
+    }
+    if (CapturePath != NULL) {
+        OpenCapture(&SessionCapture, CapturePath);
+        for (DWORD i = 0; i < PortCount; i++) {
+            char note[MAX_PATH + 32];
+            snprintf(note, sizeof(note), "Connected to %s", Ports[i].name);
+            CaptureWrite(&SessionCapture, CAP_CONTROL, (BYTE)i, Now(), note, (DWORD)strlen(note));
+        }
     }
 
     // Display a welcome message.
-    fprintf(stderr, "Connecting to %s. Press Ctrl-F10 to quit.\n", sp_s);
+    for (DWORD i = 0; i < PortCount; i++) {
+        fprintf(stderr, "%s%s", (i == 0) ? "Connecting to " : ", ", Ports[i].name);
+    }
+    fprintf(stderr, ".");
+    if (PortCount > 1) {
+        fprintf(stderr, " Typing goes to %s.", Target->name);
+        if (Hotkeys[HK_NEXT_PORT].vk != 0) {
+            fprintf(stderr, " Press %s to switch.", Hotkeys[HK_NEXT_PORT].display);
+        }
+    }
+    if (Hotkeys[HK_QUIT].vk != 0) {
+        fprintf(stderr, " Press %s to quit.", Hotkeys[HK_QUIT].display);
+    }
+    fprintf(stderr, "\n");
+
+    // Run a file transfer, if requested
+    CrcInit();
+    if (UploadPath != NULL || DownloadPath != NULL) {
+        wchar_t path[MAX_PATH];
+        bool receiving = (UploadPath == NULL);
+        if (MultiByteToWideChar(CP_ACP, 0, receiving ? DownloadPath : UploadPath, -1, path, MAX_PATH) == 0) {
+            ExitWithError("MultiByteToWideChar(transfer path)", true);
+        }
+        RunTransfer(stdin_h, Target, receiving, path);
+    }
+
+    // Send a file, if requested
+    if (SendFilePath != NULL) {
+        wchar_t path[MAX_PATH];
+        if (MultiByteToWideChar(CP_ACP, 0, SendFilePath, -1, path, MAX_PATH) == 0 || !SendFileStart(Target, path)) {
+            ExitWithError("Opening the file to send,", true);
+        }
+    }
+
+    // Received data is written to the console at most MaxFps times a second, so a flood of small reads becomes 
+    // a few large console writes. The first data after a quiet spell is written straight away, as is a full FLUSH_SIZE.
+    LONG64 frame_ticks = (MaxFps > 0) ? QpcFrequency / MaxFps : 0;
+    LONG64 last_flush = 0;
+    DWORD flush_size = (DWORD)min(FLUSH_SIZE, Target->rx.size / 2);
+    LONG64 held_deadline = 0;
+
+    // Typed data that didn't fit in the TX ring waits here, so the console thread never blocks on the port
+    static char tx_hold[TX_HOLD_SIZE];
+    DWORD tx_hold_len = 0;
+
+    // While pasting, stdin is only read when the TX ring has room for a decent block
+    DWORD paste_min_free = (DWORD)min(PASTE_MIN_FREE, Target->tx.size / 2);
 
-    // Main loop. Copy the data from stdin to the serial port, and from the serial port to stdout.
+    // Main loop (the console thread). Copy the data from stdin to the target port's TX ring, and from the RX rings
+    // to stdout. We block until the console has input or the RX thread has passed us data, rather than polling.
     while (1) {        
-        // Read stdin
-        char buf[BUF_SIZE];
-        DWORD bytes_stdin = ReadStdin(stdin_h, buf, BUF_SIZE);   
+        // Wait on stdin unless a paste is waiting for the port to catch up, and on TX space while anything is
+        // waiting for it
+        bool stdin_open = !Paste.active || (tx_hold_len == 0 && RingFree(&Target->tx) >= paste_min_free);
+        HANDLE wait_h[4];
+        DWORD wait_count = 0;
+        if (stdin_open) {
+            wait_h[wait_count++] = stdin_h;
+        }
+        wait_h[wait_count++] = RxReady;
+        if (tx_hold_len > 0 || Paste.active) {
+            wait_h[wait_count++] = Target->tx.space_event;
+        }
+        if (Sending.view != NULL) {
+            wait_h[wait_count++] = Sending.done_event;
+        }
+
+        // Don't sleep past the next console write that's due, the deadline for a held hotkey or a held line, or
+        // the next paste progress update
+        DWORD timeout = INFINITE;
+        if (StdinHotkeys.held_len > 0) {
+            timeout = min(timeout, MsUntil(held_deadline));
+        }
+        LONG64 held_due;
+        if (RxPending(&held_due) > 0) {
+            timeout = min(timeout, MsUntil(last_flush + frame_ticks));
+        }
+        if (held_due != 0) {
+            timeout = min(timeout, MsUntil(held_due));
+        }
+        if (Paste.active) {
+            timeout = min(timeout, MsUntil(Paste.last_progress + PASTE_PROGRESS * QpcFrequency / 1000));
+        }
+        if (StatusLine) {
+            timeout = min(timeout, MsUntil(StatsTime + STATS_INTERVAL * QpcFrequency / 1000));
+        }
+        DWORD wait_result = WaitForMultipleObjects(wait_count, wait_h, FALSE, timeout);
+        if (wait_result == WAIT_FAILED) {
+            ExitWithError("WaitForMultipleObjects", true);
+        }
+        ConsoleWakeups++;
+
+        // Move held input into the TX ring, as space frees up
+        if (tx_hold_len > 0) {
+            DWORD pushed = RingPush(&Target->tx, tx_hold, tx_hold_len);
+            memmove(tx_hold, tx_hold + pushed, tx_hold_len - pushed);
+            tx_hold_len -= pushed;
+        }
+
+        // Read stdin. Checked each time we wake, so a busy serial port can't starve the keyboard.
+        // During a paste, read no more than the TX ring can take, so nothing needs holding or dropping.
+        static char buf[STDIN_BUF_SIZE];
+        DWORD bytes_stdin = 0;
+        LONG64 stdin_time = 0;
+        if (stdin_open && WaitForSingleObject(stdin_h, 0) == WAIT_OBJECT_0) {
+            DWORD buf_size = Paste.active ? min(STDIN_BUF_SIZE, RingFree(&Target->tx)) : STDIN_BUF_SIZE;
+            bytes_stdin = ReadStdin(stdin_h, buf, buf_size);   
+            stdin_time = Now();
+            if (StdinHotkeys.held_len > 0 && held_deadline == 0) {
+                held_deadline = stdin_time + HOTKEY_TIMEOUT * QpcFrequency / 1000;
+            }
+            if (StdinBurst) {
+                PasteBegin(false);
+            }
+            if (Paste.active) {
+                Paste.queued += bytes_stdin;
+            }
+        }
+        else if (stdin_open && Paste.active && !Paste.bracketed) {
+            // The console has run dry, so the pasted burst is over
+            Paste.input_done = true;
+        }
+        else if (StdinHotkeys.held_len > 0 && MsUntil(held_deadline) == 0) {
+            // The rest of the hotkey didn't arrive, so send what we held
+            bytes_stdin = FlushHotkeys(&StdinHotkeys, buf);
+            stdin_time = Now();
+        }
+        if (StdinHotkeys.held_len == 0) {
+            held_deadline = 0;
+        }
        
         // If we read anything from stdin, process it
         if (bytes_stdin > 0) {                  
             DWORD bytes_written = 0;
 
-            // Echo read characters back in hex, if requested (--debug-input)          
-            if (DebugInput) {
-                for (DWORD i = 0; i < bytes_stdin; i++) {
-                    printf("[%02X]", buf[i]);
-                }
+            // Echo read characters back in hex, if requested (--debug-input, --hex-dump)
+            if (DebugInput || HexDump) {
+                WriteHex(stdout_h, "TX", TxOffset, buf, bytes_stdin);
             }
+            TxOffset += bytes_stdin;
             
             // Echo read characters back to console (local echo)  
             if (LocalEcho) {
@@ -423,35 +7412,91 @@ int main(int argc, char* argv[]) {
                 }
             }
 
-            // Write to serial port
-            if (WriteFile(port_h, buf, bytes_stdin, &bytes_written, NULL) == 0) {
-                ExitWithError("WriteFile(port_h)", true);
+            // Queue for the serial port. If the TX thread is a whole ring behind, hold the rest.
+            // If the port has stopped taking data altogether and the hold fills too, typing is thrown away
+            // (hotkeys still work).
+            DWORD pushed = (tx_hold_len == 0) ? RingPush(&Target->tx, buf, bytes_stdin) : 0;
+            if (pushed < bytes_stdin) {
+                DWORD hold = min(bytes_stdin - pushed, TX_HOLD_SIZE - tx_hold_len);
+                memcpy(tx_hold + tx_hold_len, buf + pushed, hold);
+                tx_hold_len += hold;
+                if (pushed + hold < bytes_stdin) {
+                    if (TxDropped == 0) {
+                        fprintf(stderr, "\nWARNING: Serial port isn't taking data. Typed data is being discarded.\n");
+                    }
+                    TxDropped += bytes_stdin - pushed - hold;
+                }
+            }
+            if (tx_hold_len == 0) {
+                RingMark(&Target->tx, Target->tx.head, stdin_time);
+            }
+            if (LogSent) {
+                LogWrite(&SessionLog, buf, bytes_stdin);
+            }
+            CaptureWrite(&SessionCapture, CAP_TX, (BYTE)(Target - Ports), stdin_time, buf, bytes_stdin);
+        }
+
+        // Ask for a file to send (send-file hotkey), or cancel the one being sent. Report when a send is done.
+        if (Sending.requested) {
+            Sending.requested = false;
+            if (Sending.view != NULL) {
+                InterlockedExchange(&Sending.cancel, 1);
+                SetEvent(Sending.prompt_event);     // Don't wait out a prompt
             }
-            if (bytes_written != bytes_stdin) {
-                ExitWithError("Timed out writing to serial port.", false);
+            else {
+                PromptSendFile(stdin_h, Target);
             }
         }
+        if (Sending.view != NULL && ReadAcquire(&Sending.active) == 0) {
+            SendFileFinish();
+        }
 
-        // Read serial port
-        DWORD bytes_read = 0;
-        if (ReadFile(port_h, &buf, BUF_SIZE, &bytes_read, NULL) == 0) {
-            ExitWithError("ReadFile(port_h)", true);
+        // Upload or download a file (upload/download hotkeys)
+        if (Xfer.requested != 0) {
+            bool receiving = (Xfer.requested == 2);
+            Xfer.requested = 0;
+            PromptTransfer(stdin_h, Target, receiving);
         }
-        
-        // If we read anything from the serial port, process it
-        if (bytes_read > 0) {                             
-            // Write read data to stdout
-            DWORD bytes_written = 0;
-            if (WriteConsoleA(stdout_h, buf, bytes_read, &bytes_written, NULL) == 0) {
-                ExitWithError("WriteFile(stdout_h)", true);
+
+        // Switch the port that typing goes to (next-port hotkey). Held typing, a paste or a file have to finish first.
+        if (TargetRequested) {
+            TargetRequested = false;
+            if (tx_hold_len > 0 || Paste.active || Sending.view != NULL) {
+                fprintf(stderr, "\nWait for the paste or file being sent to finish first.\n");
+            }
+            else if (PortCount > 1) {
+                Target = &Ports[(Target - Ports + 1) % PortCount];
+                fprintf(stderr, "\nTyping goes to %s.\n", Target->name);
             }
-            if (bytes_written != bytes_read) {
-                fprintf(stderr, "\nWARNING: WriteFile(stdout_h) failed to write all available bytes (req: %u, written: %u).\n", bytes_read, bytes_written);
+            LineOwner = NULL;
+        }
+
+        // Show paste progress, and finish the paste once it has all gone to the port
+        if (Paste.active) {
+            if (Paste.input_done && tx_hold_len == 0 && RingUsed(&Target->tx) == 0) {
+                PasteProgress(true);
             }
+            else if (MsUntil(Paste.last_progress + PASTE_PROGRESS * QpcFrequency / 1000) == 0) {
+                PasteProgress(false);
+            }
+        }
+
+        // Measure throughput, and update the status line (status hotkey) unless the title is showing progress
+        if (SampleStats() && StatusLine && !Paste.active && Sending.view == NULL) {
+            ShowStatus();
         }
 
-        // Sleep until we start the loop again
-        Sleep(SLEEP_TIME);
+        // Write what the RX thread has passed us to stdout, if a write is due. An unfinished line being held back
+        // (with several ports) only counts once it's due.
+        DWORD pending = RxPending(&held_due);
+        bool held_now = (held_due != 0 && MsUntil(held_due) == 0);
+        if (!held_now && (pending == 0 || (pending < flush_size && MsUntil(last_flush + frame_ticks) > 0))) {
+            continue;
+        }
+        last_flush = Now();
+        for (DWORD i = 0; i < PortCount; i++) {
+            ShowRx(stdout_h, &Ports[i]);
+        }
     }
 
     return 0;